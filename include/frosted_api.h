@@ -25,6 +25,16 @@
 #define O_NONBLOCK	000040000
 
 
+/* mmap */
+#define PROT_NONE  0x00
+#define PROT_READ  0x01
+#define PROT_WRITE 0x02
+#define PROT_EXEC  0x04
+
+#define MAP_SHARED  0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FAILED  ((void *)-1)
+
 /* seek */
 #define SEEK_SET 0
 #define SEEK_CUR 1
@@ -55,6 +65,23 @@ struct dirent {
     char d_name[MAX_FILE];
 };
 
+/* getdents: variable-length records, d_reclen bytes each (4-byte aligned) */
+#define DT_UNKNOWN 0
+#define DT_CHR     2
+#define DT_DIR     4
+#define DT_BLK     6
+#define DT_REG     8
+#define DT_LNK     10
+#define DT_SOCK    12
+
+struct dirent_ext {
+    uint32_t d_ino;
+    uint32_t d_size;    /* File size, 0 for directories */
+    uint16_t d_reclen;
+    uint8_t  d_type;
+    char     d_name[];  /* Null-terminated */
+};
+
 /*
 #define S_IFMT     0170000   // bit mask for the file type bit fields
 #define P_IFMT     0000007   // bit mask for file permissions
@@ -85,6 +112,80 @@ struct sockaddr_env {
     unsigned int se_len;
 };
 
+/* Socket level options, for all the families */
+#define SOL_SOCKET 0x80
+
+/* UNIX sockets: credentials of the peer, with getsockopt(SO_PEERCRED).
+ * There are no users: uid and gid are always 0. */
+#define SO_PEERCRED 17
+
+struct ucred {
+    int pid;
+    int uid;
+    int gid;
+};
+
+/* epoll */
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN     0x001
+#define EPOLLPRI    0x002
+#define EPOLLOUT    0x004
+#define EPOLLERR    0x008
+#define EPOLLHUP    0x010
+#define EPOLLET     (1u << 31)
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+};
+
+/* Asynchronous I/O */
+struct aiocb {
+    int aio_fildes;
+    uint32_t aio_offset;        /* Seekable files only */
+    volatile void *aio_buf;
+    uint32_t aio_nbytes;
+    int aio_reqprio;            /* Not supported */
+    /* Private, set by the kernel */
+    int __error;
+    int __return;
+};
+
+/* futex */
+#define FUTEX_WAIT  0
+#define FUTEX_WAKE  1
+
+/* Message queues */
+#define MQ_PRIO_MAX 32
+
+/* eventfd */
+#define EFD_SEMAPHORE   0x01
+#define EFD_NONBLOCK    O_NONBLOCK
+
+#ifndef __frosted__
+struct mq_attr {
+    long mq_flags;
+    long mq_maxmsg;
+    long mq_msgsize;
+    long mq_curmsgs;
+};
+#endif
+
+/* readv - writev */
+struct iovec {
+    void *iov_base;
+    uint32_t iov_len;
+};
+
 extern int errno;
 
 #endif
@@ -0,0 +1,159 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#ifndef FROSTED_LOCKS_H
+#define FROSTED_LOCKS_H
+
+/* Userspace locks, built on the futex syscall.
+ *
+ * The lock word is updated with LDREX/STREX (GCC atomic builtins): an
+ * uncontended lock or unlock takes a few instructions, and no syscall.
+ * The kernel is only entered to sleep when the lock is taken, and to
+ * wake up the sleepers on unlock.
+ *
+ * The words can live in memory shared by several processes (e.g. a
+ * segment from shm_open()), since futexes are keyed by address.
+ */
+
+#include "frosted_api.h"
+#include <errno.h>
+
+/* Provided by the C library */
+int futex(volatile int *uaddr, int op, int val, int timeout);
+
+#define FLOCK_INITIALIZER    { 0 }
+#define FCOND_INITIALIZER    { 0 }
+
+/* Mutex: 0 unlocked, 1 locked, 2 locked with (possible) sleepers */
+typedef struct {
+    volatile int val;
+} flock_t;
+
+typedef struct {
+    volatile int seq;
+} fcond_t;
+
+typedef struct {
+    volatile int phase;
+    volatile int waiting;
+    int count;
+} fbarrier_t;
+
+static inline int __flock_cas(volatile int *p, int old, int new)
+{
+    __atomic_compare_exchange_n(p, &old, new, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return old;
+}
+
+static inline void flock_init(flock_t *l)
+{
+    l->val = 0;
+}
+
+static inline int flock_trylock(flock_t *l)
+{
+    return (__flock_cas(&l->val, 0, 1) == 0) ? 0 : -1;
+}
+
+static inline void flock_lock(flock_t *l)
+{
+    int c = __flock_cas(&l->val, 0, 1);
+    if (c == 0)
+        return;
+    /* Contended: mark it, and sleep until it is released */
+    if (c != 2)
+        c = __atomic_exchange_n(&l->val, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex(&l->val, FUTEX_WAIT, 2, -1);
+        c = __atomic_exchange_n(&l->val, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void flock_unlock(flock_t *l)
+{
+    if (__atomic_fetch_sub(&l->val, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&l->val, 0, __ATOMIC_RELEASE);
+        futex(&l->val, FUTEX_WAKE, 1, 0);
+    }
+}
+
+/* Condition variable: sleepers wait for the sequence number to change */
+static inline void fcond_init(fcond_t *c)
+{
+    c->seq = 0;
+}
+
+/* Returns 0, or -1 if 'timeout' (ms, negative: forever) expired.
+ * As with pthreads, wakeups can be spurious. */
+static inline int fcond_timedwait(fcond_t *c, flock_t *l, int timeout)
+{
+    int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    int ret;
+    flock_unlock(l);
+    ret = futex(&c->seq, FUTEX_WAIT, seq, timeout);
+    /* Other tasks may be woken up too: relock as contended */
+    while (__atomic_exchange_n(&l->val, 2, __ATOMIC_ACQUIRE) != 0)
+        futex(&l->val, FUTEX_WAIT, 2, -1);
+    if ((ret == -ETIMEDOUT) || ((ret == -1) && (errno == ETIMEDOUT)))
+        return -1;
+    return 0;
+}
+
+static inline void fcond_wait(fcond_t *c, flock_t *l)
+{
+    fcond_timedwait(c, l, -1);
+}
+
+static inline void fcond_signal(fcond_t *c)
+{
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex(&c->seq, FUTEX_WAKE, 1, 0);
+}
+
+static inline void fcond_broadcast(fcond_t *c)
+{
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex(&c->seq, FUTEX_WAKE, 0x7FFFFFFF, 0);
+}
+
+/* Barrier for 'count' tasks */
+static inline void fbarrier_init(fbarrier_t *b, int count)
+{
+    b->phase = 0;
+    b->waiting = 0;
+    b->count = count;
+}
+
+/* Returns 1 in one of the tasks (the last to arrive), 0 in the others */
+static inline int fbarrier_wait(fbarrier_t *b)
+{
+    int phase = __atomic_load_n(&b->phase, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&b->waiting, 1, __ATOMIC_ACQ_REL) == b->count) {
+        __atomic_store_n(&b->waiting, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&b->phase, 1, __ATOMIC_RELEASE);
+        futex(&b->phase, FUTEX_WAKE, 0x7FFFFFFF, 0);
+        return 1;
+    }
+    while (__atomic_load_n(&b->phase, __ATOMIC_ACQUIRE) == phase)
+        futex(&b->phase, FUTEX_WAIT, phase, -1);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+
+/* Block buffer cache.
+ *
+ * Sector-sized buffers shared by all the filesystems, kept in LRU order
+ * (most recently used first). Buffers are allocated on demand, up to
+ * CONFIG_BCACHE_SECTORS, and recycled from the tail of the list.
+ *
+ * A buffer returned by bcache_get() is pinned, and will not be evicted
+ * until released with bcache_put(). Writes are kept in the cache
+ * (write-back) until bcache_sync() or eviction.
+ *
+ * Callers are syscall handlers, which never run concurrently.
+ */
+
+#ifndef CONFIG_BCACHE_SECTORS
+#   define CONFIG_BCACHE_SECTORS 16
+#endif
+
+#define MAX_SYSFS_BUFFER 256
+
+static struct bcache_buf *bcache_lru = NULL;
+static struct bcache_buf *bcache_lru_tail = NULL;
+static int bcache_n_bufs = 0;
+
+static struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;
+    uint32_t uncached;
+} bcache_stats;
+
+static void lru_del(struct bcache_buf *b)
+{
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        bcache_lru = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        bcache_lru_tail = b->prev;
+    b->prev = b->next = NULL;
+}
+
+static void lru_add_head(struct bcache_buf *b)
+{
+    b->prev = NULL;
+    b->next = bcache_lru;
+    if (bcache_lru)
+        bcache_lru->prev = b;
+    bcache_lru = b;
+    if (!bcache_lru_tail)
+        bcache_lru_tail = b;
+}
+
+static int bcache_writeback(struct bcache_buf *b)
+{
+    struct module *mod = b->dev->owner;
+    if (!(b->flags & BCACHE_DIRTY))
+        return 0;
+    if (!mod || !mod->ops.block_write)
+        return -1;
+    if (mod->ops.block_write(b->dev, b->data, b->sector, 0, BCACHE_SECTOR_SIZE) != 0)
+        return -1;
+    b->flags &= ~BCACHE_DIRTY;
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+static struct bcache_buf *bcache_lookup(struct fnode *dev, uint32_t sector)
+{
+    struct bcache_buf *b = bcache_lru;
+    while (b) {
+        if ((b->dev == dev) && (b->sector == sector) && (b->flags & BCACHE_VALID))
+            return b;
+        b = b->next;
+    }
+    return NULL;
+}
+
+/* Returns an unused buffer: a new one, or the least recently used
+ * buffer that is not pinned. */
+static struct bcache_buf *bcache_alloc(void)
+{
+    struct bcache_buf *b;
+
+    if (bcache_n_bufs < CONFIG_BCACHE_SECTORS) {
+        b = kcalloc(sizeof(struct bcache_buf), 1);
+        if (b) {
+            bcache_n_bufs++;
+            lru_add_head(b);
+            return b;
+        }
+    }
+
+    b = bcache_lru_tail;
+    while (b) {
+        if ((b->pin == 0) && (bcache_writeback(b) == 0))
+            break;
+        b = b->prev;
+    }
+    if (!b)
+        return NULL;
+    if (b->flags & BCACHE_VALID)
+        bcache_stats.evictions++;
+    b->flags = 0;
+    lru_del(b);
+    lru_add_head(b);
+    return b;
+}
+
+/* Pins the buffer for (dev, sector). Unless 'noread' is set, the buffer
+ * contents are read from the device on a miss. */
+static struct bcache_buf *bcache_get_buf(struct fnode *dev, uint32_t sector, int noread)
+{
+    struct bcache_buf *b;
+    struct module *mod = dev->owner;
+
+    b = bcache_lookup(dev, sector);
+    if (b) {
+        bcache_stats.hits++;
+        if (b != bcache_lru) {
+            lru_del(b);
+            lru_add_head(b);
+        }
+        b->pin++;
+        return b;
+    }
+
+    if (!mod || !mod->ops.block_read)
+        return NULL;
+    b = bcache_alloc();
+    if (!b)
+        return NULL;
+    bcache_stats.misses++;
+    b->dev = dev;
+    b->sector = sector;
+    if (!noread && (mod->ops.block_read(dev, b->data, sector, 0, BCACHE_SECTOR_SIZE) != 0))
+        return NULL;
+    b->flags = BCACHE_VALID;
+    b->pin = 1;
+    return b;
+}
+
+struct bcache_buf *bcache_get(struct fnode *dev, uint32_t sector)
+{
+    return bcache_get_buf(dev, sector, 0);
+}
+
+void bcache_put(struct bcache_buf *b)
+{
+    if (b && b->pin > 0)
+        b->pin--;
+}
+
+void bcache_dirty(struct bcache_buf *b)
+{
+    b->flags |= BCACHE_DIRTY;
+}
+
+/* Same semantics as ops.block_read: 0 on success */
+int bcache_read(struct fnode *dev, void *buf, uint32_t sector, int offset, int count)
+{
+    struct bcache_buf *b;
+    struct module *mod = dev->owner;
+
+    if ((offset < 0) || (count < 0) || (offset + count > BCACHE_SECTOR_SIZE))
+        return -1;
+
+    b = bcache_get(dev, sector);
+    if (!b) {
+        /* All buffers pinned: bypass the cache */
+        if (!mod || !mod->ops.block_read)
+            return -1;
+        bcache_stats.uncached++;
+        return mod->ops.block_read(dev, buf, sector, offset, count);
+    }
+    memcpy(buf, b->data + offset, count);
+    bcache_put(b);
+    return 0;
+}
+
+/* Reads 'count' whole sectors into buf, e.g. a contiguous run of file
+ * clusters. Cached copies are used when present; the other sectors are
+ * read from the device straight into buf, without evicting anything. */
+int bcache_read_blocks(struct fnode *dev, void *buf, uint32_t sector, uint32_t count)
+{
+    struct bcache_buf *b;
+    struct module *mod = dev->owner;
+    uint8_t *p = buf;
+    uint32_t i;
+
+    if (!mod || !mod->ops.block_read)
+        return -1;
+    for (i = 0; i < count; i++) {
+        b = bcache_lookup(dev, sector + i);
+        if (b) {
+            bcache_stats.hits++;
+            memcpy(p, b->data, BCACHE_SECTOR_SIZE);
+        } else {
+            bcache_stats.uncached++;
+            if (mod->ops.block_read(dev, p, sector + i, 0, BCACHE_SECTOR_SIZE) != 0)
+                return -1;
+        }
+        p += BCACHE_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Same semantics as ops.block_write: 0 on success.
+ * Data reaches the device on bcache_sync() or eviction. */
+int bcache_write(struct fnode *dev, const void *buf, uint32_t sector, int offset, int count)
+{
+    struct bcache_buf *b;
+    struct module *mod = dev->owner;
+
+    if ((offset < 0) || (count < 0) || (offset + count > BCACHE_SECTOR_SIZE))
+        return -1;
+    if (!mod || !mod->ops.block_write)
+        return -1;
+
+    /* Whole sectors are not read in first */
+    b = bcache_get_buf(dev, sector, (count == BCACHE_SECTOR_SIZE));
+    if (!b) {
+        bcache_stats.uncached++;
+        return mod->ops.block_write(dev, buf, sector, offset, count);
+    }
+    memcpy(b->data + offset, buf, count);
+    bcache_dirty(b);
+    bcache_put(b);
+    return 0;
+}
+
+/* Writes back all the dirty buffers of dev (all devices if NULL) */
+int bcache_sync(struct fnode *dev)
+{
+    struct bcache_buf *b = bcache_lru;
+    int ret = 0;
+    while (b) {
+        if ((!dev || (b->dev == dev)) && (b->flags & BCACHE_VALID)) {
+            if (bcache_writeback(b) != 0)
+                ret = -1;
+        }
+        b = b->next;
+    }
+    return ret;
+}
+
+/* Drops the buffers of dev, e.g. when a volume is mounted on it (the
+ * media may have changed). Dirty buffers are lost. */
+void bcache_invalidate(struct fnode *dev)
+{
+    struct bcache_buf *b = bcache_lru;
+    while (b) {
+        if ((b->dev == dev) && (b->pin == 0))
+            b->flags = 0;
+        b = b->next;
+    }
+}
+
+#ifdef CONFIG_SYSFS
+static int bcache_append(char *txt, int off, const char *label, uint32_t n)
+{
+    int l = strlen(label);
+    if (off + l + 14 >= MAX_SYSFS_BUFFER)
+        return off;
+    strcpy(txt + off, label);
+    off += l;
+    off += ul_to_str(n, txt + off);
+    strcpy(txt + off, "\r\n");
+    return off + 2;
+}
+
+static int sysfs_bcache_read(struct sysfs_fnode *sfs, void *buf, int len)
+{
+    char *res = (char *)buf;
+    struct fnode *fno = sfs->fnode;
+    static char *txt;
+    static int off;
+    if (fno->off == 0) {
+        struct bcache_buf *b;
+        uint32_t dirty = 0, pinned = 0;
+        sysfs_lock();
+        txt = kalloc(MAX_SYSFS_BUFFER);
+        if (!txt) {
+            sysfs_unlock();
+            return -1;
+        }
+        for (b = bcache_lru; b; b = b->next) {
+            if (b->flags & BCACHE_DIRTY)
+                dirty++;
+            if (b->pin)
+                pinned++;
+        }
+        off = 0;
+        off = bcache_append(txt, off, "Buffers: ", bcache_n_bufs);
+        off = bcache_append(txt, off, "Max buffers: ", CONFIG_BCACHE_SECTORS);
+        off = bcache_append(txt, off, "Dirty: ", dirty);
+        off = bcache_append(txt, off, "Pinned: ", pinned);
+        off = bcache_append(txt, off, "Hits: ", bcache_stats.hits);
+        off = bcache_append(txt, off, "Misses: ", bcache_stats.misses);
+        off = bcache_append(txt, off, "Evictions: ", bcache_stats.evictions);
+        off = bcache_append(txt, off, "Writebacks: ", bcache_stats.writebacks);
+        off = bcache_append(txt, off, "Uncached: ", bcache_stats.uncached);
+    }
+    if (off == fno->off) {
+        kfree(txt);
+        sysfs_unlock();
+        return -1;
+    }
+    if (len > (off - fno->off)) {
+       len = off - fno->off;
+    }
+    memcpy(res, txt + fno->off, len);
+    fno->off += len;
+    return len;
+}
+
+/* Writing anything to /sys/bcache resets the statistics */
+static int sysfs_bcache_write(struct sysfs_fnode *sfs, const void *buf, int len)
+{
+    memset(&bcache_stats, 0, sizeof(bcache_stats));
+    return len;
+}
+#endif
+
+void bcache_init(void)
+{
+#ifdef CONFIG_SYSFS
+    sysfs_register("bcache", "/sys", sysfs_bcache_read, sysfs_bcache_write);
+#endif
+}
@@ -22,16 +22,39 @@
 #include "cirbuf.h"
 #include "errno.h"
 
+/* Single-producer, single-consumer ring buffer.
+ *
+ * The size is a power of two. 'head' and 'tail' are free-running
+ * counters, masked on access: head - tail is the number of bytes in use,
+ * so the whole buffer is usable.
+ *
+ * The producer only writes 'head', the consumer only writes 'tail'. One
+ * of the two can run in an ISR while the other runs in a task, without
+ * masking interrupts: the barriers make sure that the data is in place
+ * before 'head' is published, and read before 'tail' gives it back.
+ */
+
 struct cirbuf {
     uint8_t *buf;
-    uint8_t *readptr;
-    uint8_t *writeptr;
-    int     bufsize;
+    uint32_t mask;              /* size - 1 */
+    volatile uint32_t head;     /* Producer: next byte to write */
+    volatile uint32_t tail;     /* Consumer: next byte to read */
 };
 
+#define cirbuf_barrier() __sync_synchronize()
+
+static uint32_t cirbuf_roundup(int size)
+{
+    uint32_t sz = 2;
+    while (sz < (uint32_t)size)
+        sz <<= 1;
+    return sz;
+}
+
 struct cirbuf * cirbuf_create(int size)
 {
     struct cirbuf* inbuf;
+    uint32_t sz;
     if (size <= 0) 
         return NULL;
 
@@ -39,142 +62,204 @@ struct cirbuf * cirbuf_create(int size)
     if (!inbuf)
         return NULL;
 
-    inbuf->buf = kalloc(size);
+    sz = cirbuf_roundup(size);
+    inbuf->buf = kalloc(sz);
     if (!inbuf->buf)
     {
         kfree(inbuf);
         return NULL;
     }
 
-    inbuf->bufsize = size;
-    inbuf->readptr = inbuf->buf;
-    inbuf->writeptr = inbuf->buf;
+    inbuf->mask = sz - 1;
+    inbuf->head = 0;
+    inbuf->tail = 0;
     return inbuf;
 }
 
+void cirbuf_destroy(struct cirbuf *cb)
+{
+    if (!cb)
+        return;
+    kfree(cb->buf);
+    kfree(cb);
+}
+
 /* 0 on success, -1 on fail */
 int cirbuf_writebyte(struct cirbuf *cb, uint8_t byte)
 {
+    uint32_t head;
     if (!cb)
         return -1;
 
-    /* check if there is space */
-    if (!cirbuf_bytesfree(cb))
+    head = cb->head;
+    if ((head - cb->tail) > cb->mask)
         return -1;
-
-    *cb->writeptr = byte;
-    cb->writeptr++;
-
-    /* wrap if needed */
-    if (cb->writeptr > (cb->buf + cb->bufsize - 1u))
-        cb->writeptr = cb->buf;
-
+    cirbuf_barrier();
+    cb->buf[head & cb->mask] = byte;
+    cirbuf_barrier();
+    cb->head = head + 1;
     return 0;
 }
 
 /* 0 on success, -1 on fail */
 int cirbuf_readbyte(struct cirbuf *cb, uint8_t *byte)
 {
+    uint32_t tail;
     if (!cb || !byte)
         return -1;
 
-    /* check if there is data */
-    if (!cirbuf_bytesinuse(cb))
+    tail = cb->tail;
+    if (cb->head == tail)
         return -1;
+    cirbuf_barrier();
+    *byte = cb->buf[tail & cb->mask];
+    cirbuf_barrier();
+    cb->tail = tail + 1;
+    return 0;
+}
 
-    *byte = *cb->readptr++;
+/* Contiguous data at the tail: up to the end of the buffer */
+int cirbuf_peek(struct cirbuf *cb, uint8_t **ptr)
+{
+    uint32_t tail, len, to_end;
+    if (!cb || !ptr)
+        return -1;
 
-    /* wrap if needed */
-    if (cb->readptr > (cb->buf + cb->bufsize - 1u))
-        cb->readptr = cb->buf;
+    tail = cb->tail;
+    len = cb->head - tail;
+    cirbuf_barrier();
+    to_end = (cb->mask + 1) - (tail & cb->mask);
+    if (len > to_end)
+        len = to_end;
+    *ptr = cb->buf + (tail & cb->mask);
+    return len;
+}
 
-    return 0;
+/* Gives back 'len' bytes returned by cirbuf_peek() */
+void cirbuf_consume(struct cirbuf *cb, int len)
+{
+    cirbuf_barrier();
+    cb->tail += len;
 }
 
+/* Contiguous free space at the head: up to the end of the buffer */
+int cirbuf_write_reserve(struct cirbuf *cb, uint8_t **ptr)
+{
+    uint32_t head, len, to_end;
+    if (!cb || !ptr)
+        return -1;
+
+    head = cb->head;
+    len = (cb->mask + 1) - (head - cb->tail);
+    cirbuf_barrier();
+    to_end = (cb->mask + 1) - (head & cb->mask);
+    if (len > to_end)
+        len = to_end;
+    *ptr = cb->buf + (head & cb->mask);
+    return len;
+}
+
+/* Publishes 'len' bytes written in the space from cirbuf_write_reserve() */
+void cirbuf_write_commit(struct cirbuf *cb, int len)
+{
+    cirbuf_barrier();
+    cb->head += len;
+}
+
+/* len on success, -1 on fail */
 int cirbuf_readbytes(struct cirbuf *cb, void *bytes, int len)
 {
-    int buflen;
-    int i;
-    char *dst = bytes;
+    uint8_t *dst = bytes;
+    uint8_t *src;
+    int out = 0, n;
     if (!cb || !bytes)
         return -1;
 
     /* check if there is data */
-    buflen = cirbuf_bytesinuse(cb);
-    if (buflen == 0)
+    if (cirbuf_bytesinuse(cb) == 0)
         return -1;
-    if (len > buflen)
-        len = buflen;
-
-    for (i = 0; i < len; i++) {
-        dst[i] = *(cb->readptr++);
-        /* wrap if needed */
-        if (cb->readptr > (cb->buf + cb->bufsize - 1u))
-            cb->readptr = cb->buf;
+
+    /* At most two copies: up to the end of the buffer, then from the start */
+    while (out < len) {
+        n = cirbuf_peek(cb, &src);
+        if (n <= 0)
+            break;
+        if (n > (len - out))
+            n = len - out;
+        memcpy(dst + out, src, n);
+        cirbuf_consume(cb, n);
+        out += n;
     }
-    return len;
+    return out;
 }
 
 /* written len on success, 0 on fail */
 int cirbuf_writebytes(struct cirbuf *cb, uint8_t * bytes, int len)
 {
-    uint8_t byte;
-    int freesize;
-    int tot_len = len;
+    uint8_t *dst;
+    int out = 0, n;
     if (!cb)
         return 0;
 
-    /* check if there is space */
-    freesize = cirbuf_bytesfree(cb);
-    if (!freesize)
-        return 0;
-    if (freesize < len) {
-        len = freesize;
-        tot_len = freesize;
-    }
-
-    /* Wrap needed ? */
-    if ((cb->writeptr + len) > (cb->buf + cb->bufsize) - 1u)
-    {
-        int len_first_part = cb->buf + cb->bufsize - cb->writeptr; /* end - current position */
-        memcpy(cb->writeptr, bytes, len_first_part);
-        bytes += len_first_part;
-        cb->writeptr = cb->buf; /* set to start of buffer */
-        len -= len_first_part;
+    while (out < len) {
+        n = cirbuf_write_reserve(cb, &dst);
+        if (n <= 0)
+            break;
+        if (n > (len - out))
+            n = len - out;
+        memcpy(dst, bytes + out, n);
+        cirbuf_write_commit(cb, n);
+        out += n;
     }
-    /* write remaining part */
-    if (len)
-    {
-        memcpy(cb->writeptr, bytes, len);
-        cb->writeptr += len;
-    }
-
-    return tot_len;
+    return out;
 }
 
 int cirbuf_bytesfree(struct cirbuf *cb)
 {
-    int bytes;
     if (!cb)
         return -1;
-
-    bytes = (int)(cb->readptr - cb->writeptr - 1);
-    if (cb->writeptr >= cb->readptr)
-        bytes += cb->bufsize;
-
-    return bytes;
+    return (cb->mask + 1) - (cb->head - cb->tail);
 }
 
 int cirbuf_bytesinuse(struct cirbuf *cb)
 {
-    int bytes;
     if (!cb)
         return -1;
+    return cb->head - cb->tail;
+}
 
-    bytes = (int)(cb->writeptr - cb->readptr);
-    if (cb->writeptr < cb->readptr)
-        bytes += cb->bufsize;
-
-    return (bytes);
+/* Number of bytes the buffer can hold */
+int cirbuf_capacity(struct cirbuf *cb)
+{
+    if (!cb)
+        return -1;
+    return cb->mask + 1;
 }
 
+/* Changes the capacity (rounded up to a power of two), keeping the
+ * contents. Neither the producer nor the consumer may run meanwhile.
+ * 0 on success, -1 on fail (contents would not fit, or out of memory) */
+int cirbuf_resize(struct cirbuf *cb, int size)
+{
+    uint8_t *newbuf;
+    uint32_t sz;
+    int inuse;
+
+    if (!cb || (size <= 0))
+        return -1;
+    sz = cirbuf_roundup(size);
+    inuse = cirbuf_bytesinuse(cb);
+    if (inuse > sz)
+        return -1;
+    newbuf = kalloc(sz);
+    if (!newbuf)
+        return -1;
+    if (inuse > 0)
+        cirbuf_readbytes(cb, newbuf, inuse);
+    kfree(cb->buf);
+    cb->buf = newbuf;
+    cb->mask = sz - 1;
+    cb->tail = 0;
+    cb->head = inuse;
+    return 0;
+}
@@ -5,17 +5,31 @@
 
 struct cirbuf;
 
+/* Lock-free with one producer and one consumer (see cirbuf.c).
+ * The size is rounded up to a power of two. */
 struct cirbuf * cirbuf_create(int size);
+void cirbuf_destroy(struct cirbuf *cb);
 /* 0 on success, -1 on fail */
 int cirbuf_writebyte(struct cirbuf *cb, uint8_t byte);
 /* 0 on success, -1 on fail */
 int cirbuf_readbyte(struct cirbuf *cb, uint8_t *byte);
-/* len on success, -1 on fail */
+/* written len on success, 0 on fail */
 int cirbuf_writebytes(struct cirbuf *cb, uint8_t * bytes, int len);
 
 /* len on success, -1 on fail */
 int cirbuf_readbytes(struct cirbuf *cb, void *bytes, int len);
 int cirbuf_bytesfree(struct cirbuf *cb);
 int cirbuf_bytesinuse(struct cirbuf *cb);
+int cirbuf_capacity(struct cirbuf *cb);
+/* 0 on success, -1 on fail */
+int cirbuf_resize(struct cirbuf *cb, int size);
+
+/* Zero-copy access (e.g. DMA to/from the ring).
+ * Both return the length of the contiguous region at *ptr, which may be
+ * shorter than the data/space available when it wraps around. */
+int cirbuf_peek(struct cirbuf *cb, uint8_t **ptr);
+void cirbuf_consume(struct cirbuf *cb, int len);
+int cirbuf_write_reserve(struct cirbuf *cb, uint8_t **ptr);
+void cirbuf_write_commit(struct cirbuf *cb, int len);
 
 #endif
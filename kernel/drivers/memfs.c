@@ -23,12 +23,186 @@
 
 static struct module mod_memfs;
 
+/* File contents are stored in fixed-size chunks, through a table that
+ * doubles when it is full: appending never copies the data, and writes
+ * only touch the chunks involved. Chunks never written (holes left by a
+ * seek past the end) are not allocated, and read as zeros.
+ *
+ * Released chunks are kept in a small pool for reuse, to avoid
+ * fragmenting the kernel heap with frequent create/unlink cycles.
+ *
+ * Mapped files are flattened: see memfs_mmap().
+ */
+#ifndef CONFIG_MEMFS_CHUNK_SIZE
+#   define CONFIG_MEMFS_CHUNK_SIZE 256
+#endif
+#define MEMFS_CHUNK_SIZE CONFIG_MEMFS_CHUNK_SIZE
+#define MEMFS_POOL_MAX   16
+
+struct memfs_mount {
+    struct fnode *root;
+    uint32_t used;      /* Bytes allocated for file contents */
+    uint32_t limit;     /* 0: no limit */
+    struct memfs_mount *next;
+};
 
 struct memfs_fnode {
     struct fnode *fnode;
-    uint8_t *content;
+    struct memfs_mount *mnt;
+    uint8_t **chunks;
+    uint32_t n_chunks;  /* Table size */
+    uint8_t *raw;       /* Flat contents as allocated, once mapped */
+    uint8_t *content;   /* Flat contents, aligned to cap */
+    uint32_t cap;       /* Size of the flat contents */
 };
 
+static struct memfs_mount *memfs_mounts = NULL;
+static void *memfs_chunk_pool = NULL;
+static int memfs_chunk_pool_len = 0;
+
+static int memfs_charge(struct memfs_mount *mnt, uint32_t size)
+{
+    if (mnt && mnt->limit && ((mnt->used + size) > mnt->limit))
+        return -ENOSPC;
+    if (mnt)
+        mnt->used += size;
+    return 0;
+}
+
+static void memfs_uncharge(struct memfs_mount *mnt, uint32_t size)
+{
+    if (mnt)
+        mnt->used -= size;
+}
+
+static uint8_t *memfs_chunk_alloc(struct memfs_mount *mnt)
+{
+    void *c;
+    if (memfs_charge(mnt, MEMFS_CHUNK_SIZE) < 0)
+        return NULL;
+    if (memfs_chunk_pool) {
+        c = memfs_chunk_pool;
+        memfs_chunk_pool = *((void **)c);
+        memfs_chunk_pool_len--;
+    } else {
+        c = kalloc(MEMFS_CHUNK_SIZE);
+        if (!c) {
+            memfs_uncharge(mnt, MEMFS_CHUNK_SIZE);
+            return NULL;
+        }
+    }
+    memset(c, 0, MEMFS_CHUNK_SIZE);
+    return c;
+}
+
+static void memfs_chunk_free(struct memfs_mount *mnt, uint8_t *c)
+{
+    memfs_uncharge(mnt, MEMFS_CHUNK_SIZE);
+    if (memfs_chunk_pool_len >= MEMFS_POOL_MAX) {
+        kfree(c);
+        return;
+    }
+    *((void **)c) = memfs_chunk_pool;
+    memfs_chunk_pool = c;
+    memfs_chunk_pool_len++;
+}
+
+/* Releases the contents from offset 'size' on */
+static void memfs_release(struct memfs_fnode *mfno, uint32_t size)
+{
+    uint32_t i = (size + MEMFS_CHUNK_SIZE - 1) / MEMFS_CHUNK_SIZE;
+    for (; i < mfno->n_chunks; i++) {
+        if (mfno->chunks[i]) {
+            memfs_chunk_free(mfno->mnt, mfno->chunks[i]);
+            mfno->chunks[i] = NULL;
+        }
+    }
+    /* The flat contents of a mapped file stay until it is removed */
+    if (size == 0) {
+        kfree(mfno->chunks);
+        mfno->chunks = NULL;
+        mfno->n_chunks = 0;
+    }
+}
+
+/* Contiguous area holding byte 'off' of the file. In *avail, the number
+ * of bytes from there to the end of the area. Areas not allocated yet
+ * are allocated if 'alloc' is set, otherwise NULL is returned. */
+static uint8_t *memfs_at(struct memfs_fnode *mfno, uint32_t off, int alloc, uint32_t *avail)
+{
+    uint32_t idx = off / MEMFS_CHUNK_SIZE;
+    uint32_t n;
+    uint8_t **tab;
+
+    if (mfno->content) {
+        /* Flat contents may be mapped: they never move, or grow */
+        if (off >= mfno->cap) {
+            *avail = (uint32_t)-1;
+            return NULL;
+        }
+        *avail = mfno->cap - off;
+        return mfno->content + off;
+    }
+
+    *avail = MEMFS_CHUNK_SIZE - (off % MEMFS_CHUNK_SIZE);
+    if ((idx < mfno->n_chunks) && mfno->chunks[idx])
+        return mfno->chunks[idx] + (off % MEMFS_CHUNK_SIZE);
+    if (!alloc)
+        return NULL;
+
+    if (idx >= mfno->n_chunks) {
+        n = mfno->n_chunks ? mfno->n_chunks * 2 : 4;
+        while (n <= idx)
+            n *= 2;
+        tab = krealloc(mfno->chunks, n * sizeof(uint8_t *));
+        if (!tab)
+            return NULL;
+        memset(tab + mfno->n_chunks, 0, (n - mfno->n_chunks) * sizeof(uint8_t *));
+        mfno->chunks = tab;
+        mfno->n_chunks = n;
+    }
+    mfno->chunks[idx] = memfs_chunk_alloc(mfno->mnt);
+    if (!mfno->chunks[idx])
+        return NULL;
+    return mfno->chunks[idx] + (off % MEMFS_CHUNK_SIZE);
+}
+
+/* Copies out len bytes from 'off'. The caller checks the file size. */
+static void memfs_copy_out(struct memfs_fnode *mfno, uint32_t off, uint8_t *buf, uint32_t len)
+{
+    uint32_t avail;
+    uint8_t *p;
+    while (len > 0) {
+        p = memfs_at(mfno, off, 0, &avail);
+        if (avail > len)
+            avail = len;
+        if (p)
+            memcpy(buf, p, avail);
+        else
+            memset(buf, 0, avail);
+        buf += avail;
+        off += avail;
+        len -= avail;
+    }
+}
+
+/* Copies in len bytes at 'off'. Returns the number of bytes written. */
+static uint32_t memfs_copy_in(struct memfs_fnode *mfno, uint32_t off, const uint8_t *buf, uint32_t len)
+{
+    uint32_t avail, done = 0;
+    uint8_t *p;
+    while (done < len) {
+        p = memfs_at(mfno, off + done, 1, &avail);
+        if (!p)
+            break;
+        if (avail > (len - done))
+            avail = len - done;
+        memcpy(p, buf + done, avail);
+        done += avail;
+    }
+    return done;
+}
+
 static int memfs_read(struct fnode *fno, void *buf, unsigned int len)
 {
     struct memfs_fnode *mfno;
@@ -45,15 +219,15 @@ static int memfs_read(struct fnode *fno, void *buf, unsigned int len)
     if (len > (fno->size - fno->off))
         len = fno->size - fno->off;
 
-    memcpy(buf, mfno->content + fno->off, len);
+    memfs_copy_out(mfno, fno->off, buf, len);
     fno->off += len;
     return len;
 }
 
-
 static int memfs_write(struct fnode *fno, const void *buf, unsigned int len)
 {
     struct memfs_fnode *mfno;
+    uint32_t w;
     if (len <= 0)
         return len;
 
@@ -61,16 +235,60 @@ static int memfs_write(struct fnode *fno, const void *buf, unsigned int len)
     if (!mfno)
         return -1;
 
-    if (fno->size < (fno->off + len)) {
-        mfno->content = krealloc(mfno->content, fno->off + len);
+    w = memfs_copy_in(mfno, fno->off, buf, len);
+    if (w == 0)
+        return (mfno->content || (mfno->mnt && mfno->mnt->limit)) ? -ENOSPC : -ENOMEM;
+    fno->off += w;
+    if (fno->size < fno->off)
+        fno->size = fno->off;
+    return w;
+}
+
+static int memfs_readv(struct fnode *fno, const struct iovec *iov, int iovcnt)
+{
+    struct memfs_fnode *mfno;
+    int i, len, tot = 0;
+
+    mfno = FNO_MOD_PRIV(fno, &mod_memfs);
+    if (!mfno)
+        return -1;
+
+    if (fno->size <= (fno->off))
+        return -1;
+
+    for (i = 0; (i < iovcnt) && (fno->off < fno->size); i++) {
+        len = iov[i].iov_len;
+        if (len > (fno->size - fno->off))
+            len = fno->size - fno->off;
+        memfs_copy_out(mfno, fno->off, iov[i].iov_base, len);
+        fno->off += len;
+        tot += len;
     }
-    if (!mfno->content)
+    return tot;
+}
+
+static int memfs_writev(struct fnode *fno, const struct iovec *iov, int iovcnt)
+{
+    struct memfs_fnode *mfno;
+    uint32_t w, tot = 0;
+    int i;
+
+    mfno = FNO_MOD_PRIV(fno, &mod_memfs);
+    if (!mfno)
         return -1;
-    memcpy(mfno->content + fno->off, buf, len);
-    fno->off += len;
+
+    for (i = 0; i < iovcnt; i++) {
+        w = memfs_copy_in(mfno, fno->off, iov[i].iov_base, iov[i].iov_len);
+        fno->off += w;
+        tot += w;
+        if (w < iov[i].iov_len)
+            break;
+    }
     if (fno->size < fno->off)
         fno->size = fno->off;
-    return len;
+    if ((tot == 0) && (i < iovcnt))
+        return (mfno->content || (mfno->mnt && mfno->mnt->limit)) ? -ENOSPC : -ENOMEM;
+    return tot;
 }
 
 static int memfs_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
@@ -103,15 +321,86 @@ static int memfs_seek(struct fnode *fno, int off, int whence)
     if (new_off < 0)
         new_off = 0;
 
-    if (new_off > fno->size) {
-        mfno->content = krealloc(mfno->content, new_off);
-        memset(mfno->content + fno->size, 0, new_off - fno->size);
+    /* The gap reads as zeros, and takes no memory until written */
+    if (new_off > fno->size)
         fno->size = new_off;
-    }
     fno->off = new_off;
     return 0;
 }
 
+static int memfs_truncate(struct fnode *fno, uint32_t size)
+{
+    struct memfs_fnode *mfno;
+    uint32_t avail, pos = size;
+    uint8_t *p;
+    mfno = FNO_MOD_PRIV(fno, &mod_memfs);
+    if (!mfno)
+        return -EINVAL;
+
+    if (size < fno->size) {
+        memfs_release(mfno, size);
+        /* Zero what is left past the end, in case the file grows again */
+        while (pos < fno->size) {
+            p = memfs_at(mfno, pos, 0, &avail);
+            if (!p)
+                break;
+            if (avail > (fno->size - pos))
+                avail = fno->size - pos;
+            memset(p, 0, avail);
+            pos += avail;
+        }
+    }
+    fno->size = size;
+    if (fno->off > size)
+        fno->off = size;
+    return 0;
+}
+
+/* Kernel memory is only reachable from userspace through an MPU
+ * region, which covers a power-of-two block aligned to its size: the
+ * first mapping moves the chunks of the file into such a block, as for
+ * shm segments. The contents stay there from then on, while mappings
+ * may still use them: the file can only grow within the block.
+ */
+static void *memfs_mmap(struct fnode *fno, uint32_t off, uint32_t *len)
+{
+    struct memfs_fnode *mfno;
+    uint8_t *raw, *content;
+    uint32_t i, held = 0, cap = 32;
+    mfno = FNO_MOD_PRIV(fno, &mod_memfs);
+    if (!mfno || (off >= fno->size))
+        return NULL;
+
+    if (!mfno->content) {
+        while (cap < fno->size)
+            cap <<= 1;
+        for (i = 0; i < mfno->n_chunks; i++) {
+            if (mfno->chunks[i])
+                held += MEMFS_CHUNK_SIZE;
+        }
+        if (mfno->mnt && mfno->mnt->limit &&
+                ((mfno->mnt->used - held + cap) > mfno->mnt->limit))
+            return NULL;
+        /* Twice the size, to find a block aligned to cap */
+        raw = kalloc(2 * cap);
+        if (!raw)
+            return NULL;
+        content = (uint8_t *)(((uint32_t)raw + cap - 1) & ~(cap - 1));
+        memset(content, 0, cap);
+        memfs_copy_out(mfno, 0, content, fno->size);
+        memfs_release(mfno, 0);
+        memfs_charge(mfno->mnt, cap);
+        mfno->raw = raw;
+        mfno->content = content;
+        mfno->cap = cap;
+    } else if (fno->size > mfno->cap) {
+        /* Grown by a seek past the end */
+        return NULL;
+    }
+    *len = fno->size - off;
+    return mfno->content + off;
+}
+
 static int memfs_close(struct fnode *fno)
 {
     struct memfs_fnode *mfno;
@@ -122,11 +411,24 @@ static int memfs_close(struct fnode *fno)
     return 0;
 }
 
+static struct memfs_mount *memfs_mount_of(struct fnode *fno)
+{
+    struct memfs_mount *m;
+    for (; fno; fno = fno->parent) {
+        for (m = memfs_mounts; m; m = m->next) {
+            if (m->root == fno)
+                return m;
+        }
+    }
+    return NULL;
+}
+
 static int memfs_creat(struct fnode *fno)
 {
-    struct memfs_fnode *mfs = kalloc(sizeof(struct memfs_fnode));
+    struct memfs_fnode *mfs = kcalloc(sizeof(struct memfs_fnode), 1);
     if (mfs) {
         mfs->fnode = fno;
+        mfs->mnt = memfs_mount_of(fno->parent);
         fno->priv = mfs;
         return 0;
     }
@@ -140,15 +442,38 @@ static int memfs_unlink(struct fnode *fno)
     if (!fno)
         return -1;
     mfno = fno->priv;
-    if (mfno && mfno->content)
-        kfree(mfno->content);
+    if (mfno) {
+        memfs_release(mfno, 0);
+        if (mfno->raw) {
+            kfree(mfno->raw);
+            memfs_uncharge(mfno->mnt, mfno->cap);
+        }
+    }
     kfree(mfno);
     return 0;
 }
 
+/* Mount options: "size=<bytes>[k|m]" limits the memory used by the
+ * contents of the files. */
+static uint32_t memfs_opt_size(const char *opt)
+{
+    uint32_t size = 0;
+    if (!opt || (strncmp(opt, "size=", 5) != 0))
+        return 0;
+    opt += 5;
+    while ((*opt >= '0') && (*opt <= '9'))
+        size = size * 10 + (*opt++ - '0');
+    if ((*opt == 'k') || (*opt == 'K'))
+        size <<= 10;
+    else if ((*opt == 'm') || (*opt == 'M'))
+        size <<= 20;
+    return size;
+}
+
 static int memfs_mount(char *source, char *tgt, uint32_t flags, void *arg)
 {
     struct fnode *tgt_dir = NULL;
+    struct memfs_mount *m;
     /* Source must be NULL */
     if (source)
         return -1;
@@ -169,6 +494,13 @@ static int memfs_mount(char *source, char *tgt, uint32_t flags, void *arg)
         return -1;
     }
     */
+    m = kcalloc(sizeof(struct memfs_mount), 1);
+    if (!m)
+        return -1;
+    m->root = tgt_dir;
+    m->limit = memfs_opt_size(arg);
+    m->next = memfs_mounts;
+    memfs_mounts = m;
     tgt_dir->owner = &mod_memfs;
     return 0;
 }
@@ -183,7 +515,11 @@ void memfs_init(void)
     mod_memfs.ops.read = memfs_read;
     mod_memfs.ops.poll = memfs_poll;
     mod_memfs.ops.write = memfs_write;
+    mod_memfs.ops.readv = memfs_readv;
+    mod_memfs.ops.writev = memfs_writev;
     mod_memfs.ops.seek = memfs_seek;
+    mod_memfs.ops.truncate = memfs_truncate;
+    mod_memfs.ops.mmap = memfs_mmap;
     mod_memfs.ops.creat = memfs_creat;
     mod_memfs.ops.unlink = memfs_unlink;
     mod_memfs.ops.close = memfs_close;
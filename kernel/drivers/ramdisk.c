@@ -0,0 +1,145 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+#include "device.h"
+
+/* RAM-backed block device (/dev/ram0).
+ *
+ * The disk is blank at boot: a filesystem image can be copied in through
+ * the character interface (e.g. with dd) before mounting it.
+ */
+
+#ifndef CONFIG_RAMDISK_SIZE
+#   define CONFIG_RAMDISK_SIZE 64   /* KB */
+#endif
+
+#define RAMDISK_SECTOR_SIZE 512
+
+struct dev_ramdisk {
+    struct device *dev;
+    uint8_t *data;
+    uint32_t size;
+};
+
+static struct module mod_ramdisk = {
+};
+
+static struct dev_ramdisk ramdisk;
+
+static int ramdisk_block_read(struct fnode *fno, void *buf, uint32_t sector, int offset, int count)
+{
+    struct dev_ramdisk *rd = FNO_MOD_PRIV(fno, &mod_ramdisk);
+    uint32_t pos = sector * RAMDISK_SECTOR_SIZE + offset;
+    if (!rd || (offset < 0) || (count < 0) || (pos + count > rd->size))
+        return -1;
+    memcpy(buf, rd->data + pos, count);
+    return 0;
+}
+
+static int ramdisk_block_write(struct fnode *fno, const void *buf, uint32_t sector, int offset, int count)
+{
+    struct dev_ramdisk *rd = FNO_MOD_PRIV(fno, &mod_ramdisk);
+    uint32_t pos = sector * RAMDISK_SECTOR_SIZE + offset;
+    if (!rd || (offset < 0) || (count < 0) || (pos + count > rd->size))
+        return -1;
+    memcpy(rd->data + pos, buf, count);
+    return 0;
+}
+
+static int ramdisk_read(struct fnode *fno, void *buf, unsigned int len)
+{
+    struct dev_ramdisk *rd = FNO_MOD_PRIV(fno, &mod_ramdisk);
+    if (!rd)
+        return -1;
+    if (fno->off >= rd->size)
+        return 0;
+    if (len > (rd->size - fno->off))
+        len = rd->size - fno->off;
+    memcpy(buf, rd->data + fno->off, len);
+    fno->off += len;
+    return len;
+}
+
+static int ramdisk_write(struct fnode *fno, const void *buf, unsigned int len)
+{
+    struct dev_ramdisk *rd = FNO_MOD_PRIV(fno, &mod_ramdisk);
+    if (!rd)
+        return -1;
+    if (fno->off >= rd->size)
+        return -ENOSPC;
+    if (len > (rd->size - fno->off))
+        len = rd->size - fno->off;
+    memcpy(rd->data + fno->off, buf, len);
+    fno->off += len;
+    return len;
+}
+
+static int ramdisk_seek(struct fnode *fno, int off, int whence)
+{
+    struct dev_ramdisk *rd = FNO_MOD_PRIV(fno, &mod_ramdisk);
+    int new_off;
+    if (!rd)
+        return -1;
+    switch(whence) {
+        case SEEK_CUR:
+            new_off = fno->off + off;
+            break;
+        case SEEK_SET:
+            new_off = off;
+            break;
+        case SEEK_END:
+            new_off = rd->size + off;
+            break;
+        default:
+            return -EINVAL;
+    }
+    if ((new_off < 0) || (new_off > rd->size))
+        return -EINVAL;
+    fno->off = new_off;
+    return 0;
+}
+
+static int ramdisk_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
+{
+    *revents = events;
+    return 1;
+}
+
+void ramdisk_init(struct fnode *dev)
+{
+    strcpy(mod_ramdisk.name,"ramdisk");
+    mod_ramdisk.family = FAMILY_FILE;
+    mod_ramdisk.ops.open = device_open;
+    mod_ramdisk.ops.read = ramdisk_read;
+    mod_ramdisk.ops.write = ramdisk_write;
+    mod_ramdisk.ops.seek = ramdisk_seek;
+    mod_ramdisk.ops.poll = ramdisk_poll;
+    mod_ramdisk.ops.block_read = ramdisk_block_read;
+    mod_ramdisk.ops.block_write = ramdisk_block_write;
+
+    ramdisk.size = CONFIG_RAMDISK_SIZE * 1024;
+    ramdisk.data = f_calloc(MEM_USER, ramdisk.size, 1);
+    if (!ramdisk.data)
+        return;
+    ramdisk.dev = device_fno_init(&mod_ramdisk, "ram0", dev, FL_BLK, &ramdisk);
+    register_module(&mod_ramdisk);
+}
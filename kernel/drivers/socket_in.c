@@ -23,10 +23,13 @@ struct frosted_inet_socket {
 #define SOCK_BLOCKING(s) (((s->node->flags & O_NONBLOCK) == 0))
 
 
-void pico_lock(void)
+/* Syscalls return SYS_CALL_AGAIN when told so: the stack lock is only
+ * handed over to them when they restart. The kernel task spins. */
+int pico_lock(void)
 {
     if (picotcp_lock)
-        frosted_mutex_lock(picotcp_lock);
+        return frosted_mutex_lock(picotcp_lock);
+    return 0;
 }
 
 void pico_unlock(void)
@@ -99,6 +102,20 @@ static struct frosted_inet_socket *pico_inet(struct pico_socket *s)
     return (struct frosted_inet_socket *)(s->priv);
 }
 
+static uint16_t pico_ev_to_poll(uint16_t ev)
+{
+    uint16_t events = 0;
+    if (ev & (PICO_SOCK_EV_RD | PICO_SOCK_EV_CONN))
+        events |= POLLIN;
+    if (ev & PICO_SOCK_EV_WR)
+        events |= POLLOUT;
+    if (ev & PICO_SOCK_EV_CLOSE)
+        events |= POLLHUP;
+    if (ev & PICO_SOCK_EV_FIN)
+        events |= POLLERR;
+    return events;
+}
+
 static void pico_socket_event(uint16_t ev, struct pico_socket *sock)
 {
     struct frosted_inet_socket *s;
@@ -107,12 +124,20 @@ static void pico_socket_event(uint16_t ev, struct pico_socket *sock)
         return;
     }
     s->revents |= ev;
+    epoll_notify(s->node, pico_ev_to_poll(ev));
     if ((s->revents & s->events) != 0) {
         task_resume(s->pid);
         s->events = 0;
     }
 }
 
+static void sock_close_tasklet(void *arg)
+{
+    pico_lock();
+    pico_socket_close((struct pico_socket *)arg);
+    pico_unlock();
+}
+
 static int sock_close(struct fnode *fno)
 {
     struct frosted_inet_socket *s;
@@ -121,9 +146,15 @@ static int sock_close(struct fnode *fno)
     s = (struct frosted_inet_socket *)fno->priv;
     if (!s)
         return -1;
-    pico_lock();
-    pico_socket_close(s->sock);
-    pico_unlock();
+    /* Close cannot be restarted: if the stack is busy, the kernel task
+     * closes the socket later. */
+    s->sock->priv = NULL;
+    if (frosted_mutex_trylock(picotcp_lock) == 0) {
+        pico_socket_close(s->sock);
+        pico_unlock();
+    } else {
+        tasklet_add(sock_close_tasklet, s->sock);
+    }
     //kprintf("## Closed INET socket!\n");
     kfree((struct fnode *)s->node);
     kfree(s);
@@ -151,10 +182,16 @@ static int sock_socket(int domain, int type_flags, int protocol)
     struct frosted_inet_socket *s;
     int type = type_flags & 0xFFFF;
     uint32_t fnode_flags = ((uint32_t)type_flags) & 0xFFFF0000u;
+    int ret;
 
+    ret = pico_lock();
+    if (ret != 0)
+        return ret;
     s = inet_socket_new(fnode_flags);
-    if (!s)
+    if (!s) {
+        pico_unlock();
         return -ENOMEM;
+    }
     if (domain != PICO_PROTO_IPV4)
         domain = PICO_PROTO_IPV4;
 
@@ -164,7 +201,6 @@ static int sock_socket(int domain, int type_flags, int protocol)
     if (type == 2)
         type = PICO_PROTO_UDP;
 
-    pico_lock();
     s->sock = pico_socket_open(domain, type, pico_socket_event);
     pico_unlock();
     if (!s->sock) {
@@ -193,15 +229,15 @@ static int sock_recvfrom(int fd, void *buf, unsigned int len, int flags, struct
     if (!s)
         return -EINVAL;
     while (s->bytes < len) {
-        if ((addr) && ((*addrlen) > 0)) {
-            pico_lock();
+        /* s->bytes survives a restart */
+        ret = pico_lock();
+        if (ret != 0)
+            return ret;
+        if ((addr) && ((*addrlen) > 0))
             ret = pico_socket_recvfrom(s->sock, buf + s->bytes, len - s->bytes, &paddr, &port);
-            pico_unlock();
-        } else {
-            pico_lock();
+        else
             ret = pico_socket_read(s->sock, buf + s->bytes, len - s->bytes);
-            pico_unlock();
-        }
+        pico_unlock();
 
         if (ret < 0)
             return 0 - pico_err;
@@ -245,18 +281,18 @@ static int sock_sendto(int fd, const void *buf, unsigned int len, int flags, str
         return -EINVAL;
 
     while (len > s->bytes) {
+        ret = pico_lock();
+        if (ret != 0)
+            return ret;
         if ((addr) && (addrlen >0))
         {
             paddr.addr = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
             port = ((struct sockaddr_in *)addr)->sin_port;
-            pico_lock();
             ret = pico_socket_sendto(s->sock, buf + s->bytes, len - s->bytes, &paddr, port);
-            pico_unlock();
         } else {
-            pico_lock();
             ret = pico_socket_write(s->sock, buf + s->bytes, len - s->bytes);
-            pico_unlock();
         }
+        pico_unlock();
         if (ret == 0) {
             s->revents &= (~PICO_SOCK_EV_WR);
             if (SOCK_BLOCKING(s)) {
@@ -282,6 +318,174 @@ static int sock_sendto(int fd, const void *buf, unsigned int len, int flags, str
     return ret;
 }
 
+static int sock_is_udp(struct frosted_inet_socket *s)
+{
+    return (s->sock->proto->proto_number == PICO_PROTO_UDP);
+}
+
+static uint32_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    uint32_t tot = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        tot += iov[i].iov_len;
+    return tot;
+}
+
+/* Datagrams cannot be split across several pico_socket_read/write
+ * calls: bounce them through a single buffer. */
+static int sock_udp_readv(struct frosted_inet_socket *s, const struct iovec *iov, int iovcnt)
+{
+    uint32_t tot = iov_total(iov, iovcnt);
+    uint8_t *tmp;
+    int ret, i, off = 0, len;
+    tmp = kalloc(tot);
+    if (!tmp)
+        return -ENOMEM;
+    ret = pico_lock();
+    if (ret != 0) {
+        kfree(tmp);
+        return ret;
+    }
+    ret = pico_socket_read(s->sock, tmp, tot);
+    pico_unlock();
+    for (i = 0; (i < iovcnt) && (off < ret); i++) {
+        len = iov[i].iov_len;
+        if (len > (ret - off))
+            len = ret - off;
+        memcpy(iov[i].iov_base, tmp + off, len);
+        off += len;
+    }
+    kfree(tmp);
+    return ret;
+}
+
+static int sock_udp_writev(struct frosted_inet_socket *s, const struct iovec *iov, int iovcnt)
+{
+    uint32_t tot = iov_total(iov, iovcnt);
+    uint8_t *tmp;
+    int ret, i, off = 0;
+    tmp = kalloc(tot);
+    if (!tmp)
+        return -ENOMEM;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(tmp + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    ret = pico_lock();
+    if (ret == 0) {
+        ret = pico_socket_write(s->sock, tmp, tot);
+        pico_unlock();
+    }
+    kfree(tmp);
+    return ret;
+}
+
+static int sock_readv(struct fnode *fno, const struct iovec *iov, int iovcnt)
+{
+    struct frosted_inet_socket *s;
+    int i, ret = 0, tot = 0;
+
+    s = (struct frosted_inet_socket *)FNO_MOD_PRIV(fno, &mod_socket_in);
+    if (!s)
+        return -EINVAL;
+
+    if (sock_is_udp(s)) {
+        tot = sock_udp_readv(s, iov, iovcnt);
+        if (tot == SYS_CALL_AGAIN)
+            return tot;
+    } else {
+        ret = pico_lock();
+        if (ret != 0)
+            return ret;
+        for (i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0)
+                continue;
+            ret = pico_socket_read(s->sock, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0)
+                break;
+            tot += ret;
+            if (ret < iov[i].iov_len)
+                break;
+        }
+        pico_unlock();
+        if ((ret < 0) && (tot == 0))
+            tot = ret;
+    }
+
+    if (tot < 0)
+        return 0 - pico_err;
+    if (tot == 0) {
+        s->revents &= (~PICO_SOCK_EV_RD);
+        if (SOCK_BLOCKING(s))  {
+            s->events = PICO_SOCK_EV_RD;
+            s->pid = scheduler_get_cur_pid();
+            task_suspend();
+            return SYS_CALL_AGAIN;
+        }
+        return -EAGAIN;
+    }
+    s->events  &= (~PICO_SOCK_EV_RD);
+    s->revents &= (~PICO_SOCK_EV_RD);
+    return tot;
+}
+
+/* Same restart protocol as sock_sendto(): s->bytes counts the bytes of
+ * the whole vector already queued. */
+static int sock_writev(struct fnode *fno, const struct iovec *iov, int iovcnt)
+{
+    struct frosted_inet_socket *s;
+    uint32_t pos = 0, skip;
+    int i, ret;
+
+    s = (struct frosted_inet_socket *)FNO_MOD_PRIV(fno, &mod_socket_in);
+    if (!s)
+        return -EINVAL;
+
+    if (sock_is_udp(s)) {
+        ret = sock_udp_writev(s, iov, iovcnt);
+        if (ret == SYS_CALL_AGAIN)
+            return ret;
+        if (ret < 0)
+            return 0 - pico_err;
+        return ret;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (s->bytes >= pos + iov[i].iov_len) {
+            pos += iov[i].iov_len;
+            continue;
+        }
+        skip = s->bytes - pos;
+        ret = pico_lock();
+        if (ret != 0)
+            return ret;
+        ret = pico_socket_write(s->sock, (uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        pico_unlock();
+        if (ret < 0)
+            return (0 - pico_err);
+        s->bytes += ret;
+        if (ret < (iov[i].iov_len - skip)) {
+            s->revents &= (~PICO_SOCK_EV_WR);
+            if (SOCK_BLOCKING(s)) {
+                s->events = PICO_SOCK_EV_WR;
+                s->pid = scheduler_get_cur_pid();
+                task_suspend();
+                return SYS_CALL_AGAIN;
+            }
+            break;
+        }
+        pos += iov[i].iov_len;
+    }
+    ret = s->bytes;
+    s->bytes = 0;
+    s->events  &= (~PICO_SOCK_EV_WR);
+    if ((ret == 0) && !SOCK_BLOCKING(s)) {
+        ret = -EAGAIN;
+    }
+    return ret;
+}
+
 static int sock_bind(int fd, struct sockaddr *addr, unsigned int addrlen)
 {
     struct frosted_inet_socket *s;
@@ -293,7 +497,9 @@ static int sock_bind(int fd, struct sockaddr *addr, unsigned int addrlen)
         return -EINVAL;
     paddr.ip4.addr = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
     port = ((struct sockaddr_in *)addr)->sin_port;
-    pico_lock();
+    ret = pico_lock();
+    if (ret != 0)
+        return ret;
     ret = pico_socket_bind(s->sock, &paddr, &port);
     pico_unlock();
     if (ret == 0) {
@@ -309,22 +515,25 @@ static int sock_accept(int fd, struct sockaddr *addr, unsigned int *addrlen)
     struct pico_socket *cli;
     union pico_address paddr;
     uint16_t port;
+    int ret;
 
     l = fd_inet(fd);
     if (!l)
         return -EINVAL;
     l->events = PICO_SOCK_EV_CONN;
 
-    pico_lock();
+    ret = pico_lock();
+    if (ret != 0)
+        return ret;
     cli = pico_socket_accept(l->sock, &paddr, &port);
-    pico_unlock();
-    if ((cli == NULL) && (pico_err != PICO_ERR_EAGAIN))
+    if ((cli == NULL) && (pico_err != PICO_ERR_EAGAIN)) {
+        pico_unlock();
         return 0 - pico_err;
+    }
 
     if (cli) {
         s = inet_socket_new(0);
         if (!s) {
-            pico_lock();
             pico_socket_close(cli);
             pico_unlock();
             return -ENOMEM;
@@ -333,11 +542,13 @@ static int sock_accept(int fd, struct sockaddr *addr, unsigned int *addrlen)
         s->node->owner = &mod_socket_in;
         s->node->priv = s;
         s->sock->priv = s;
+        pico_unlock();
         s->fd = task_filedesc_add(s->node);
         if (s->fd >= 0)
             task_fd_setmask(s->fd, O_RDWR);
         return s->fd;
     } else {
+        pico_unlock();
         l->revents &= (~PICO_SOCK_EV_CONN);
         if (SOCK_BLOCKING(l)) {
             l->pid = scheduler_get_cur_pid();
@@ -362,7 +573,9 @@ static int sock_connect(int fd, struct sockaddr *addr, unsigned int addrlen)
     if ((s->revents & PICO_SOCK_EV_CONN) == 0) {
         paddr.ip4.addr = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
         port = ((struct sockaddr_in *)addr)->sin_port;
-        pico_lock();
+        ret = pico_lock();
+        if (ret != 0)
+            return ret;
         ret = pico_socket_connect(s->sock, &paddr, port);
         pico_unlock();
         if (SOCK_BLOCKING(s)) {
@@ -385,7 +598,9 @@ static int sock_listen(int fd, int backlog)
     s = fd_inet(fd);
     if (!s)
         return -EINVAL;
-    pico_lock();
+    ret = pico_lock();
+    if (ret != 0)
+        return ret;
     ret = pico_socket_listen(s->sock, backlog);
     pico_unlock();
     s->events |= PICO_SOCK_EV_CONN;
@@ -399,7 +614,9 @@ static int sock_shutdown(int fd, uint16_t how)
     s = fd_inet(fd);
     if (!s)
         return -EINVAL;
-    pico_lock();
+    ret = pico_lock();
+    if (ret != 0)
+        return ret;
     ret =  pico_socket_shutdown(s->sock, how);
     pico_unlock();
     return ret;
@@ -684,8 +901,10 @@ int sysfs_net_route_list(struct sysfs_fnode *sfs, void *buf, int len)
         const char route_banner[] = "Kernel IP routing table\r\nDestination     Gateway         Genmask         Flags   Metric  Iface \r\n";
         sysfs_lock();
         mem_txt = kalloc(MAX_SYSFS_BUFFER);
-        if (!mem_txt)
+        if (!mem_txt) {
+            sysfs_unlock();
             return -1;
+        }
         off = 0;
         strcpy(mem_txt + off, route_banner);
         off += strlen(route_banner);
@@ -749,7 +968,6 @@ int sysfs_net_route_list(struct sysfs_fnode *sfs, void *buf, int len)
     }
     memcpy(res, mem_txt + fno->off, len);
     fno->off += len;
-    sysfs_unlock();
     return len;
 }
 
@@ -865,6 +1083,8 @@ void socket_in_init(void)
     mod_socket_in.ops.listen     = sock_listen;
     mod_socket_in.ops.recvfrom   = sock_recvfrom;
     mod_socket_in.ops.sendto     = sock_sendto;
+    mod_socket_in.ops.readv      = sock_readv;
+    mod_socket_in.ops.writev     = sock_writev;
     mod_socket_in.ops.shutdown   = sock_shutdown;
     mod_socket_in.ops.ioctl      = sock_ioctl;
     mod_socket_in.ops.getsockopt   = sock_getsockopt;
@@ -36,7 +36,6 @@ extern void   *pico_signal_tick;
 typedef int socklen_t;
 #define AF_INET     (PICO_PROTO_IPV4)
 #define AF_INET6    (PICO_PROTO_IPV6)
-#define SOL_SOCKET (0x80)
 
 #define IP_MULTICAST_LOOP   (PICO_IP_MULTICAST_LOOP)
 #define IP_MULTICAST_TTL    (PICO_IP_MULTICAST_TTL)
@@ -193,7 +192,7 @@ struct timezone {
     };
 #endif
 
-void pico_lock(void);
+int pico_lock(void);
 void pico_unlock(void);
 
 #endif /* PICO_BSD_SOCKETS_H_ */
@@ -1,84 +1,741 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
 #include "frosted.h"
 #include <string.h>
+#include "poll.h"
+
+/* UNIX domain sockets (AF_UNIX), SOCK_STREAM and SOCK_DGRAM.
+ *
+ * bind() creates a node in the VFS (e.g. /tmp/log.sock), found by the
+ * peers at connect()/sendto() time. The node stays until unlinked, as
+ * on Linux, and refuses connections once its socket is closed.
+ *
+ * Data is copied once into the receive queue of the destination socket,
+ * and from there to the reader's buffer. Datagrams keep their
+ * boundaries; stream data is read across queued chunks. Each receive
+ * queue holds up to UN_RCVBUF bytes: senders block (or get -EAGAIN)
+ * when it is full.
+ *
+ * Stream connections are established at connect() time: the server-side
+ * socket is queued on the listening socket until accept().
+ */
+
+#define UN_RCVBUF       2048
+#define UN_BACKLOG_MAX  8
+
+#define UN_IDLE         0
+#define UN_LISTEN       1
+#define UN_CONNECTED    2
+
+#define UN_SHUT_RD      1
+#define UN_SHUT_WR      2
+
+#define SOCK_BLOCKING(s) (((s->node->flags & O_NONBLOCK) == 0))
 
 static struct module mod_socket_un;
-struct fnode FNO_SOCKUN_STUB = {
-    .owner = &mod_socket_un
+
+struct un_msg {
+    struct un_msg *next;
+    uint16_t len;
+    uint16_t off;                   /* Streams: bytes already read */
+    char *from;                     /* Datagrams: bound path of the sender */
+    uint8_t data[];
+};
+
+struct un_sock {
+    struct fnode *node;
+    struct fnode *bound;            /* Name in the VFS, after bind() */
+    char *path;                     /* Absolute path of 'bound' */
+    int type;
+    uint8_t state;
+    uint8_t shut;
+    struct un_sock *peer;           /* Streams: other end */
+    char *dest;                     /* Datagrams: destination set by connect() */
+    int owner;                      /* Pid at socket()/listen() */
+    int peer_pid;                   /* Pid at the other end, for SO_PEERCRED */
+    struct un_msg *rx_head;
+    struct un_msg *rx_tail;
+    uint32_t rx_bytes;
+    struct un_sock *pending;        /* Listening: not accepted yet */
+    struct un_sock *pending_next;
+    int n_pending;
+    int backlog;
+    int pid;                        /* Waiting for data or connections */
+    int pid_w;                      /* Waiting for room in the receive queue */
+    int bytes;                      /* Streams: progress of a blocked send */
 };
 
-static int sock_check_fd(int fd, struct fnode **fno)
+static struct un_sock *fd_un(int fd)
 {
-    *fno = task_filedesc_get(fd);
-    
-    if (!fno)
-        return -1;
+    struct fnode *fno = task_filedesc_get(fd);
+    if (!fno || (fno->owner != &mod_socket_un) || (fno->flags & FL_SOCK))
+        return NULL;
+    return (struct un_sock *)fno->priv;
+}
 
-    if (fd < 0)
-        return -1;
-    if ((*fno)->owner != &mod_socket_un)
-        return -1;
+static void un_wake(int *pid)
+{
+    if (*pid > 0) {
+        task_resume(*pid);
+        *pid = 0;
+    }
+}
+
+static struct un_sock *un_sock_new(int type, uint32_t flags)
+{
+    struct un_sock *s;
+    s = kcalloc(sizeof(struct un_sock), 1);
+    if (!s)
+        return NULL;
+    s->node = kcalloc(sizeof(struct fnode), 1);
+    if (!s->node) {
+        kfree(s);
+        return NULL;
+    }
+    s->node->owner = &mod_socket_un;
+    s->node->priv = s;
+    s->node->flags = FL_RDWR | flags;
+    s->type = type;
+    s->owner = scheduler_get_cur_pid();
+    return s;
+}
+
+static void un_queue_free(struct un_sock *s)
+{
+    struct un_msg *m;
+    while (s->rx_head) {
+        m = s->rx_head;
+        s->rx_head = m->next;
+        kfree(m);
+    }
+    s->rx_tail = NULL;
+    s->rx_bytes = 0;
+}
+
+static void un_sock_free(struct un_sock *s)
+{
+    un_queue_free(s);
+    kfree(s->path);
+    kfree(s->dest);
+    kfree(s->node);
+    kfree(s);
+}
+
+static int un_fd_attach(struct un_sock *s)
+{
+    int fd = task_filedesc_add(s->node);
+    if (fd >= 0)
+        task_fd_setmask(fd, O_RDWR);
+    return fd;
+}
+
+/* Breaks a stream connection, waking up both ends */
+static void un_disconnect(struct un_sock *s)
+{
+    struct un_sock *p = s->peer;
+    if (p) {
+        p->peer = NULL;
+        s->peer = NULL;
+        un_wake(&p->pid);
+        un_wake(&p->pid_w);
+        epoll_notify(p->node, POLLIN | POLLHUP);
+    }
+    un_wake(&s->pid_w);
+}
 
+static struct un_msg *un_msg_new(int len, const char *from)
+{
+    struct un_msg *m;
+    int flen = from ? (strlen(from) + 1) : 0;
+    m = kalloc(sizeof(struct un_msg) + len + flen);
+    if (!m)
+        return NULL;
+    m->next = NULL;
+    m->len = len;
+    m->off = 0;
+    m->from = NULL;
+    if (from) {
+        m->from = (char *)(m->data + len);
+        memcpy(m->from, from, flen);
+    }
+    return m;
+}
+
+static void un_enqueue(struct un_sock *dst, struct un_msg *m)
+{
+    if (dst->rx_tail)
+        dst->rx_tail->next = m;
+    else
+        dst->rx_head = m;
+    dst->rx_tail = m;
+    dst->rx_bytes += m->len;
+    un_wake(&dst->pid);
+    epoll_notify(dst->node, POLLIN);
+}
+
+static void un_dequeue(struct un_sock *s)
+{
+    struct un_msg *m = s->rx_head;
+    s->rx_head = m->next;
+    if (!s->rx_head)
+        s->rx_tail = NULL;
+    kfree(m);
+}
+
+/* Path in a sockaddr_un, NUL-terminated into 'path' (MAX_FILE bytes) */
+static int un_path(struct sockaddr *addr, unsigned int addrlen, char *path)
+{
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    unsigned int len;
+    if (!addr || (addrlen <= sizeof(uint16_t)))
+        return -EINVAL;
+    len = addrlen - sizeof(uint16_t);
+    if (len > sizeof(un->sun_path))
+        len = sizeof(un->sun_path);
+    memcpy(path, un->sun_path, len);
+    path[len] = '\0';
+    if (path[0] == '\0')
+        return -EINVAL;
     return 0;
 }
 
-static int sock_poll(int fd, uint16_t events, uint16_t *revents)
+static void un_getaddr(const char *path, struct sockaddr *addr, unsigned int *addrlen)
 {
-    *revents = events;
-    return 1;
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    unsigned int plen = 0;
+    if (!addr || !addrlen || (*addrlen < sizeof(uint16_t)))
+        return;
+    un->sun_family = FAMILY_UNIX;
+    if (path)
+        plen = strlen(path) + 1;
+    if (plen > (*addrlen - sizeof(uint16_t)))
+        plen = *addrlen - sizeof(uint16_t);
+    if (plen > 0)
+        memcpy(un->sun_path, path, plen);
+    *addrlen = sizeof(uint16_t) + plen;
 }
 
+/* Bound socket of the given type at 'path' */
+static int un_lookup(const char *path, int type, struct un_sock **s)
+{
+    struct fnode *fno = vfs_search(path);
+    if (!fno)
+        return -ENOENT;
+    if ((fno->owner != &mod_socket_un) || !(fno->flags & FL_SOCK))
+        return -ECONNREFUSED;
+    *s = (struct un_sock *)fno->priv;
+    if (!*s)
+        return -ECONNREFUSED;
+    if ((*s)->type != type)
+        return -EPROTOTYPE;
+    return 0;
+}
 
-static int sock_close(int fd)
+static int un_eof(struct un_sock *s)
 {
-    struct fnode *fno;
-    if (sock_check_fd(fd, &fno))
-        return -1;
-    kprintf("## Closed UNIX socket!\n");
-    /* TODO */
+    if (s->shut & UN_SHUT_RD)
+        return 1;
+    if (s->type == SOCK_DGRAM)
+        return 0;
+    return (s->state == UN_CONNECTED) &&
+        (!s->peer || (s->peer->shut & UN_SHUT_WR));
+}
+
+static int un_recv(struct un_sock *s, void *buf, unsigned int len, struct sockaddr *addr, unsigned int *addrlen)
+{
+    struct un_msg *m;
+    uint8_t *dst = buf;
+    unsigned int n, out = 0;
+
+    if ((s->type == SOCK_STREAM) && (s->state != UN_CONNECTED))
+        return -ENOTCONN;
+    if (len == 0)
+        return 0;
+
+    if (!s->rx_head) {
+        if (un_eof(s))
+            return 0;
+        if (!SOCK_BLOCKING(s))
+            return -EAGAIN;
+        s->pid = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    if (s->type == SOCK_DGRAM) {
+        /* One datagram per call: what does not fit is discarded */
+        m = s->rx_head;
+        out = (m->len < len) ? m->len : len;
+        memcpy(dst, m->data, out);
+        un_getaddr(m->from, addr, addrlen);
+        s->rx_bytes -= m->len;
+        un_dequeue(s);
+    } else {
+        while (((m = s->rx_head) != NULL) && (out < len)) {
+            n = m->len - m->off;
+            if (n > (len - out))
+                n = len - out;
+            memcpy(dst + out, m->data + m->off, n);
+            m->off += n;
+            out += n;
+            s->rx_bytes -= n;
+            if (m->off == m->len)
+                un_dequeue(s);
+        }
+        un_getaddr(s->peer ? s->peer->path : NULL, addr, addrlen);
+        if (s->peer)
+            epoll_notify(s->peer->node, POLLOUT);
+    }
+    un_wake(&s->pid_w);
+    return out;
+}
+
+static int un_send_dgram(struct un_sock *s, const void *buf, unsigned int len, struct sockaddr *addr, unsigned int addrlen)
+{
+    char path[MAX_FILE];
+    struct un_sock *dst;
+    struct un_msg *m;
+    int ret;
+
+    if (addr && (addrlen > 0)) {
+        ret = un_path(addr, addrlen, path);
+        if (ret < 0)
+            return ret;
+    } else if (s->dest) {
+        strcpy(path, s->dest);
+    } else {
+        return -ENOTCONN;
+    }
+    ret = un_lookup(path, SOCK_DGRAM, &dst);
+    if (ret < 0)
+        return ret;
+    if (dst->shut & UN_SHUT_RD)
+        return -ECONNREFUSED;
+    if (len > UN_RCVBUF)
+        return -EMSGSIZE;
+
+    if ((UN_RCVBUF - dst->rx_bytes) < len) {
+        if (!SOCK_BLOCKING(s))
+            return -EAGAIN;
+        dst->pid_w = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+    m = un_msg_new(len, s->path);
+    if (!m)
+        return -ENOMEM;
+    memcpy(m->data, buf, len);
+    un_enqueue(dst, m);
+    return len;
+}
+
+/* Same restart protocol as pipe_write(): s->bytes counts the bytes
+ * already queued when the call blocks. */
+static int un_send_stream(struct un_sock *s, const void *buf, unsigned int len)
+{
+    struct un_sock *dst = s->peer;
+    struct un_msg *m;
+    unsigned int n, room;
+    int ret;
+
+    if (s->state != UN_CONNECTED)
+        return -ENOTCONN;
+    if (!dst || (dst->shut & UN_SHUT_RD)) {
+        s->bytes = 0;
+        return -EPIPE;
+    }
+
+    while (s->bytes < len) {
+        room = UN_RCVBUF - dst->rx_bytes;
+        if (room == 0)
+            break;
+        n = len - s->bytes;
+        if (n > room)
+            n = room;
+        m = un_msg_new(n, NULL);
+        if (!m) {
+            if (s->bytes == 0)
+                return -ENOMEM;
+            break;
+        }
+        memcpy(m->data, (const uint8_t *)buf + s->bytes, n);
+        un_enqueue(dst, m);
+        s->bytes += n;
+    }
+
+    if ((s->bytes < len) && SOCK_BLOCKING(s) && (dst->rx_bytes >= UN_RCVBUF)) {
+        dst->pid_w = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+    ret = s->bytes;
+    s->bytes = 0;
+    if (ret == 0)
+        return -EAGAIN;
+    return ret;
+}
+
+static int un_send(struct un_sock *s, const void *buf, unsigned int len, struct sockaddr *addr, unsigned int addrlen)
+{
+    if (s->shut & UN_SHUT_WR)
+        return -EPIPE;
+    if (s->type == SOCK_DGRAM)
+        return un_send_dgram(s, buf, len, addr, addrlen);
+    if (len == 0)
+        return 0;
+    return un_send_stream(s, buf, len);
+}
+
+static int sock_poll(struct fnode *f, uint16_t events, uint16_t *revents)
+{
+    struct un_sock *s = (struct un_sock *)f->priv;
+    *revents = 0;
+    if (!s)
+        return -EINVAL;
+
+    if (s->rx_head || s->pending)
+        *revents |= POLLIN;
+    if ((s->type == SOCK_STREAM) && un_eof(s))
+        *revents |= POLLIN | POLLHUP;
+    if (s->type == SOCK_DGRAM)
+        *revents |= POLLOUT;
+    else if (s->peer && (s->peer->rx_bytes < UN_RCVBUF))
+        *revents |= POLLOUT;
+
+    *revents &= (events | POLLHUP | POLLERR);
+    if (*revents)
+        return 1;
+
+    s->pid = scheduler_get_cur_pid();
+    if ((events & POLLOUT) && s->peer)
+        s->peer->pid_w = s->pid;
     return 0;
 }
 
-int sock_socket(int domain, int type, int protocol)
+static int sock_close(struct fnode *fno)
 {
-    int fd = -1;
-    kprintf("## Opened UNIX socket!\n");
-    fd = task_filedesc_add(&FNO_SOCKUN_STUB);
+    struct un_sock *s, *p;
+    if (!fno)
+        return -EINVAL;
+    s = (struct un_sock *)fno->priv;
+    if (!s)
+        return -EINVAL;
+    if (fno->usage > 0)
+        return 0;
+
+    /* The name stays in the VFS until unlinked */
+    if (s->bound)
+        s->bound->priv = NULL;
+
+    while (s->pending) {
+        p = s->pending;
+        s->pending = p->pending_next;
+        un_disconnect(p);
+        un_sock_free(p);
+    }
+    un_disconnect(s);
+    un_sock_free(s);
+    return 0;
+}
+
+/* The name of a bound socket was unlinked */
+static int sock_unlink(struct fnode *fno)
+{
+    struct un_sock *s = (struct un_sock *)fno->priv;
+    if ((fno->flags & FL_SOCK) && s)
+        s->bound = NULL;
+    return 0;
+}
+
+static int sock_open(const char *path, int flags)
+{
+    return -ENXIO;
+}
+
+static int sock_read(struct fnode *fno, void *buf, unsigned int len)
+{
+    struct un_sock *s = (struct un_sock *)fno->priv;
+    if (!s)
+        return -EINVAL;
+    return un_recv(s, buf, len, NULL, NULL);
+}
+
+static int sock_write(struct fnode *fno, const void *buf, unsigned int len)
+{
+    struct un_sock *s = (struct un_sock *)fno->priv;
+    if (!s)
+        return -EINVAL;
+    return un_send(s, buf, len, NULL, 0);
+}
+
+static int sock_socket(int domain, int type_flags, int protocol)
+{
+    struct un_sock *s;
+    int fd;
+    int type = type_flags & 0xFFFF;
+    uint32_t fnode_flags = ((uint32_t)type_flags) & 0xFFFF0000u;
+
+    if (type == 1)
+        type = SOCK_STREAM;
+    if (type == 2)
+        type = SOCK_DGRAM;
+    if ((type != SOCK_STREAM) && (type != SOCK_DGRAM))
+        return -EPROTOTYPE;
+
+    s = un_sock_new(type, fnode_flags);
+    if (!s)
+        return -ENOMEM;
+    fd = un_fd_attach(s);
+    if (fd < 0)
+        un_sock_free(s);
     return fd;
 }
-int sock_recvfrom(int fd, void *buf, unsigned int len, int flags, struct sockaddr *addr, unsigned int *addrlen)
+
+static int sock_recvfrom(int fd, void *buf, unsigned int len, int flags, struct sockaddr *addr, unsigned int *addrlen)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    if (!s)
+        return -EINVAL;
+    return un_recv(s, buf, len, addr, addrlen);
 }
 
-int sock_sendto(int fd, const void *buf, unsigned int len, int flags, struct sockaddr *addr, unsigned int addrlen)
+static int sock_sendto(int fd, const void *buf, unsigned int len, int flags, struct sockaddr *addr, unsigned int addrlen)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    if (!s)
+        return -EINVAL;
+    return un_send(s, buf, len, addr, addrlen);
 }
-int sock_bind(int fd, struct sockaddr *addr, unsigned int addrlen)
+
+static int sock_bind(int fd, struct sockaddr *addr, unsigned int addrlen)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    struct fnode *fno;
+    char path[MAX_FILE];
+    int ret;
+
+    if (!s)
+        return -EINVAL;
+    if (s->path)
+        return -EINVAL;
+    ret = un_path(addr, addrlen, path);
+    if (ret < 0)
+        return ret;
+    ret = vfs_mknod(&mod_socket_un, path, FL_SOCK | FL_RDWR, &fno);
+    if (ret == -EEXIST)
+        return -EADDRINUSE;
+    if (ret < 0)
+        return ret;
+    s->path = kalloc(MAX_FILE);
+    if (!s->path || (fno_fullpath(fno, s->path, MAX_FILE) < 0)) {
+        kfree(s->path);
+        s->path = NULL;
+        fno_unlink(fno);
+        return -ENOMEM;
+    }
+    fno->priv = s;
+    s->bound = fno;
+    return 0;
 }
 
-int sock_accept(int fd, struct sockaddr *addr, unsigned int *addrlen)
+static int sock_listen(int fd, int backlog)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    if (!s)
+        return -EINVAL;
+    if (s->type != SOCK_STREAM)
+        return -EOPNOTSUPP;
+    if (!s->bound || (s->state == UN_CONNECTED))
+        return -EINVAL;
+    if (backlog < 1)
+        backlog = 1;
+    if (backlog > UN_BACKLOG_MAX)
+        backlog = UN_BACKLOG_MAX;
+    s->backlog = backlog;
+    s->state = UN_LISTEN;
+    s->owner = scheduler_get_cur_pid();
+    return 0;
 }
 
-int sock_connect(int fd, struct sockaddr *addr, unsigned int addrlen)
+static int sock_connect(int fd, struct sockaddr *addr, unsigned int addrlen)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    struct un_sock *l, *srv, **pp;
+    char path[MAX_FILE];
+    int ret;
+
+    if (!s)
+        return -EINVAL;
+    ret = un_path(addr, addrlen, path);
+    if (ret < 0)
+        return ret;
+
+    if (s->type == SOCK_DGRAM) {
+        ret = un_lookup(path, SOCK_DGRAM, &l);
+        if (ret < 0)
+            return ret;
+        kfree(s->dest);
+        s->dest = kalloc(strlen(path) + 1);
+        if (!s->dest)
+            return -ENOMEM;
+        strcpy(s->dest, path);
+        s->peer_pid = l->owner;
+        return 0;
+    }
+
+    if (s->state == UN_CONNECTED)
+        return -EISCONN;
+    if (s->state == UN_LISTEN)
+        return -EINVAL;
+    ret = un_lookup(path, SOCK_STREAM, &l);
+    if (ret < 0)
+        return ret;
+    if (l->state != UN_LISTEN)
+        return -ECONNREFUSED;
+    if (l->n_pending >= l->backlog) {
+        if (!SOCK_BLOCKING(s))
+            return -EAGAIN;
+        l->pid_w = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    srv = un_sock_new(SOCK_STREAM, 0);
+    if (!srv)
+        return -ENOMEM;
+    srv->state = UN_CONNECTED;
+    srv->peer = s;
+    srv->peer_pid = scheduler_get_cur_pid();
+    srv->owner = l->owner;
+    s->state = UN_CONNECTED;
+    s->peer = srv;
+    s->peer_pid = l->owner;
+
+    for (pp = &l->pending; *pp; pp = &(*pp)->pending_next)
+        ;
+    *pp = srv;
+    l->n_pending++;
+    un_wake(&l->pid);
+    epoll_notify(l->node, POLLIN);
+    return 0;
 }
 
-int sock_listen(int fd, int backlog)
+static int sock_accept(int fd, struct sockaddr *addr, unsigned int *addrlen)
 {
-    return -1;
+    struct un_sock *l = fd_un(fd);
+    struct un_sock *srv;
+    int sd;
+
+    if (!l)
+        return -EINVAL;
+    if (l->state != UN_LISTEN)
+        return -EINVAL;
+
+    srv = l->pending;
+    if (!srv) {
+        if (!SOCK_BLOCKING(l))
+            return -EAGAIN;
+        l->pid = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    sd = un_fd_attach(srv);
+    if (sd < 0)
+        return sd;
+    l->pending = srv->pending_next;
+    srv->pending_next = NULL;
+    l->n_pending--;
+    /* Room in the backlog */
+    un_wake(&l->pid_w);
+    un_getaddr(srv->peer ? srv->peer->path : NULL, addr, addrlen);
+    return sd;
 }
 
-int sock_shutdown(int fd, uint16_t how)
+static int sock_shutdown(int fd, uint16_t how)
 {
-    return -1;
+    struct un_sock *s = fd_un(fd);
+    if (!s)
+        return -EINVAL;
+    if (how > 2)
+        return -EINVAL;
+    if ((s->type == SOCK_STREAM) && (s->state != UN_CONNECTED))
+        return -ENOTCONN;
+
+    s->shut |= (how + 1);
+    if (s->shut & UN_SHUT_RD) {
+        un_queue_free(s);
+        un_wake(&s->pid_w);
+    }
+    if ((s->shut & UN_SHUT_WR) && s->peer) {
+        un_wake(&s->peer->pid);
+        epoll_notify(s->peer->node, POLLIN | POLLHUP);
+    }
+    return 0;
+}
+
+static int sock_getsockopt(int sd, int level, int optname, void *optval, unsigned int *optlen)
+{
+    struct un_sock *s = fd_un(sd);
+    struct ucred *cred = (struct ucred *)optval;
+    if (!s)
+        return -EINVAL;
+    if (optname != SO_PEERCRED)
+        return -ENOPROTOOPT;
+    if (*optlen < sizeof(struct ucred))
+        return -EINVAL;
+    if (s->peer_pid == 0)
+        return -ENOTCONN;
+    cred->pid = s->peer_pid;
+    cred->uid = 0;
+    cred->gid = 0;
+    *optlen = sizeof(struct ucred);
+    return 0;
 }
 
+static int sock_getsockname(int sd, struct sockaddr *addr, unsigned int *addrlen)
+{
+    struct un_sock *s = fd_un(sd);
+    if (!s)
+        return -EINVAL;
+    un_getaddr(s->path, addr, addrlen);
+    return 0;
+}
+
+static int sock_getpeername(int sd, struct sockaddr *addr, unsigned int *addrlen)
+{
+    struct un_sock *s = fd_un(sd);
+    if (!s)
+        return -EINVAL;
+    if (s->type == SOCK_DGRAM) {
+        if (!s->dest)
+            return -ENOTCONN;
+        un_getaddr(s->dest, addr, addrlen);
+        return 0;
+    }
+    if (!s->peer)
+        return -ENOTCONN;
+    un_getaddr(s->peer->path, addr, addrlen);
+    return 0;
+}
 
 void socket_un_init(void)
 {
@@ -86,6 +743,10 @@ void socket_un_init(void)
     strcpy(mod_socket_un.name,"un");
     mod_socket_un.ops.poll = sock_poll;
     mod_socket_un.ops.close = sock_close;
+    mod_socket_un.ops.unlink = sock_unlink;
+    mod_socket_un.ops.open = sock_open;
+    mod_socket_un.ops.read = sock_read;
+    mod_socket_un.ops.write = sock_write;
 
     mod_socket_un.ops.socket     = sock_socket;
     mod_socket_un.ops.connect    = sock_connect;
@@ -95,10 +756,10 @@ void socket_un_init(void)
     mod_socket_un.ops.recvfrom   = sock_recvfrom;
     mod_socket_un.ops.sendto     = sock_sendto;
     mod_socket_un.ops.shutdown   = sock_shutdown;
+    mod_socket_un.ops.getsockopt  = sock_getsockopt;
+    mod_socket_un.ops.getsockname = sock_getsockname;
+    mod_socket_un.ops.getpeername = sock_getpeername;
 
     register_module(&mod_socket_un);
     register_addr_family(&mod_socket_un, FAMILY_UNIX);
 }
-
-
-
@@ -617,6 +617,31 @@ sdio_writeblock(SDIO_CARD c, uint32_t lba, uint8_t *buf) {
     return err;
 }
 
+/* Partial blocks are read, patched and written back */
+int sdio_block_write(struct fnode *fno, const void *_buf, uint32_t lba, int offset, int count)
+{
+    struct dev_sd *sdio;
+    uint8_t *blk;
+    int err;
+
+    sdio = (struct dev_sd *)FNO_MOD_PRIV(fno, &mod_sdio);
+    if (!sdio)
+        return -1;
+    if ((offset == 0) && (count == 512))
+        return sdio_writeblock(sdio->card, lba, (uint8_t *)_buf);
+
+    blk = kalloc(512);
+    if (!blk)
+        return -1;
+    err = sdio_block_read(fno, blk, lba, 0, 512);
+    if (!err) {
+        memcpy(blk + offset, _buf, count);
+        err = sdio_writeblock(sdio->card, lba, blk);
+    }
+    kfree(blk);
+    return err;
+}
+
 /*
  * sdio-status - Get Card Status page
  *
@@ -842,6 +867,7 @@ void stm32_sdio_init(struct fnode * dev)
 
     //mod_sdio.ops.close = sdio_close;
     mod_sdio.ops.block_read = sdio_block_read;
+    mod_sdio.ops.block_write = sdio_block_write;
 
     register_module(&mod_sdio);
     tasklet_add(stm32_sdio_card_detect, dev);
@@ -60,6 +60,7 @@ static struct module mod_devadc = {
 void dma2_stream0_isr()
 {
     struct dev_adc * adc = &DEV_ADC[0];
+    IRQPROF_ENTER();
 
     if((DMA2_LISR & DMA_LISR_TCIF0) != 0)
     {
@@ -69,11 +70,12 @@ void dma2_stream0_isr()
         if (adc->dev->pid > 0)
             task_resume(adc->dev->pid);
     }
+    IRQPROF_EXIT();
 }
 
 static int devadc_read(struct fnode *fno, void *buf, unsigned int len)
 {
-    int i;
+    int i, ret;
     struct dev_adc *adc;
 
     if (len <= 0)
@@ -83,7 +85,9 @@ static int devadc_read(struct fnode *fno, void *buf, unsigned int len)
     if (!adc)
         return -1;
 
-    frosted_mutex_lock(adc->dev->mutex);
+    ret = frosted_mutex_lock(adc->dev->mutex);
+    if (ret != 0)
+        return ret;
 
     if (adc->conversion_done == 0)
     {
@@ -67,11 +67,13 @@ void exti_register_callback(struct fnode *fno, exti_callback callback_fn, void *
 
 void exti_isr(uint32_t exti_base, uint32_t exti_idx)
 {
+    IRQPROF_ENTER();
     exti_reset_request(exti_base);
     if(exti_fno[exti_idx]->exti_callback_fn)
     {
         tasklet_add(exti_fno[exti_idx]->exti_callback_fn, exti_fno[exti_idx]->exti_callback_arg);
     }
+    IRQPROF_EXIT();
 }
 void exti0_isr(void)
 {
@@ -152,13 +152,17 @@ void i2c1_er_isr(void)
 }
 void dma1_stream0_isr()
 {
+    IRQPROF_ENTER();
     dma_clear_interrupt_flags(DMA1, DMA_STREAM0, DMA_LISR_TCIF0);
     i2c_rx_dma_complete(&DEV_I2C[0]);
+    IRQPROF_EXIT();
 }
 void dma1_stream6_isr()
 {
+    IRQPROF_ENTER();
     dma_clear_interrupt_flags(DMA1, DMA_STREAM6, DMA_LISR_TCIF0);
     i2c_tx_dma_complete(&DEV_I2C[0]);
+    IRQPROF_EXIT();
 }
 #endif
 
@@ -72,8 +72,10 @@ static void spi1_rx_dma_complete(struct dev_spi *spi)
 #ifdef CONFIG_SPI_1
 void dma2_stream2_isr()
 {
+    IRQPROF_ENTER();
     dma_clear_interrupt_flags(DMA2, DMA_STREAM2, DMA_LISR_TCIF0);
     spi1_rx_dma_complete(&DEV_SPI[0]);
+    IRQPROF_EXIT();
 }
 #endif
 
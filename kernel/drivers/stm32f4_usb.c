@@ -43,9 +43,11 @@ static struct dev_usb DEV_USB[MAX_USBS];
 void otg_fs_isr(void)
 {
     struct dev_usb *u = &DEV_USB[0];
+    IRQPROF_ENTER();
 
     if (u)
         usbd_poll(u->usbd_dev);
+    IRQPROF_EXIT();
 }
 
 usbd_device * usb_register_set_config_callback(usbd_set_config_callback callback)
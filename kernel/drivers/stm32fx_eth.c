@@ -266,6 +266,7 @@ int stm_eth_init(void)
 void eth_isr(void)
 {
     uint32_t bits = ETH_DMASR;
+    IRQPROF_ENTER();
 
     /* Clear all bits */
     eth_irq_ack_pending(ETH_DMASR);
@@ -275,5 +276,6 @@ void eth_isr(void)
         /* Receive Status bit set */
         dev_eth_stm->rx_prod++;
     }
+    IRQPROF_EXIT();
 }
 
@@ -27,7 +27,9 @@
 static struct fnode *sysfs;
 static struct module mod_sysfs;
 
-static frosted_mutex_t *sysfs_mutex = NULL;
+/* Held for reading while a file is read: readers of different files
+ * proceed together. Registering a file takes it for writing. */
+static rwlock_t *sysfs_rwlock = NULL;
 
 extern struct mountpoint *MTAB;
 extern struct f_malloc_stats f_malloc_stats[3];
@@ -35,31 +37,49 @@ extern struct f_malloc_stats f_malloc_stats[3];
 
 void sysfs_lock(void)
 {
-    if (sysfs_mutex)
-        frosted_mutex_lock(sysfs_mutex);
+    if (sysfs_rwlock)
+        rwlock_rdlock(sysfs_rwlock);
 }
 
 void sysfs_unlock(void)
 {
-    if (sysfs_mutex)
-        frosted_mutex_unlock(sysfs_mutex);
+    if (sysfs_rwlock)
+        rwlock_rdunlock(sysfs_rwlock);
+}
+
+static void sysfs_read_done(struct sysfs_fnode *mfno)
+{
+    mfno->reader = 0;
+    mfno->off = 0;
+    frosted_mutex_unlock(mfno->lock);
 }
 
 static int sysfs_read(struct fnode *fno, void *buf, unsigned int len)
 {
     struct sysfs_fnode *mfno;
+    int ret;
     if (len <= 0)
         return len;
 
     mfno = FNO_MOD_PRIV(fno, &mod_sysfs);
-    if (!mfno)
+    if (!mfno || !mfno->do_read)
         return -1;
 
-    if (mfno->do_read) {
-        return mfno->do_read(mfno, buf, len);
+    if (mfno->reader != scheduler_get_cur_pid()) {
+        /* Already read to the end */
+        if (fno->off != 0)
+            return -1;
+        ret = frosted_mutex_lock(mfno->lock);
+        if (ret != 0)
+            return ret;
+        mfno->reader = scheduler_get_cur_pid();
     }
-    return -1;
-
+    ret = mfno->do_read(mfno, buf, len);
+    if (ret < 0)
+        sysfs_read_done(mfno);
+    else
+        mfno->off = fno->off;
+    return ret;
 }
 
 static int sysfs_write(struct fnode *fno, const void *buf, unsigned int len)
@@ -69,7 +89,7 @@ static int sysfs_write(struct fnode *fno, const void *buf, unsigned int len)
         return len;
 
     mfno = FNO_MOD_PRIV(fno, &mod_sysfs);
-    if (mfno)
+    if (!mfno)
         return -1;
 
     if (mfno->do_write) {
@@ -88,9 +108,17 @@ static int sysfs_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
 static int sysfs_close(struct fnode *fno)
 {
     struct sysfs_fnode *mfno;
+    char scratch[32];
     mfno = FNO_MOD_PRIV(fno, &mod_sysfs);
     if (!mfno)
         return -1;
+    /* Closed before the end: let do_read() release its snapshot */
+    if (mfno->reader && ((mfno->reader == scheduler_get_cur_pid()) || (fno->usage == 0))) {
+        fno->off = mfno->off;
+        while (mfno->do_read(mfno, scratch, sizeof(scratch)) >= 0)
+            ;
+        sysfs_read_done(mfno);
+    }
     fno->off = 0;
     return 0;
 }
@@ -153,10 +181,12 @@ int sysfs_tasks_read(struct sysfs_fnode *sfs, void *buf, int len)
     int p_state;
     const char legend[]="pid\tstate\tstack\tname\r\n";
     if (fno->off == 0) {
-        frosted_mutex_lock(sysfs_mutex);
+        sysfs_lock();
         task_txt = kalloc(MAX_SYSFS_BUFFER);
-        if (!task_txt)
+        if (!task_txt) {
+            sysfs_unlock();
             return -1;
+        }
         off = 0;
 
         strcpy(task_txt, legend);
@@ -198,7 +228,7 @@ int sysfs_tasks_read(struct sysfs_fnode *sfs, void *buf, int len)
     }
     if (off == fno->off) {
         kfree(task_txt);
-        frosted_mutex_unlock(sysfs_mutex);
+        sysfs_unlock();
         return -1;
     }
     if (len > (off - fno->off)) {
@@ -238,10 +268,12 @@ int sysfs_mem_read(struct sysfs_fnode *sfs, void *buf, int len)
         const char mem_banner[] = "\tMemory in use: ";
         const char frags_banner[] = "\tReserved: ";
         int i;
-        frosted_mutex_lock(sysfs_mutex);
+        sysfs_lock();
         mem_txt = kalloc(MAX_SYSFS_BUFFER);
-        if (!mem_txt)
+        if (!mem_txt) {
+            sysfs_unlock();
             return -1;
+        }
         off = 0;
 
         for (i = 0; i < NPOOLS; i++) {
@@ -286,7 +318,7 @@ int sysfs_mem_read(struct sysfs_fnode *sfs, void *buf, int len)
     }
     if (off == fno->off) {
         kfree(mem_txt);
-        frosted_mutex_unlock(sysfs_mutex);
+        sysfs_unlock();
         return -1;
     }
     if (len > (off - fno->off)) {
@@ -309,10 +341,12 @@ int sysfs_modules_read(struct sysfs_fnode *sfs, void *buf, int len)
     struct module *m = MODS;
     if (fno->off == 0) {
         const char mod_banner[] = "Loaded modules:\r\n";
-        frosted_mutex_lock(sysfs_mutex);
+        sysfs_lock();
         mem_txt = kalloc(MAX_SYSFS_BUFFER);
-        if (!mem_txt)
+        if (!mem_txt) {
+            sysfs_unlock();
             return -1;
+        }
         off = 0;
         strcpy(mem_txt + off, mod_banner);
         off += strlen(mod_banner);
@@ -327,7 +361,7 @@ int sysfs_modules_read(struct sysfs_fnode *sfs, void *buf, int len)
     }
     if (off == fno->off) {
         kfree(mem_txt);
-        frosted_mutex_unlock(sysfs_mutex);
+        sysfs_unlock();
         return -1;
     }
     if (len > (off - fno->off)) {
@@ -351,10 +385,12 @@ int sysfs_mtab_read(struct sysfs_fnode *sfs, void *buf, int len)
     int l = 0;
     if (fno->off == 0) {
         const char mtab_banner[] = "Mountpoint\tDriver\t\tInfo\r\n--------------------------------------\r\n";
-        frosted_mutex_lock(sysfs_mutex);
+        sysfs_lock();
         mem_txt = kalloc(MAX_SYSFS_BUFFER);
-        if (!mem_txt)
+        if (!mem_txt) {
+            sysfs_unlock();
             return -1;
+        }
         off = 0;
         strcpy(mem_txt + off, mtab_banner);
         off += strlen(mtab_banner);
@@ -393,7 +429,7 @@ int sysfs_mtab_read(struct sysfs_fnode *sfs, void *buf, int len)
     }
     if (off == fno->off) {
         kfree(mem_txt);
-        frosted_mutex_unlock(sysfs_mutex);
+        sysfs_unlock();
         return -1;
     }
     if (len > (off - fno->off)) {
@@ -414,20 +450,34 @@ int sysfs_register(char *name, char *dir,
         int (*do_read)(struct sysfs_fnode *sfs, void *buf, int len),
         int (*do_write)(struct sysfs_fnode *sfs, const void *buf, int len) )
 {
-    struct fnode *fno = fno_create(&mod_sysfs, name, fno_search(dir));
+    struct fnode *fno;
     struct sysfs_fnode *mfs;
-    if (!fno)
+    int ret = -1;
+
+    /* Not while a file is being read */
+    if (sysfs_rwlock && (rwlock_trywrlock(sysfs_rwlock) < 0))
         return -1;
+    fno = fno_create(&mod_sysfs, name, fno_search(dir));
+    if (!fno)
+        goto out;
 
-    mfs = kalloc(sizeof(struct sysfs_fnode));
+    mfs = kcalloc(sizeof(struct sysfs_fnode), 1);
     if (mfs) {
+        mfs->lock = frosted_mutex_init();
+        if (!mfs->lock) {
+            kfree(mfs);
+            goto out;
+        }
         mfs->fnode = fno;
         fno->priv = mfs;
         mfs->do_read = do_read;
         mfs->do_write = do_write;
-        return 0;
+        ret = 0;
     }
-    return -1;
+out:
+    if (sysfs_rwlock)
+        rwlock_wrunlock(sysfs_rwlock);
+    return ret;
 }
 
 static int sysfs_mount(char *source, char *tgt, uint32_t flags, void *args)
@@ -477,5 +527,5 @@ void sysfs_init(void)
     sysfs = fno_search("/sys");
     register_module(&mod_sysfs);
     fno_mkdir(&mod_sysfs, "net", sysfs);
-    sysfs_mutex = frosted_mutex_init();
+    sysfs_rwlock = rwlock_init();
 }
@@ -91,12 +91,15 @@ static void uart_send_break(void *arg)
 
 void uart_isr(struct dev_uart *uart)
 {
+    IRQPROF_ENTER();
+
     /* TX interrupt */
     if (usart_get_interrupt_source(uart->base, USART_SR_TXE)) {
         usart_clear_tx_interrupt(uart->base);
 
-        if (scheduler_get_cur_pid() != 0) /* cannot spinlock in ISR! */
-            frosted_mutex_lock(uart->dev->mutex);
+        /* No locking needed: devuart_write() masks the TX interrupt
+         * while it takes bytes from outbuf to start a transmission, so
+         * there is one consumer at a time. */
 
         /* Are there bytes left to be written? */
         if (cirbuf_bytesinuse(uart->outbuf))
@@ -106,11 +109,11 @@ void uart_isr(struct dev_uart *uart)
             usart_send(uart->base, (uint16_t)(outbyte));
         } else {
             usart_disable_tx_interrupt(uart->base);
+            epoll_notify(uart->dev->fno, POLLOUT);
             /* If a process is attached, resume the process */
             if (uart->dev->pid > 0)
                 task_resume(uart->dev->pid);
         }
-        frosted_mutex_unlock(uart->dev->mutex);
     }
 
     /* RX interrupt */
@@ -126,16 +129,18 @@ void uart_isr(struct dev_uart *uart)
                 if (uart->sid > 1) {
                     tasklet_add(uart_send_break, &uart->sid);
                 }
+                IRQPROF_EXIT();
                 return;
             }
             /* read data into circular buffer */
             cirbuf_writebyte(uart->inbuf, byte);
+            epoll_notify(uart->dev->fno, POLLIN);
         }
         /* If a process is attached, resume the process */
         if (uart->dev->pid > 0)
             task_resume(uart->dev->pid);
     }
-
+    IRQPROF_EXIT();
 }
 
 void uart0_isr(void)
@@ -197,7 +202,7 @@ static void devuart_tty_attach(struct fnode *fno, int pid)
 
 static int devuart_write(struct fnode *fno, const void *buf, unsigned int len)
 {
-    int i;
+    int i, ret;
     char *ch = (char *)buf;
     struct dev_uart *uart;
     
@@ -205,22 +210,30 @@ static int devuart_write(struct fnode *fno, const void *buf, unsigned int len)
     if (!uart)
         return -1;
         
-    frosted_mutex_lock(uart->dev->mutex);
+    ret = frosted_mutex_lock(uart->dev->mutex);
+    if (ret != 0)
+        return ret;
+    /* Syscalls are preemptible: keep the TX ISR away from outbuf */
+    usart_disable_tx_interrupt(uart->base);
     if (cirbuf_bytesinuse(uart->outbuf) && usart_is_send_ready(uart->base)) {
         char c;
         cirbuf_readbyte(uart->outbuf, &c);
         usart_send(uart->base, (uint16_t) c);
-        usart_enable_tx_interrupt(uart->base);
     }
 
     if (!cirbuf_bytesfree(uart->outbuf)) {
+        usart_enable_tx_interrupt(uart->base);
         frosted_mutex_unlock(uart->dev->mutex);
         task_preempt();
         return SYS_CALL_AGAIN;
     }
 
-    if (len <= 0)
+    if (len <= 0) {
+        if (cirbuf_bytesinuse(uart->outbuf))
+            usart_enable_tx_interrupt(uart->base);
+        frosted_mutex_unlock(uart->dev->mutex);
         return len;
+    }
     if (uart->w_start == NULL) {
         uart->w_start = (uint8_t *)buf;
         uart->w_end = ((uint8_t *)buf) + len;
@@ -236,12 +249,10 @@ static int devuart_write(struct fnode *fno, const void *buf, unsigned int len)
         char c;
         cirbuf_readbyte(uart->outbuf, &c);
         usart_send(uart->base, (uint16_t) c);
-        usart_enable_tx_interrupt(uart->base);
     }
 
     if (cirbuf_bytesinuse(uart->outbuf) == 0) {
         frosted_mutex_unlock(uart->dev->mutex);
-        usart_disable_tx_interrupt(uart->base);
         uart->w_start = NULL;
         uart->w_end = NULL;
         return len;
@@ -250,12 +261,15 @@ static int devuart_write(struct fnode *fno, const void *buf, unsigned int len)
 
     if (uart->w_start < uart->w_end)
     {
+        /* Suspend before unmasking TX, so the wakeup cannot be lost */
         uart->dev->pid = scheduler_get_cur_pid();
-        frosted_mutex_unlock(uart->dev->mutex);
         task_suspend();
+        usart_enable_tx_interrupt(uart->base);
+        frosted_mutex_unlock(uart->dev->mutex);
         return SYS_CALL_AGAIN;
     }
 
+    usart_enable_tx_interrupt(uart->base);
     frosted_mutex_unlock(uart->dev->mutex);
     uart->w_start = NULL;
     uart->w_end = NULL;
@@ -265,9 +279,8 @@ static int devuart_write(struct fnode *fno, const void *buf, unsigned int len)
 
 static int devuart_read(struct fnode *fno, void *buf, unsigned int len)
 {
-    int out;
-    volatile int len_available;
-    char *ptr = (char *)buf;
+    int out, ret;
+    uint32_t primask;
     struct dev_uart *uart;
 
     if (len <= 0)
@@ -277,29 +290,22 @@ static int devuart_read(struct fnode *fno, void *buf, unsigned int len)
     if (!uart)
         return -1;
 
-    frosted_mutex_lock(uart->dev->mutex);
-    usart_disable_rx_interrupt(uart->base);
-    len_available =  cirbuf_bytesinuse(uart->inbuf);
-    if (len_available <= 0) {
+    /* inbuf is filled by the RX ISR and drained here without masking
+     * the interrupt: the mutex keeps readers to one at a time. */
+    ret = frosted_mutex_lock(uart->dev->mutex);
+    if (ret != 0)
+        return ret;
+    primask = irq_save();
+    if (cirbuf_bytesinuse(uart->inbuf) <= 0) {
         uart->dev->pid = scheduler_get_cur_pid();
         task_suspend();
+        irq_restore(primask);
         frosted_mutex_unlock(uart->dev->mutex);
-        out = SYS_CALL_AGAIN;
-        goto again;
-    }
-
-    if (len_available < len)
-        len = len_available;
-
-    for(out = 0; out < len; out++) {
-        /* read data */
-        if (cirbuf_readbyte(uart->inbuf, ptr) != 0)
-            break;
-        ptr++;
+        return SYS_CALL_AGAIN;
     }
+    irq_restore(primask);
 
-again:
-    usart_enable_rx_interrupt(uart->base);
+    out = cirbuf_readbytes(uart->inbuf, buf, len);
     frosted_mutex_unlock(uart->dev->mutex);
     return out;
 }
@@ -314,9 +320,8 @@ static int devuart_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
     if (!uart)
         return -1;
 
+    /* Only looks at the fill levels: no need to wait for the mutex */
     uart->dev->pid = scheduler_get_cur_pid();
-    frosted_mutex_lock(uart->dev->mutex);
-    usart_disable_rx_interrupt(uart->base);
     *revents = 0;
     if ((events & POLLOUT) && (cirbuf_bytesfree(uart->outbuf) > 0)) {
         *revents |= POLLOUT;
@@ -326,8 +331,6 @@ static int devuart_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
         *revents |= POLLIN;
         ret = 1;
     }
-    usart_enable_rx_interrupt(uart->base);
-    frosted_mutex_unlock(uart->dev->mutex);
     return ret;
 }
 
@@ -363,8 +363,10 @@ static void pico_usbeth_destroy(struct pico_device *dev)
 
 void otg_fs_isr(void)
 {
+    IRQPROF_ENTER();
     if (pico_usbeth)
         usbd_poll(pico_usbeth->usbd_dev);
+    IRQPROF_EXIT();
 }
 
 
@@ -60,6 +60,24 @@ static int xipfs_read(struct fnode *fno, void *buf, unsigned int len)
     return len;
 }
 
+/* Files are executed in place: their content is directly addressable */
+static void *xipfs_mmap(struct fnode *fno, uint32_t off, uint32_t *len)
+{
+    struct xipfs_fnode *xfno;
+
+    xfno = FNO_MOD_PRIV(fno, &mod_xipfs);
+    if (!xfno)
+        return NULL;
+
+    if (off >= fno->size)
+        return NULL;
+
+    if (*len > (fno->size - off))
+        *len = fno->size - off;
+
+    return ((char *)xfno->init) + off;
+}
+
 static int xipfs_block_read(struct fnode *fno, void *buf, uint32_t sector, int offset, int count)
 {
     fno->off = sector * SECTOR_SIZE + offset;
@@ -214,6 +232,8 @@ void xipfs_init(void)
     mod_xipfs.ops.unlink = xipfs_unlink;
     mod_xipfs.ops.close = xipfs_close;
     mod_xipfs.ops.exe = xipfs_exe;
+    mod_xipfs.ops.mmap = xipfs_mmap;
+    mod_xipfs.ops.contents = xipfs_mmap;
 
     mod_xipfs.ops.block_read = xipfs_block_read;
     register_module(&mod_xipfs);
@@ -0,0 +1,393 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+#include "poll.h"
+
+/* epoll: readiness notification through a ready list.
+ *
+ * Every watched file keeps the list of the epoll items referring to it
+ * (fno->epitems). Modules call epoll_notify() when a file becomes
+ * readable or writable, possibly from an ISR: the items interested are
+ * queued on the ready list of their instance, and the task waiting in
+ * epoll_wait() is resumed. epoll_wait() only visits the ready list.
+ *
+ * Level-triggered items stay queued as long as ops.poll reports them
+ * ready. Edge-triggered items (EPOLLET) are dequeued once reported, and
+ * queued again by the next notification.
+ *
+ * Files whose module never calls epoll_notify() are checked when added:
+ * in level-triggered mode they are reported for as long as they are
+ * ready, like with poll().
+ */
+
+#define EPOLL_ALWAYS (EPOLLERR | EPOLLHUP)
+
+struct eventpoll;
+
+struct epitem {
+    struct fnode *fno;
+    struct eventpoll *ep;
+    struct epoll_event event;
+    uint8_t ready;
+    struct epitem *next;        /* Items of the same instance */
+    struct epitem *fno_next;    /* Items watching the same file */
+    struct epitem *rd_next;     /* Ready list */
+};
+
+struct eventpoll {
+    struct fnode *fno;
+    struct epitem *items;
+    struct epitem *rd_head;
+    struct epitem *rd_tail;
+    int pid;                    /* Task waiting in epoll_wait() */
+    uint32_t deadline;
+    uint8_t timer;              /* Timeout armed for the current wait */
+};
+
+static int epoll_poll(struct fnode *f, uint16_t events, uint16_t *revents);
+static int epoll_close(struct fnode *f);
+
+static struct module mod_epoll = {
+    .family = FAMILY_FILE,
+    .name = "epoll",
+    .ops.poll = epoll_poll,
+    .ops.close = epoll_close,
+};
+
+static struct fnode EPOLL_ROOT = {
+};
+
+/* Ready list: accessed from ISRs, call with interrupts masked */
+static void rd_enqueue(struct epitem *it)
+{
+    struct eventpoll *ep = it->ep;
+    if (it->ready)
+        return;
+    it->ready = 1;
+    it->rd_next = NULL;
+    if (ep->rd_tail)
+        ep->rd_tail->rd_next = it;
+    else
+        ep->rd_head = it;
+    ep->rd_tail = it;
+}
+
+static struct epitem *rd_dequeue(struct eventpoll *ep)
+{
+    struct epitem *it = ep->rd_head;
+    if (!it)
+        return NULL;
+    ep->rd_head = it->rd_next;
+    if (!ep->rd_head)
+        ep->rd_tail = NULL;
+    it->ready = 0;
+    return it;
+}
+
+static void rd_remove(struct epitem *it)
+{
+    struct eventpoll *ep = it->ep;
+    struct epitem *prev = NULL, *cur = ep->rd_head;
+    while (cur && (cur != it)) {
+        prev = cur;
+        cur = cur->rd_next;
+    }
+    if (!cur)
+        return;
+    if (prev)
+        prev->rd_next = it->rd_next;
+    else
+        ep->rd_head = it->rd_next;
+    if (ep->rd_tail == it)
+        ep->rd_tail = prev;
+    it->ready = 0;
+}
+
+/* Called by the modules when the state of fno changes (ISR safe) */
+void epoll_notify(struct fnode *fno, uint16_t events)
+{
+    struct epitem *it;
+    uint32_t primask;
+    if (!fno)
+        return;
+    primask = irq_save();
+    for (it = fno->epitems; it; it = it->fno_next) {
+        if (((it->event.events | EPOLL_ALWAYS) & events) == 0)
+            continue;
+        rd_enqueue(it);
+        if (it->ep->pid > 0)
+            task_resume(it->ep->pid);
+    }
+    irq_restore(primask);
+}
+
+/* Current readiness of the file, among the events of interest */
+static uint32_t epitem_poll(struct epitem *it)
+{
+    uint16_t want = (it->event.events & 0xFFFF) | EPOLL_ALWAYS;
+    uint16_t rev = 0;
+    struct module *mod = it->fno->owner;
+    if (mod && mod->ops.poll)
+        mod->ops.poll(it->fno, want, &rev);
+    else
+        rev = want & (EPOLLIN | EPOLLOUT);
+    return rev & want;
+}
+
+static void epitem_del(struct epitem *it)
+{
+    struct eventpoll *ep = it->ep;
+    struct epitem **pp;
+    uint32_t primask;
+
+    primask = irq_save();
+    for (pp = &it->fno->epitems; *pp; pp = &(*pp)->fno_next) {
+        if (*pp == it) {
+            *pp = it->fno_next;
+            break;
+        }
+    }
+    if (it->ready)
+        rd_remove(it);
+    irq_restore(primask);
+
+    for (pp = &ep->items; *pp; pp = &(*pp)->next) {
+        if (*pp == it) {
+            *pp = it->next;
+            break;
+        }
+    }
+    kfree(it);
+}
+
+/* fno is going away: drop it from all the interest lists */
+void epoll_forget(struct fnode *fno)
+{
+    while (fno->epitems)
+        epitem_del(fno->epitems);
+}
+
+static struct eventpoll *epoll_get(int fd)
+{
+    struct fnode *fno = task_filedesc_get(fd);
+    if (!fno || (fno->owner != &mod_epoll))
+        return NULL;
+    return (struct eventpoll *)fno->priv;
+}
+
+static int epoll_poll(struct fnode *f, uint16_t events, uint16_t *revents)
+{
+    struct eventpoll *ep = (struct eventpoll *)f->priv;
+    *revents = 0;
+    if (ep && ep->rd_head && (events & POLLIN)) {
+        *revents = POLLIN;
+        return 1;
+    }
+    return 0;
+}
+
+static int epoll_close(struct fnode *f)
+{
+    struct eventpoll *ep = (struct eventpoll *)f->priv;
+    if (f->usage > 0)
+        return 0;
+    if (ep) {
+        while (ep->items)
+            epitem_del(ep->items);
+        kfree(ep);
+    }
+    f->priv = NULL;
+    fno_unlink(f);
+    return 0;
+}
+
+int sys_epoll_create_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct eventpoll *ep;
+    struct fnode *fno;
+    int fd;
+
+    ep = kcalloc(sizeof(struct eventpoll), 1);
+    if (!ep)
+        return -ENOMEM;
+    fno = fno_create(&mod_epoll, "", &EPOLL_ROOT);
+    if (!fno) {
+        kfree(ep);
+        return -ENOMEM;
+    }
+    ep->fno = fno;
+    fno->priv = ep;
+    fd = task_filedesc_add(fno);
+    if (fd < 0) {
+        fno_unlink(fno);
+        kfree(ep);
+        return fd;
+    }
+    return fd;
+}
+
+int sys_epoll_ctl_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct eventpoll *ep = epoll_get(arg1);
+    int op = (int)arg2;
+    struct fnode *fno = task_filedesc_get(arg3);
+    struct epoll_event *ev = (struct epoll_event *)arg4;
+    struct epitem *it;
+    uint32_t primask;
+
+    if (!ep || !fno)
+        return -EBADF;
+    if (fno == ep->fno)
+        return -EINVAL;
+    for (it = ep->items; it; it = it->next) {
+        if (it->fno == fno)
+            break;
+    }
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (it)
+                return -EEXIST;
+            if (!ev)
+                return -EFAULT;
+            it = kcalloc(sizeof(struct epitem), 1);
+            if (!it)
+                return -ENOMEM;
+            it->fno = fno;
+            it->ep = ep;
+            it->event = *ev;
+            it->next = ep->items;
+            ep->items = it;
+            primask = irq_save();
+            it->fno_next = fno->epitems;
+            fno->epitems = it;
+            irq_restore(primask);
+            break;
+        case EPOLL_CTL_MOD:
+            if (!it)
+                return -ENOENT;
+            if (!ev)
+                return -EFAULT;
+            primask = irq_save();
+            it->event = *ev;
+            irq_restore(primask);
+            break;
+        case EPOLL_CTL_DEL:
+            if (!it)
+                return -ENOENT;
+            epitem_del(it);
+            return 0;
+        default:
+            return -EINVAL;
+    }
+
+    /* Report files that are ready already */
+    if (epitem_poll(it)) {
+        primask = irq_save();
+        rd_enqueue(it);
+        irq_restore(primask);
+    }
+    return 0;
+}
+
+static void epoll_timeout(uint32_t now, void *arg)
+{
+    task_resume((int)arg);
+}
+
+int sys_epoll_wait_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct eventpoll *ep = epoll_get(arg1);
+    struct epoll_event *out = (struct epoll_event *)arg2;
+    int maxevents = (int)arg3;
+    int timeout = (int)arg4;
+    int pid = scheduler_get_cur_pid();
+    struct epitem *it;
+    uint32_t primask, rev;
+    int n = 0, todo;
+
+    if (!ep)
+        return -EBADF;
+    if (!out || (maxevents <= 0))
+        return -EINVAL;
+
+    /* Restarted after a wakeup? */
+    if (ep->pid == pid) {
+        if ((timeout > 0) && (jiffies >= ep->deadline)) {
+            ep->pid = 0;
+            return 0;
+        }
+    } else {
+        ep->deadline = jiffies + timeout;
+        ep->timer = 0;
+    }
+
+    /* Notifications from now on wake this task up */
+    ep->pid = pid;
+
+again:
+    /* Visit each queued item once: level-triggered ones are requeued */
+    primask = irq_save();
+    for (todo = 0, it = ep->rd_head; it; it = it->rd_next)
+        todo++;
+    irq_restore(primask);
+
+    while ((todo-- > 0) && (n < maxevents)) {
+        primask = irq_save();
+        it = rd_dequeue(ep);
+        irq_restore(primask);
+        if (!it)
+            break;
+        rev = epitem_poll(it);
+        if (!rev)
+            continue;
+        out[n].events = rev;
+        out[n].data = it->event.data;
+        n++;
+        if (!(it->event.events & EPOLLET)) {
+            primask = irq_save();
+            rd_enqueue(it);
+            irq_restore(primask);
+        }
+    }
+
+    if ((n > 0) || (timeout == 0)) {
+        ep->pid = 0;
+        return n;
+    }
+
+    /* A stale timer from a previous wait only causes an early restart */
+    if ((timeout > 0) && !ep->timer) {
+        ktimer_add(ep->deadline - jiffies, epoll_timeout, (void *)pid);
+        ep->timer = 1;
+    }
+
+    primask = irq_save();
+    if (ep->rd_head) {
+        /* Notified in the meantime */
+        irq_restore(primask);
+        goto again;
+    }
+    task_suspend();
+    irq_restore(primask);
+    return SYS_CALL_AGAIN;
+}
@@ -0,0 +1,266 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+#include "poll.h"
+
+/* Event descriptors: a 64-bit counter behind a file descriptor.
+ *
+ * write() adds an 8-byte value to the counter, read() returns it and
+ * resets it to zero (or, with EFD_SEMAPHORE, returns 1 and decrements
+ * it). Reads block while the counter is zero, writes while it would
+ * overflow. The descriptor can be polled, so it is a cheap way to tell
+ * a task "something happened" without a pipe.
+ *
+ * Kernel code can keep a reference to an event descriptor (see
+ * eventfd_get()) and signal it with eventfd_signal(), e.g. from a
+ * tasklet.
+ */
+
+#define EVENTFD_MAX 0xFFFFFFFFFFFFFFFEULL
+
+struct eventfd {
+    struct fnode *fno;
+    uint64_t count;
+    uint8_t semaphore;
+    uint8_t closed;             /* No more descriptors */
+    uint16_t refs;              /* Kernel references */
+    uint16_t pid_r;
+    uint16_t pid_w;
+};
+
+static struct module mod_eventfd;
+
+static void eventfd_free(struct eventfd *ev)
+{
+    kfree(ev->fno);
+    kfree(ev);
+}
+
+/* The counter was raised */
+static void eventfd_wake_reader(struct eventfd *ev)
+{
+    if (ev->pid_r > 0)
+        task_resume(ev->pid_r);
+    epoll_notify(ev->fno, POLLIN);
+}
+
+/* The counter was lowered */
+static void eventfd_wake_writer(struct eventfd *ev)
+{
+    if (ev->pid_w > 0)
+        task_resume(ev->pid_w);
+    epoll_notify(ev->fno, POLLOUT);
+}
+
+/* Adds n, if it fits. Returns 0, or -EAGAIN. */
+static int eventfd_add(struct eventfd *ev, uint64_t n)
+{
+    uint32_t primask = irq_save();
+    if (n > (EVENTFD_MAX - ev->count)) {
+        irq_restore(primask);
+        return -EAGAIN;
+    }
+    ev->count += n;
+    irq_restore(primask);
+    return 0;
+}
+
+static int eventfd_read(struct fnode *f, void *buf, unsigned int len)
+{
+    struct eventfd *ev = (struct eventfd *)f->priv;
+    uint64_t val;
+    uint32_t primask;
+
+    if (!ev)
+        return -EINVAL;
+    if (len < sizeof(uint64_t))
+        return -EINVAL;
+
+    /* Masked: eventfd_signal() cannot slip in before the sleep */
+    primask = irq_save();
+    val = ev->count;
+    if (val == 0) {
+        if (!FNO_BLOCKING(f)) {
+            irq_restore(primask);
+            return -EAGAIN;
+        }
+        ev->pid_r = scheduler_get_cur_pid();
+        task_suspend();
+        irq_restore(primask);
+        return SYS_CALL_AGAIN;
+    }
+    if (ev->semaphore)
+        val = 1;
+    ev->count -= val;
+    irq_restore(primask);
+
+    ev->pid_r = 0;
+    memcpy(buf, &val, sizeof(uint64_t));
+    eventfd_wake_writer(ev);
+    return sizeof(uint64_t);
+}
+
+static int eventfd_write(struct fnode *f, const void *buf, unsigned int len)
+{
+    struct eventfd *ev = (struct eventfd *)f->priv;
+    uint64_t val;
+
+    if (!ev)
+        return -EINVAL;
+    if (len < sizeof(uint64_t))
+        return -EINVAL;
+    memcpy(&val, buf, sizeof(uint64_t));
+    if (val > EVENTFD_MAX)
+        return -EINVAL;
+
+    if (eventfd_add(ev, val) < 0) {
+        if (!FNO_BLOCKING(f))
+            return -EAGAIN;
+        ev->pid_w = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+    ev->pid_w = 0;
+    if (val > 0)
+        eventfd_wake_reader(ev);
+    return sizeof(uint64_t);
+}
+
+static int eventfd_poll(struct fnode *f, uint16_t events, uint16_t *revents)
+{
+    struct eventfd *ev = (struct eventfd *)f->priv;
+    *revents = 0;
+    if (!ev)
+        return -EINVAL;
+    if ((events & POLLIN) && (ev->count > 0))
+        *revents |= POLLIN;
+    if ((events & POLLOUT) && (ev->count < EVENTFD_MAX))
+        *revents |= POLLOUT;
+    if (*revents)
+        return 1;
+    if (events & POLLIN)
+        ev->pid_r = scheduler_get_cur_pid();
+    if (events & POLLOUT)
+        ev->pid_w = scheduler_get_cur_pid();
+    return 0;
+}
+
+static int eventfd_close(struct fnode *f)
+{
+    struct eventfd *ev = (struct eventfd *)f->priv;
+    if (!ev)
+        return -EINVAL;
+    if (f->usage > 0)
+        return 0;
+    ev->closed = 1;
+    if (!ev->refs)
+        eventfd_free(ev);
+    return 0;
+}
+
+/* Kernel API */
+
+/* Takes a reference to the event descriptor 'fd' of the current task,
+ * which stays valid after the task closes it, until eventfd_put(). */
+struct fnode *eventfd_get(int fd)
+{
+    struct file *f = task_file_get(fd);
+    struct eventfd *ev;
+    if (!f || (f->fno->owner != &mod_eventfd) || !f->fno->priv)
+        return NULL;
+    ev = (struct eventfd *)f->fno->priv;
+    ev->refs++;
+    return f->fno;
+}
+
+void eventfd_put(struct fnode *fno)
+{
+    struct eventfd *ev = (struct eventfd *)fno->priv;
+    if (!ev || (ev->refs == 0))
+        return;
+    ev->refs--;
+    if (!ev->refs && ev->closed)
+        eventfd_free(ev);
+}
+
+/* Adds n to the counter, and wakes up the reader. Does not block: the
+ * value is dropped (-EAGAIN) if it would overflow the counter. Meant
+ * for kernel context (e.g. tasklets); from an interrupt handler, defer
+ * it with tasklet_add(). */
+int eventfd_signal(struct fnode *fno, uint32_t n)
+{
+    struct eventfd *ev;
+    int ret;
+    if (!fno || (fno->owner != &mod_eventfd) || !fno->priv)
+        return -EINVAL;
+    ev = (struct eventfd *)fno->priv;
+    if (ev->closed)
+        return -EPIPE;
+    ret = eventfd_add(ev, n);
+    if ((ret == 0) && (n > 0))
+        eventfd_wake_reader(ev);
+    return ret;
+}
+
+/* eventfd(initval, flags) */
+int sys_eventfd_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    uint32_t flags = arg2;
+    struct eventfd *ev;
+    int fd;
+
+    if (flags & ~(EFD_SEMAPHORE | EFD_NONBLOCK))
+        return -EINVAL;
+    ev = kcalloc(sizeof(struct eventfd), 1);
+    if (!ev)
+        return -ENOMEM;
+    /* Not part of the tree: freed with the last descriptor */
+    ev->fno = kcalloc(sizeof(struct fnode), 1);
+    if (!ev->fno) {
+        kfree(ev);
+        return -ENOMEM;
+    }
+    ev->fno->owner = &mod_eventfd;
+    ev->fno->flags = FL_RDWR | (flags & EFD_NONBLOCK);
+    ev->fno->priv = ev;
+    ev->count = arg1;
+    ev->semaphore = !!(flags & EFD_SEMAPHORE);
+
+    fd = task_filedesc_add(ev->fno);
+    if (fd < 0) {
+        eventfd_free(ev);
+        return fd;
+    }
+    task_fd_setmask(fd, O_RDWR);
+    return fd;
+}
+
+void eventfd_init(void)
+{
+    mod_eventfd.family = FAMILY_FILE;
+    strcpy(mod_eventfd.name, "eventfd");
+    mod_eventfd.ops.read = eventfd_read;
+    mod_eventfd.ops.write = eventfd_write;
+    mod_eventfd.ops.poll = eventfd_poll;
+    mod_eventfd.ops.close = eventfd_close;
+    register_module(&mod_eventfd);
+}
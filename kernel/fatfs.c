@@ -29,18 +29,49 @@
 
 static struct module mod_fatfs = { };
 
+typedef uint32_t fatfs_cluster;
+
 struct fatfs_disk {
     struct fnode *blockdev;
     struct fnode *mountpoint;
     struct fatfs *fs;
+    struct fatfs_disk *next;
+    uint8_t populated;      /* Root directory read */
 };
 
+/* Run of contiguous clusters in a file */
+struct fatfs_extent {
+    uint32_t idx;           /* Cluster index in the file */
+    fatfs_cluster clust;    /* First cluster on disk */
+    uint32_t len;           /* Number of clusters */
+};
+
+/* Files and directories. The root directory is the mountpoint,
+ * which has no private data (cluster 0). */
 struct fatfs_priv {
-    int cluster;
+    fatfs_cluster cluster;  /* Start cluster, 0: none allocated */
     struct fatfs_disk *fsd;
+    uint32_t dirsect;       /* Location of the directory entry */
+    uint16_t dirofs;
+    struct fatfs_extent *ext;   /* Cluster map, built on demand */
+    uint8_t n_ext;
+    uint8_t populated;      /* Directories: children in the VFS tree */
+    uint32_t stamp;         /* Directories: last lookup */
 };
 
-typedef uint32_t fatfs_cluster;
+static struct fatfs_disk *fatfs_disks = NULL;
+
+/* Cluster map size, per file */
+#define FATFS_MAX_EXTENTS   16
+#define FATFS_EXTENT_STEP   4
+
+#ifndef CONFIG_FATFS_MAX_NODES
+#   define CONFIG_FATFS_MAX_NODES 128
+#endif
+#define FATFS_MAX_NODES CONFIG_FATFS_MAX_NODES
+
+/* Set while the VFS tree is built from the disk contents */
+static int fatfs_populating = 0;
 #ifdef CONFIG_FAT32
 # define FATFS_FAT32	1	/* Enable FAT32 */
 #endif
@@ -61,14 +92,16 @@ typedef uint32_t fatfs_cluster;
 
 #define	LD_WORD(ptr)		(uint16_t)(*(uint16_t *)(ptr))
 #define	LD_DWORD(ptr)		(uint32_t)(*(uint32_t *)(ptr))
+#define	ST_WORD(ptr,val)	*(uint16_t *)(ptr) = (uint16_t)(val)
+#define	ST_DWORD(ptr,val)	*(uint32_t *)(ptr) = (uint32_t)(val)
 #define FATFS_CODE_PAGE (858)
 
 #define _USE_LCC	1	/* Allow lower case characters for path name */
 
 
-/* Macro proxies for disk operations */
-#define disk_readp(f,b,s,o,l) f->blockdev->owner->ops.block_read(f->blockdev,b,s,o,l)
-#define disk_writep(f,b,s,o,l) f->blockdev->owner->ops.block_write(f->blockdev,b,s,o,l)
+/* Macro proxies for disk operations, through the block buffer cache */
+#define disk_readp(f,b,s,o,l) bcache_read(f->blockdev,b,s,o,l)
+#define disk_writep(f,b,s,o,l) bcache_write(f->blockdev,b,s,o,l)
 
 
 /* File system object structure */
@@ -77,17 +110,14 @@ struct fatfs {
     uint8_t	fs_type;	/* FAT sub type */
     uint8_t	flag;		/* File status flags */
     uint8_t	csize;		/* Number of sectors per cluster */
-    uint8_t	pad1;
+    uint8_t	n_fats;		/* Number of FAT copies */
     uint16_t	n_rootdir;	/* Number of root directory entries (0 on FAT32) */
     fatfs_cluster n_fatent;	/* Number of FAT entries (= number of clusters + 2) */
     uint32_t	fatbase;	/* FAT start sector */
+    uint32_t	fatsize;	/* Number of sectors per FAT copy */
     uint32_t	dirbase;	/* Root directory start sector (Cluster# on FAT32) */
     uint32_t	database;	/* Data start sector */
-    uint32_t	fptr;		/* File R/W pointer */
-    uint32_t	fsize;		/* File size */
-    fatfs_cluster	org_clust;	/* File start cluster */
-    fatfs_cluster	curr_clust;	/* File current cluster */
-    uint32_t	dsect;		/* File current data sector */
+    fatfs_cluster	last_clust;	/* Last allocated cluster (allocation hint) */
 };
 
 
@@ -125,12 +155,12 @@ struct fatfs_finfo{
 #define FR_NOT_OPENED    4
 #define FR_NOT_ENABLED   5
 #define FR_NO_FILESYSTEM 6	
+#define FR_DENIED        7
+#define FR_NO_SPACE      8
 
-/* File status flag (struct fatfs.flag) */
+/* File system flags (struct fatfs.flag) */
 
-#define	FA_OPENED	0x01
-#define	FA_WPRT		0x02
-#define	FA__WIP		0x40
+#define	FA_WPRT		0x02	/* Block device is read-only */
 
 /* DISK status */
 #define STA_OK          0x00
@@ -162,10 +192,6 @@ struct fatfs_finfo{
 
   ---------------------------------------------------------------------------*/
 
-#define ABORT(err)	{fs->flag = 0; return err;}
-
-
-
 /*---------------------------------------------------------------------------/
   / Locale and Namespace Configurations
   /---------------------------------------------------------------------------*/
@@ -474,6 +500,143 @@ fatfs_cluster get_fat (struct fatfs_disk *f, fatfs_cluster clst)
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT access - Change value of a FAT entry, in all the FAT copies       */
+/*-----------------------------------------------------------------------*/
+/* 0: OK, else: IO error. Updated FAT sectors stay dirty in the block
+ * cache until synced. */
+static
+int put_fat (struct fatfs_disk *f, fatfs_cluster clst, fatfs_cluster val)
+{
+    uint8_t buf[4];
+    struct fatfs *fs = f->fs;
+    uint32_t base;
+    int i;
+
+    if (clst < 2 || clst >= fs->n_fatent)	/* Range check */
+        return FR_DISK_ERR;
+
+    for (i = 0; i < fs->n_fats; i++) {
+        base = fs->fatbase + i * fs->fatsize;
+        switch (fs->fs_type) {
+#if FATFS_FAT12
+            case FS_FAT12 : {
+                                unsigned int wc, bc, ofs;
+
+                                bc = (unsigned int)clst; bc += bc / 2;
+                                ofs = bc % 512; bc /= 512;
+                                if (ofs != 511) {
+                                    if (disk_readp(f, buf, base + bc, ofs, 2)) return FR_DISK_ERR;
+                                } else {
+                                    if (disk_readp(f, buf, base + bc, 511, 1)) return FR_DISK_ERR;
+                                    if (disk_readp(f, buf+1, base + bc + 1, 0, 1)) return FR_DISK_ERR;
+                                }
+                                wc = LD_WORD(buf);
+                                if (clst & 1)
+                                    wc = (wc & 0x000F) | ((val & 0xFFF) << 4);
+                                else
+                                    wc = (wc & 0xF000) | (val & 0xFFF);
+                                ST_WORD(buf, wc);
+                                if (ofs != 511) {
+                                    if (disk_writep(f, buf, base + bc, ofs, 2)) return FR_DISK_ERR;
+                                } else {
+                                    if (disk_writep(f, buf, base + bc, 511, 1)) return FR_DISK_ERR;
+                                    if (disk_writep(f, buf+1, base + bc + 1, 0, 1)) return FR_DISK_ERR;
+                                }
+                                break;
+                            }
+#endif
+#if FATFS_FAT16
+            case FS_FAT16 :
+                            ST_WORD(buf, val);
+                            if (disk_writep(f, buf, base + clst / 256, ((unsigned int)clst % 256) * 2, 2)) return FR_DISK_ERR;
+                            break;
+#endif
+#if FATFS_FAT32
+            case FS_FAT32 :
+                            if (disk_readp(f, buf, base + clst / 128, ((unsigned int)clst % 128) * 4, 4)) return FR_DISK_ERR;
+                            ST_DWORD(buf, (LD_DWORD(buf) & 0xF0000000) | (val & 0x0FFFFFFF));
+                            if (disk_writep(f, buf, base + clst / 128, ((unsigned int)clst % 128) * 4, 4)) return FR_DISK_ERR;
+                            break;
+#endif
+            default:
+                            return FR_DISK_ERR;
+        }
+    }
+    return FR_OK;
+}
+
+/* End of chain marker */
+static fatfs_cluster fat_eoc(struct fatfs *fs)
+{
+    if (fs->fs_type == FS_FAT12)
+        return 0xFFF;
+    if (fs->fs_type == FS_FAT16)
+        return 0xFFFF;
+    return 0x0FFFFFFF;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch or create a cluster chain                      */
+/*-----------------------------------------------------------------------*/
+/* 0: No free cluster, 1: IO error, else: new cluster#.
+ * clst: cluster# to stretch, 0 to create a new chain. */
+static
+fatfs_cluster create_chain (struct fatfs_disk *f, fatfs_cluster clst)
+{
+    fatfs_cluster cs, ncl, scl;
+    struct fatfs *fs = f->fs;
+
+    scl = fs->last_clust;			/* Start from the last allocated cluster */
+    if (!scl || scl >= fs->n_fatent)
+        scl = 1;
+
+    ncl = scl;
+    for (;;) {
+        ncl++;
+        if (ncl >= fs->n_fatent) {		/* Wrap around */
+            ncl = 2;
+            if (ncl > scl) return 0;
+        }
+        cs = get_fat(f, ncl);
+        if (cs == 0) break;				/* Found a free cluster */
+        if (cs == 1) return 1;			/* IO error */
+        if (ncl == scl) return 0;		/* No free cluster */
+    }
+
+    if (put_fat(f, ncl, fat_eoc(fs)))
+        return 1;
+    if (clst && put_fat(f, clst, ncl))
+        return 1;
+    fs->last_clust = ncl;
+    return ncl;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Remove a cluster chain                                 */
+/*-----------------------------------------------------------------------*/
+static
+int remove_chain (struct fatfs_disk *f, fatfs_cluster clst)
+{
+    fatfs_cluster nxt;
+    struct fatfs *fs = f->fs;
+
+    while (clst >= 2 && clst < fs->n_fatent) {
+        nxt = get_fat(f, clst);
+        if (nxt == 1)
+            return FR_DISK_ERR;
+        if (put_fat(f, clst, 0))
+            return FR_DISK_ERR;
+        clst = nxt;
+    }
+    return FR_OK;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get sector# from cluster# / Get cluster field from directory entry    */
 /*-----------------------------------------------------------------------*/
@@ -507,6 +670,14 @@ fatfs_cluster get_clust ( struct fatfs_disk *f,
 }
 
 
+static
+void st_clust (uint8_t* dir, fatfs_cluster cl)
+{
+    ST_WORD(dir+DIR_FstClusLO, cl);
+    ST_WORD(dir+DIR_FstClusHI, cl >> 16);
+}
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Rewind directory index                           */
 /*-----------------------------------------------------------------------*/
@@ -648,6 +819,75 @@ int dir_read ( struct fatfs_disk *f,
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Zero the sectors of a cluster                                         */
+/*-----------------------------------------------------------------------*/
+static
+int clear_clust (struct fatfs_disk *f, fatfs_cluster clst)
+{
+    uint8_t *zero;
+    uint32_t sect = clust2sect(f, clst);
+    int i, res = FR_OK;
+
+    if (!sect)
+        return FR_DISK_ERR;
+    zero = kcalloc(512, 1);
+    if (!zero)
+        return FR_DISK_ERR;
+    for (i = 0; i < f->fs->csize; i++) {
+        if (disk_writep(f, zero, sect + i, 0, 512)) {
+            res = FR_DISK_ERR;
+            break;
+        }
+    }
+    kfree(zero);
+    return res;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Reserve a free entry in the directory, stretching it if needed        */
+/*-----------------------------------------------------------------------*/
+static
+int dir_alloc ( struct fatfs_disk *f,
+	struct fatfs_dir *dj		/* Directory object, on return points to the free entry */
+)
+{
+	int res;
+	uint8_t c;
+	fatfs_cluster clst;
+
+	res = dir_rewind(f, dj);
+	if (res != FR_OK) return res;
+
+	do {
+		res = disk_readp(f, &c, dj->sect, (dj->index % 16) * 32, 1)
+			? FR_DISK_ERR : FR_OK;
+		if (res != FR_OK) return res;
+		if (c == 0 || c == 0xE5)		/* Free entry */
+			return FR_OK;
+		res = dir_next(f, dj);
+	} while (res == FR_OK);
+
+	if (res != FR_NO_FILE)
+		return res;
+	if (dj->clust == 0 || (uint16_t)(dj->index + 1) == 0)	/* Static table is full */
+		return FR_DENIED;
+
+	/* Stretch the dynamic table with a cleared cluster */
+	clst = create_chain(f, dj->clust);
+	if (clst == 0) return FR_NO_SPACE;
+	if (clst == 1) return FR_DISK_ERR;
+	if (clear_clust(f, clst) != FR_OK) return FR_DISK_ERR;
+	dj->clust = clst;
+	dj->sect = clust2sect(f, clst);
+	dj->index++;
+	return FR_OK;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Pick a segment and create the object name in directory form           */
 /*-----------------------------------------------------------------------*/
@@ -744,109 +984,263 @@ void get_fileinfo (		/* No return code */
 
 
 
+static struct fatfs_priv *fatfs_priv_new(struct fatfs_disk *f, fatfs_cluster clust, struct fatfs_dir *dj)
+{
+    struct fatfs_priv *priv = kalloc(sizeof(struct fatfs_priv));
+    if (!priv)
+        return NULL;
+    priv->cluster = clust;
+    priv->fsd = f;
+    priv->dirsect = dj->sect;
+    priv->dirofs = (dj->index % 16) * 32;
+    priv->ext = NULL;
+    priv->n_ext = 0;
+    priv->populated = 0;
+    priv->stamp = 0;
+    return priv;
+}
+
+/* Directory 'dir' of a mounted volume: returns the disk, and the start
+ * cluster of the directory in *clst (0: root directory) */
+static struct fatfs_disk *fatfs_dir_disk(struct fnode *dir, fatfs_cluster *clst)
+{
+    struct fatfs_disk *f;
+    struct fatfs_priv *priv;
+
+    for (f = fatfs_disks; f; f = f->next) {
+        if (f->mountpoint == dir) {
+            *clst = 0;
+            return f;
+        }
+    }
+    priv = FNO_MOD_PRIV(dir, &mod_fatfs);
+    if (!priv || !(dir->flags & FL_DIR))
+        return NULL;
+    *clst = priv->cluster;
+    return priv->fsd;
+}
+
 /*-----------------------------------------------------------------------*/
-/* Follow a file path                                                    */
+/* Directory cache                                                       */
 /*-----------------------------------------------------------------------*/
 
-static
-int follow_path (	struct fatfs_disk *f, /* FR_OK(0): successful, !=0: error code */
-	struct fatfs_dir *dj,			/* Directory object to return last directory and found object */
-	char *dir,			/* 32-byte working buffer */
-	const char *path	/* Full-path string to find a file or directory */
-)
-{
-	int res;
+/* Directories are read from the disk the first time they are looked up
+ * or listed. When more than FATFS_MAX_NODES files and directories are
+ * in the VFS tree, or when the heap is exhausted, the contents of the
+ * least recently used directories are dropped, and read again when
+ * needed. */
 
+static int fatfs_evicting = 0;
+static uint32_t fatfs_nodes = 0;
+static uint32_t fatfs_clock = 0;
 
-	while (*path == ' ') path++;		/* Strip leading spaces */
-	if (*path == '/') path++;			/* Strip heading separator if exist */
-	dj->sclust = 0;						/* Set start directory (always root dir) */
-
-	if (*path < ' ') {			        /* Null path means the root directory */
-		res = dir_rewind(f, dj);
-		dir[0] = 0;
-	} else {							/* Follow path */
-		for (;;) {
-			res = create_name(dj, &path);	/* Get a segment */
-			if (res != FR_OK) break;
-			res = dir_find(f, dj, dir);		/* Find it */
-			if (res != FR_OK) break;		/* Could not find the object */
-			if (dj->fn[11]) break;			/* Last segment match. Function completed. */
-			if (!(dir[DIR_Attr] & AM_DIR)) { /* Cannot follow path because it is a file */
-				res = FR_NO_FILE; break;
-			}
-			dj->sclust = get_clust(f, dir);	/* Follow next */
-		}
-	}
+/* Removes fno and its children from the VFS tree, leaving the disk alone */
+static void fatfs_drop(struct fnode *fno)
+{
+    while (fno->children)
+        fatfs_drop(fno->children);
+    fatfs_evicting++;
+    fno_unlink(fno);
+    fatfs_evicting--;
+}
 
-	return res;
+static int fatfs_is_ancestor(struct fnode *dir, struct fnode *fno)
+{
+    while (fno) {
+        if (fno == dir)
+            return 1;
+        fno = fno->parent;
+    }
+    return 0;
 }
 
-char *relative_path(struct fatfs_disk *f, char *abs)
+/* Open files or working directories in the subtree */
+static int fatfs_busy(struct fnode *fno)
 {
-    if (!abs)
-        return NULL;
-    return (abs + strlen(f->mountpoint->fname) + 1);
+    struct fnode *c;
+    if ((fno->usage > 0) || task_is_cwd(fno))
+        return 1;
+    for (c = fno->children; c; c = c->next) {
+        if (fatfs_busy(c))
+            return 1;
+    }
+    return 0;
+}
+
+static void fatfs_lru_dir(struct fnode *dir, struct fnode *keep, struct fnode **victim)
+{
+    struct fnode *c;
+    struct fatfs_priv *priv;
+
+    for (c = dir->children; c; c = c->next) {
+        priv = FNO_MOD_PRIV(c, &mod_fatfs);
+        if (!priv || !(c->flags & FL_DIR))
+            continue;
+        if (priv->populated && (!*victim ||
+                    (priv->stamp < ((struct fatfs_priv *)(*victim)->priv)->stamp)) &&
+                !fatfs_is_ancestor(c, keep) && !fatfs_busy(c))
+            *victim = c;
+        fatfs_lru_dir(c, keep, victim);
+    }
 }
 
+/* Drops the contents of directories, least recently used first, until
+ * the number of nodes is below 'target'. 'keep' and its ancestors are
+ * left alone. */
+static void fatfs_evict(struct fnode *keep, uint32_t target)
+{
+    struct fatfs_disk *f;
+    struct fnode *victim;
+    struct fatfs_priv *priv;
+
+    while (fatfs_nodes > target) {
+        victim = NULL;
+        for (f = fatfs_disks; f; f = f->next)
+            fatfs_lru_dir(f->mountpoint, keep, &victim);
+        if (!victim)
+            break;
+        while (victim->children)
+            fatfs_drop(victim->children);
+        priv = victim->priv;
+        priv->populated = 0;
+    }
+}
 
-void fatfs_populate(struct fatfs_disk *f, char *path, uint32_t clust)
+/* Creates the nodes for the entries of directory 'dir' */
+static int fatfs_populate(struct fatfs_disk *f, struct fnode *dir, fatfs_cluster clust)
 {
     uint8_t fbuf[12];
     uint8_t dirbuf[32];
     struct fatfs_dir dj;
-    struct fnode *parent;
-    char  fullpath[128];
+    struct fatfs_finfo fi;
+    struct fnode *fno;
     int res;
 
-    fno_fullpath(f->mountpoint, fullpath, 128);
-    if (path && strlen(path) > 0) {
-        if (path[0] != '/')
-            strcat(fullpath, "/");
-        strcat(fullpath, path);
-    }
-    parent = fno_search(fullpath);
     dj.fn = fbuf;
-    if (clust > 0) {
-        dj.clust = clust;
-        dj.sclust = clust;
-        res = 0;
-    } else {
-        res = follow_path(f, &dj, dirbuf, path);
+    dj.sclust = clust;
+    if (dir_rewind(f, &dj) != FR_OK)
+        return -EIO;
+
+    while ((res = dir_read(f, &dj, dirbuf)) == FR_OK) {
+        get_fileinfo(&dj, dirbuf, &fi);
+        if (dirbuf[DIR_Attr] & AM_DIR)
+            fno = fno_mkdir(&mod_fatfs, fi.fname, dir);
+        else
+            fno = fno_create(&mod_fatfs, fi.fname, dir);
+        if (!fno)
+            return -ENOMEM;
+        fno->priv = fatfs_priv_new(f, get_clust(f, dirbuf), &dj);
+        if (!fno->priv) {
+            fatfs_drop(fno);
+            return -ENOMEM;
+        }
+        if (!(fno->flags & FL_DIR))
+            fno->size = fi.fsize;
+        fatfs_nodes++;
+        res = dir_next(f, &dj);
+        if (res != FR_OK)
+            break;
     }
+    /* Anything but the end of the table leaves the list partial */
+    if (res != FR_NO_FILE)
+        return -EIO;
+    return 0;
+}
 
-    if (res == 0) {
-        dir_rewind(f, &dj);
-        while(dir_read(f, &dj, dirbuf) == 0) {
-            struct fatfs_finfo fi;
-            get_fileinfo(&dj, dirbuf, &fi);
-            if (dirbuf[DIR_Attr] & AM_DIR) {
-                struct fnode *newdir;
-                newdir = fno_mkdir(&mod_fatfs, fi.fname, parent);
-                strcat(fullpath, "/");
-                strcat(fullpath, fi.fname);
-                if (newdir) {
-                    path = relative_path(f, fullpath);
-                    fatfs_populate(f, path, get_clust(f, dirbuf));
-                }
-            } else {
-                struct fnode *newfile;
-                newfile = fno_create(&mod_fatfs, fi.fname, parent);
-                if (newfile) {
-                    newfile->priv = (void *)kalloc(sizeof(struct fatfs_priv));
-                    if (!newfile->priv) {
-                        fno_unlink(newfile);
-                    } else {
-                        ((struct fatfs_priv *)newfile->priv)->cluster = get_clust(f, dirbuf);
-                        ((struct fatfs_priv *)newfile->priv)->fsd = f;
-                        newfile->size = fi.fsize;
-
-                    }
-                }
-            }
-            dir_next(f, &dj);
+/* Called by the VFS before looking up or listing the children of 'dir' */
+static int fatfs_lookup(struct fnode *dir)
+{
+    struct fatfs_disk *f;
+    struct fatfs_priv *priv;
+    fatfs_cluster clst;
+    uint8_t *populated;
+    int ret;
+
+    f = fatfs_dir_disk(dir, &clst);
+    if (!f)
+        return 0;
+    if (dir == f->mountpoint) {
+        populated = &f->populated;
+    } else {
+        priv = dir->priv;
+        priv->stamp = ++fatfs_clock;
+        populated = &priv->populated;
+    }
+    if (*populated)
+        return 0;
+    /* Set during the populate, which looks up the new nodes */
+    *populated = 1;
+
+    if (fatfs_nodes >= FATFS_MAX_NODES)
+        fatfs_evict(dir, (FATFS_MAX_NODES * 3) / 4);
+
+    fatfs_populating++;
+    ret = fatfs_populate(f, dir, clst);
+    if (ret == -ENOMEM) {
+        /* Out of memory: start over, after making room */
+        while (dir->children)
+            fatfs_drop(dir->children);
+        fatfs_evict(dir, 0);
+        ret = fatfs_populate(f, dir, clst);
+    }
+    if (ret < 0) {
+        /* Partial list: drop it, and read it again next time. The
+         * dot links belong to the directory itself. */
+        struct fnode *c = dir->children, *next;
+        while (c) {
+            next = c->next;
+            if (!(c->flags & FL_LINK))
+                fatfs_drop(c);
+            c = next;
         }
+        *populated = 0;
+    }
+    fatfs_populating--;
+    return ret;
+}
+
+/* getdents: streams the entries straight from the disk, without adding
+ * them to the VFS tree. *pos is the index of the next directory entry. */
+static int fatfs_readdir(struct fnode *dir, uint32_t *pos, void *buf, int len)
+{
+    struct fatfs_disk *f;
+    struct fatfs_dir dj;
+    struct fatfs_finfo fi;
+    fatfs_cluster clst;
+    uint8_t dirbuf[32];
+    int res, w, tot = 0;
+
+    f = fatfs_dir_disk(dir, &clst);
+    if (!f)
+        return -ENOENT;
+    dj.fn = NULL;
+    dj.sclust = clst;
+    if (dir_rewind(f, &dj) != FR_OK)
+        return -EIO;
+    while (dj.index < *pos) {
+        if (dir_next(f, &dj) != FR_OK)
+            return 0;
+    }
+
+    while ((res = dir_read(f, &dj, dirbuf)) == FR_OK) {
+        get_fileinfo(&dj, dirbuf, &fi);
+        w = vfs_dirent((uint8_t *)buf + tot, len - tot, fi.fname,
+                (fi.fattrib & AM_DIR) ? DT_DIR : DT_REG,
+                (fi.fattrib & AM_DIR) ? 0 : fi.fsize);
+        if (w == 0)
+            break;
+        tot += w;
+        *pos = dj.index + 1;
+        if (dir_next(f, &dj) != FR_OK)
+            break;
+    }
+    if (tot == 0) {
+        if (res == FR_OK)
+            return -EINVAL; /* Buffer too small for a single entry */
+        if (res == FR_DISK_ERR)
+            return -EIO;
     }
+    return tot;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -909,8 +1303,10 @@ static int fatfs_mount(char *source, char *tgt, uint32_t flags, void *arg)
     if (!fsd)
         return -1;
 
-    /* Associate the disk device */
+    /* Associate the disk device. The media may have been swapped since
+     * the device was last mounted: forget what the cache holds for it. */
     fsd->blockdev = src_dev;
+    bcache_invalidate(src_dev);
     
     /* Associate a newly created fat filesystem */
     fsd->fs = kcalloc(sizeof(struct fatfs), 1);
@@ -947,6 +1343,8 @@ static int fatfs_mount(char *source, char *tgt, uint32_t flags, void *arg)
     fsize = LD_WORD(buf+BPB_FATSz16-13);				/* Number of sectors per FAT */
     if (!fsize) fsize = LD_DWORD(buf+BPB_FATSz32-13);
 
+    fsd->fs->fatsize = fsize;
+    fsd->fs->n_fats = buf[BPB_NumFATs-13];
     fsize *= buf[BPB_NumFATs-13];						/* Number of sectors in FAT area */
     fsd->fs->fatbase = bsect + LD_WORD(buf+BPB_RsvdSecCnt-13); /* FAT start sector (lba) */
     fsd->fs->csize = buf[BPB_SecPerClus-13];					/* Number of sectors per cluster */
@@ -975,10 +1373,15 @@ static int fatfs_mount(char *source, char *tgt, uint32_t flags, void *arg)
         fsd->fs->dirbase = fsd->fs->fatbase + fsize;				/* Root directory start sector (lba) */
     fsd->fs->database = fsd->fs->fatbase + fsize + fsd->fs->n_rootdir / 16;	/* Data start sector (lba) */
     fsd->fs->flag = 0;
+    if (!src_dev->owner->ops.block_write)
+        fsd->fs->flag |= FA_WPRT;
     //kprintf("Mounted FAT filesystem, %d sectors per cluster, %d total sectors, dirbase: %p database: %p\r\n",
     //        fsd->fs->csize, fsd->fs->n_fatent, fsd->fs->dirbase, fsd->fs->database);
     //
-    fatfs_populate(fsd, "", 0);
+    /* Directories are read on first lookup */
+    fsd->populated = 0;
+    fsd->next = fatfs_disks;
+    fatfs_disks = fsd;
     return 0;
 
 fail:
@@ -987,41 +1390,184 @@ fail:
     return -1;
 }
 
-static int fatfs_read(struct fnode *fno, void *buf, unsigned int len)
+/*-----------------------------------------------------------------------*/
+/* Cluster map                                                           */
+/*-----------------------------------------------------------------------*/
+
+/* Updates start cluster and size in the directory entry of fno */
+static int fatfs_sync_dirent(struct fnode *fno)
 {
-    struct fatfs_priv *priv;
-    uint32_t sect;
-    uint32_t r_len = 0;
-    uint32_t r_off = 0;
+    struct fatfs_priv *priv = fno->priv;
+    struct fatfs_disk *f = priv->fsd;
+    uint8_t dir[32];
+
+    if (disk_readp(f, dir, priv->dirsect, priv->dirofs, 32))
+        return FR_DISK_ERR;
+    st_clust(dir, priv->cluster);
+    if (!(dir[DIR_Attr] & AM_DIR)) {
+        ST_DWORD(dir + DIR_FileSize, fno->size);
+        dir[DIR_Attr] |= AM_ARC;
+    }
+    if (disk_writep(f, dir, priv->dirsect, priv->dirofs, 32))
+        return FR_DISK_ERR;
+    return FR_OK;
+}
 
+/* Follows the chain from clst. At the end of the chain, a new cluster
+ * is appended if 'stretch' is set. 0: No space, 1: Error */
+static fatfs_cluster next_clust(struct fatfs_disk *f, fatfs_cluster clst, int stretch)
+{
+    fatfs_cluster nxt = get_fat(f, clst);
+    if (nxt < 2)
+        return 1;
+    if (nxt >= f->fs->n_fatent) {
+        if (!stretch)
+            return 1;
+        nxt = create_chain(f, clst);
+    }
+    return nxt;
+}
 
-    if (!fno || !fno->priv)
+/* Records that cluster #idx of the file is clst. Clusters must be added
+ * in order. Returns -1 when the map is full. */
+static int fatfs_map_add(struct fatfs_priv *priv, uint32_t idx, fatfs_cluster clst)
+{
+    struct fatfs_extent *e;
+
+    if (priv->n_ext > 0) {
+        e = &priv->ext[priv->n_ext - 1];
+        if (((e->idx + e->len) == idx) && ((e->clust + e->len) == clst)) {
+            e->len++;
+            return 0;
+        }
+    }
+    if (priv->n_ext >= FATFS_MAX_EXTENTS)
         return -1;
-    priv = (struct fatfs_priv *)fno->priv;
+    if ((priv->n_ext % FATFS_EXTENT_STEP) == 0) {
+        e = krealloc(priv->ext, (priv->n_ext + FATFS_EXTENT_STEP) * sizeof(struct fatfs_extent));
+        if (!e)
+            return -1;
+        priv->ext = e;
+    }
+    e = &priv->ext[priv->n_ext++];
+    e->idx = idx;
+    e->clust = clst;
+    e->len = 1;
+    return 0;
+}
 
-    if (len + fno->off > fno->size)
-        len = fno->size - fno->off;
+/* Cluster holding byte 'pos' of the file. If 'stretch' is set, clusters
+ * are allocated up to pos. In *run, the number of contiguous clusters on
+ * disk starting from the one returned.
+ *
+ * Clusters already in the map are found with a binary search; the FAT is
+ * only read past the end of the map, which then grows. Files with more
+ * than FATFS_MAX_EXTENTS fragments walk the FAT beyond that point.
+ * 0: No space, 1: Error */
+static fatfs_cluster fatfs_file_clust(struct fnode *fno, uint32_t pos, int stretch, uint32_t *run)
+{
+    struct fatfs_priv *priv = fno->priv;
+    struct fatfs_disk *f = priv->fsd;
+    struct fatfs_extent *e;
+    uint32_t idx = pos / (f->fs->csize * 512);
+    uint32_t i;
+    int lo, hi, mid, mapped = 1;
+    fatfs_cluster clst;
 
-    if (len == 0)
-        return -1;
+    *run = 1;
+    if (priv->cluster == 0) {
+        if (!stretch)
+            return 1;
+        clst = create_chain(f, 0);
+        if (clst < 2)
+            return clst;
+        priv->cluster = clst;
+        if (fatfs_sync_dirent(fno) != FR_OK)
+            return 1;
+    }
+    if ((priv->n_ext == 0) && (fatfs_map_add(priv, 0, priv->cluster) < 0))
+        return 1;
 
-    while (r_len < len) {
-        int r = len - r_len;
-        r_off = fno->off;
-        sect = clust2sect(priv->fsd, priv->cluster);
-        while (r_off >= 512) {
-            sect++;
-            r_off -= 512;
-        }
-        if (r + r_off > 512) {
-            r = 512 - r_off;
+    e = &priv->ext[priv->n_ext - 1];
+    if (idx < (e->idx + e->len)) {
+        lo = 0;
+        hi = priv->n_ext - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (priv->ext[mid].idx <= idx)
+                lo = mid;
+            else
+                hi = mid - 1;
         }
-        if (disk_readp(priv->fsd, buf + r_len, sect, r_off, r) != 0)
+        e = &priv->ext[lo];
+        *run = e->len - (idx - e->idx);
+        return e->clust + (idx - e->idx);
+    }
+
+    /* Past the end of the map: follow the chain */
+    i = e->idx + e->len - 1;
+    clst = e->clust + e->len - 1;
+    while (i < idx) {
+        clst = next_clust(f, clst, stretch);
+        if (clst < 2)
+            return clst;
+        i++;
+        if (mapped && (fatfs_map_add(priv, i, clst) < 0))
+            mapped = 0;
+    }
+    return clst;
+}
+
+static int fatfs_read(struct fnode *fno, void *buf, unsigned int len)
+{
+    struct fatfs_priv *priv;
+    struct fatfs_disk *f;
+    fatfs_cluster clst;
+    uint32_t bcs, pos, sect, run, n;
+    uint8_t *p = buf;
+    unsigned int done = 0, r;
+
+    priv = FNO_MOD_PRIV(fno, &mod_fatfs);
+    if (!priv)
+        return -1;
+    if (fno->flags & FL_DIR)
+        return -EISDIR;
+    f = priv->fsd;
+
+    if (fno->off >= fno->size)
+        return -1;
+    if (len > (fno->size - fno->off))
+        len = fno->size - fno->off;
+
+    bcs = (uint32_t)f->fs->csize * 512;
+    pos = fno->off;
+    while (done < len) {
+        clst = fatfs_file_clust(fno, pos, 0, &run);
+        if (clst < 2)
             break;
-        r_len += r;
-        fno->off += r;
+        sect = clust2sect(f, clst) + (pos % bcs) / 512;
+        if (((pos % 512) == 0) && ((len - done) >= 512)) {
+            /* Whole sectors, up to the end of the contiguous run */
+            n = (run * bcs - (pos % bcs)) / 512;
+            if (n > ((len - done) / 512))
+                n = (len - done) / 512;
+            if (bcache_read_blocks(f->blockdev, p + done, sect, n) != 0)
+                break;
+            r = n * 512;
+        } else {
+            r = 512 - (pos % 512);
+            if (r > (len - done))
+                r = len - done;
+            if (disk_readp(f, p + done, sect, pos % 512, r) != 0)
+                break;
+        }
+        done += r;
+        pos += r;
     }
-    return r_len;
+    fno->off = pos;
+    if (done == 0)
+        return -EIO;
+    return done;
 }
 
 static int fatfs_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
@@ -1061,224 +1607,286 @@ static int fatfs_seek(struct fnode *fno, int off, int whence)
     return fno->off;
 }
 
+/* Dirty sectors are written back when the file is closed */
 static int fatfs_close(struct fnode *fno)
 {
-    struct fatfs_fnode *mfno;
-    mfno = FNO_MOD_PRIV(fno, &mod_fatfs);
-    if (!mfno)
+    struct fatfs_priv *priv;
+    priv = FNO_MOD_PRIV(fno, &mod_fatfs);
+    if (!priv)
         return -1;
     fno->off = 0;
+    if (!(priv->fsd->fs->flag & FA_WPRT))
+        bcache_sync(priv->fsd->blockdev);
     return 0;
 }
 
-
-#if 0
-
-/*-----------------------------------------------------------------------*/
-/* Open or Create a File                                                 */
-/*-----------------------------------------------------------------------*/
-
-static
-int fatfs_open (struct fatfs_disk *f,
-        const char *path	/* Pointer to the file name */
-        )
+static int fatfs_fsync(struct fnode *fno)
 {
-    int res;
-    struct fatfs_dir dj;
-    uint8_t sp[12], dir[32];
-    struct fatfs *fs = f->fs;
-
-
-    if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-
-    fs->flag = 0;
-    dj.fn = sp;
-    res = follow_path(&dj, dir, path);	/* Follow the file path */
-    if (res != FR_OK) return res;		/* Follow failed */
-    if (!dir[0] || (dir[DIR_Attr] & AM_DIR))	/* It is a directory */
-        return FR_NO_FILE;
-
-    fs->org_clust = get_clust(f, dir);		/* File start cluster */
-    fs->fsize = LD_DWORD(dir+DIR_FileSize);	/* File size */
-    fs->fptr = 0;						/* File pointer */
-    fs->flag = FA_OPENED;
-
-    return FR_OK;
+    struct fatfs_priv *priv;
+    priv = FNO_MOD_PRIV(fno, &mod_fatfs);
+    if (!priv)
+        return -EINVAL;
+    if (priv->fsd->fs->flag & FA_WPRT)
+        return 0;
+    if (bcache_sync(priv->fsd->blockdev) != 0)
+        return -EIO;
+    return 0;
 }
 
 
 
-
 /*-----------------------------------------------------------------------*/
-/* Read File                                                             */
+/* Write support                                                         */
 /*-----------------------------------------------------------------------*/
 
-static
-int fatfs_read ( struct fatfs_disk *f,
-        void* buff,		/* Pointer to the read buffer (NULL:Forward data to the stream)*/
-        unsigned int btr,		/* Number of bytes to read */
-        unsigned int* br		/* Pointer to number of bytes read */
-        )
+#define FATFS_DEFAULT_DATE 0x0021   /* 1980-01-01 */
+
+static int fatfs_write(struct fnode *fno, const void *buf, unsigned int len)
 {
-    int dr;
-    fatfs_cluster clst;
-    uint32_t sect, remain;
-    unsigned int rcnt;
-    uint8_t cs, *rbuff = buff;
-    struct fatfs *fs = f->fs;
+    struct fatfs_priv *priv;
+    struct fatfs_disk *f;
+    struct fatfs *fs;
+    fatfs_cluster clst = 2;
+    uint32_t bcs, pos, sect, cs, i, run;
+    const uint8_t *p = buf;
+    unsigned int done = 0, w;
+    int err = 0;
+
+    priv = FNO_MOD_PRIV(fno, &mod_fatfs);
+    if (!priv)
+        return -1;
+    if (fno->flags & FL_DIR)
+        return -EISDIR;
+    f = priv->fsd;
+    fs = f->fs;
+    if (fs->flag & FA_WPRT)
+        return -EROFS;
+    if (len == 0)
+        return 0;
 
+    bcs = (uint32_t)fs->csize * 512;
+    pos = fno->off;
+    if ((pos + len) < pos)
+        return -EFBIG;
 
-    *br = 0;
-    if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-    if (!(fs->flag & FA_OPENED))		/* Check if opened */
-        return FR_NOT_OPENED;
-
-    remain = fs->fsize - fs->fptr;
-    if (btr > remain) btr = (unsigned int)remain;			/* Truncate btr by remaining bytes */
-
-    while (btr)	{									/* Repeat until all data transferred */
-        if ((fs->fptr % 512) == 0) {				/* On the sector boundary? */
-            cs = (uint8_t)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
-            if (!cs) {								/* On the cluster boundary? */
-                if (fs->fptr == 0)					/* On the top of the file? */
-                    clst = fs->org_clust;
-                else
-                    clst = get_fat(fs->curr_clust);
-                if (clst <= 1) ABORT(FR_DISK_ERR);
-                fs->curr_clust = clst;				/* Update current cluster */
+    while (done < len) {
+        clst = fatfs_file_clust(fno, pos, 1, &run);
+        if (clst < 2)
+            break;
+        sect = clust2sect(f, clst) + (pos % bcs) / 512;
+        if (((pos % 512) == 0) && ((len - done) >= 512)) {
+            /* Fast path: whole sectors, up to the end of the contiguous run */
+            cs = (run * bcs - (pos % bcs)) / 512;
+            if (cs > ((len - done) / 512))
+                cs = (len - done) / 512;
+            for (i = 0; i < cs; i++) {
+                if (disk_writep(f, p + done + i * 512, sect + i, 0, 512))
+                    break;
+            }
+            w = i * 512;
+            if (i < cs)
+                err = -EIO;
+        } else {
+            w = 512 - (pos % 512);
+            if (w > (len - done))
+                w = len - done;
+            if (disk_writep(f, p + done, sect, pos % 512, w)) {
+                w = 0;
+                err = -EIO;
             }
-            sect = clust2sect(f, fs->curr_clust);		/* Get current sector */
-            if (!sect) ABORT(FR_DISK_ERR);
-            fs->dsect = sect + cs;
         }
-        rcnt = 512 - (unsigned int)fs->fptr % 512;			/* Get partial sector data from sector buffer */
-        if (rcnt > btr) rcnt = btr;
-        dr = disk_readp(!buff ? 0 : rbuff, fs->dsect, (unsigned int)fs->fptr % 512, rcnt);
-        if (dr) ABORT(FR_DISK_ERR);
-        fs->fptr += rcnt; rbuff += rcnt;			/* Update pointers and counters */
-        btr -= rcnt; *br += rcnt;
+        done += w;
+        pos += w;
+        if (err)
+            break;
     }
-
-    return FR_OK;
+    if (clst == 0)
+        err = -ENOSPC;
+    else if (clst == 1)
+        err = -EIO;
+
+    fno->off = pos;
+    if (pos > fno->size) {
+        fno->size = pos;
+        if (fatfs_sync_dirent(fno) != FR_OK)
+            err = -EIO;
+    }
+    if (done > 0)
+        return done;
+    return err;
 }
 
-
-
-/*-----------------------------------------------------------------------*/
-/* Write File                                                            */
-/*-----------------------------------------------------------------------*/
-static
-int fatfs_write (struct fatfs_disk *f,
-        const void* buff,	/* Pointer to the data to be written */
-        unsigned int btw,			/* Number of bytes to write (0:Finalize the current write operation) */
-        unsigned int* bw			/* Pointer to number of bytes written */
-        )
+/* Names are stored as 8.3 short names, and read back as such: only
+ * accept names that are stored verbatim, so that the node can be found
+ * again once evicted, or after a remount. */
+static int fatfs_sfn(const char *name, uint8_t *sfn)
 {
-    fatfs_cluster clst;
-    uint32_t sect, remain;
-    const uint8_t *p = buff;
-    uint8_t cs;
-    unsigned int wcnt;
-    struct fatfs *fs = f->fs;
-
-
-    *bw = 0;
-    if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-    if (!(fs->flag & FA_OPENED))		/* Check if opened */
-        return FR_NOT_OPENED;
+    const char *p = name;
+    struct fatfs_dir dj;
+    char back[13];
+    int base = 0, ext = 0, dots = 0, i, j = 0;
 
-    if (!btw) {		/* Finalize request */
-        if ((fs->flag & FA__WIP) && disk_writep(0, 0)) ABORT(FR_DISK_ERR);
-        fs->flag &= ~FA__WIP;
-        return FR_OK;
-    } else {		/* Write data request */
-        if (!(fs->flag & FA__WIP))		/* Round-down fptr to the sector boundary */
-            fs->fptr &= 0xFFFFFE00;
-    }
-    remain = fs->fsize - fs->fptr;
-    if (btw > remain) btw = (unsigned int)remain;			/* Truncate btw by remaining bytes */
-
-    while (btw)	{									/* Repeat until all data transferred */
-        if ((unsigned int)fs->fptr % 512 == 0) {			/* On the sector boundary? */
-            cs = (uint8_t)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
-            if (!cs) {								/* On the cluster boundary? */
-                if (fs->fptr == 0)					/* On the top of the file? */
-                    clst = fs->org_clust;
-                else
-                    clst = get_fat(fs->curr_clust);
-                if (clst <= 1) ABORT(FR_DISK_ERR);
-                fs->curr_clust = clst;				/* Update current cluster */
-            }
-            sect = clust2sect(f, fs->curr_clust);		/* Get current sector */
-            if (!sect) ABORT(FR_DISK_ERR);
-            fs->dsect = sect + cs;
-            if (disk_writep(0, fs->dsect)) ABORT(FR_DISK_ERR);	/* Initiate a sector write operation */
-            fs->flag |= FA__WIP;
+    for (p = name; *p; p++) {
+        if (*p == '.') {
+            dots++;
+            continue;
         }
-        wcnt = 512 - (unsigned int)fs->fptr % 512;			/* Number of bytes to write to the sector */
-        if (wcnt > btw) wcnt = btw;
-        if (disk_writep(p, wcnt)) ABORT(FR_DISK_ERR);	/* Send data to the sector */
-        fs->fptr += wcnt; p += wcnt;				/* Update pointers and counters */
-        btw -= wcnt; *bw += wcnt;
-        if ((unsigned int)fs->fptr % 512 == 0) {
-            if (disk_writep(0, 0)) ABORT(FR_DISK_ERR);	/* Finalize the currtent secter write operation */
-            fs->flag &= ~FA__WIP;
+        if (dots)
+            ext++;
+        else
+            base++;
+    }
+    if ((base > 8) || (ext > 3))
+        return -ENAMETOOLONG;
+    if ((base == 0) || (dots > 1) || (dots && !ext))
+        return -EINVAL;
+    for (p = name; *p; p++) {
+        const char *bad;
+        if (*p <= ' ')
+            return -EINVAL;
+        for (bad = "\"*+,/:;<=>?[\\]|"; *bad; bad++) {
+            if (*p == *bad)
+                return -EINVAL;
         }
     }
 
-    return FR_OK;
+    dj.fn = sfn;
+    p = name;
+    create_name(&dj, &p);
+    for (i = 0; (i < 8) && (sfn[i] != ' '); i++)
+        back[j++] = sfn[i];
+    if (sfn[8] != ' ') {
+        back[j++] = '.';
+        for (i = 8; (i < 11) && (sfn[i] != ' '); i++)
+            back[j++] = sfn[i];
+    }
+    back[j] = '\0';
+    /* e.g. lower case, which would come back in upper case */
+    if (strcmp(back, name) != 0)
+        return -EINVAL;
+    return 0;
 }
 
+/* Called by the VFS for each new node in a FAT directory, including the
+ * ones created while the volume is populated. Links are only kept in
+ * the VFS. */
+static int fatfs_creat(struct fnode *fno)
+{
+    struct fatfs_disk *f;
+    struct fatfs_dir dj;
+    fatfs_cluster dclst, clst = 0;
+    uint8_t sfn[12], dir[32];
+    const char *name = fno->fname;
+    int res;
 
+    if (fatfs_populating)
+        return 0;
+    if (fno->flags & FL_LINK)
+        return 0;
+    f = fatfs_dir_disk(fno->parent, &dclst);
+    if (!f)
+        return -ENOENT;
+    if (f->fs->flag & FA_WPRT)
+        return -EROFS;
+
+    res = fatfs_sfn(name, sfn);
+    if (res < 0)
+        return res;
+    dj.fn = sfn;
+    dj.sclust = dclst;
+    res = dir_find(f, &dj, dir);
+    if (res == FR_OK)
+        return -EEXIST;
+    if (res != FR_NO_FILE)
+        return -EIO;
+    res = dir_alloc(f, &dj);
+    if (res == FR_DENIED || res == FR_NO_SPACE)
+        return -ENOSPC;
+    if (res != FR_OK)
+        return -EIO;
+
+    if (fno->flags & FL_DIR) {
+        /* New directory table, with the dot entries */
+        clst = create_chain(f, 0);
+        if (clst == 0)
+            return -ENOSPC;
+        if ((clst == 1) || (clear_clust(f, clst) != FR_OK))
+            return -EIO;
+        memset(dir, 0, 32);
+        memset(dir, ' ', 11);
+        dir[0] = '.';
+        dir[DIR_Attr] = AM_DIR;
+        ST_WORD(dir + DIR_WrtDate, FATFS_DEFAULT_DATE);
+        st_clust(dir, clst);
+        if (disk_writep(f, dir, clust2sect(f, clst), 0, 32))
+            return -EIO;
+        dir[1] = '.';
+        st_clust(dir, dclst);
+        if (disk_writep(f, dir, clust2sect(f, clst), 32, 32))
+            return -EIO;
+    }
 
-/*-----------------------------------------------------------------------*/
-/* Seek File R/W Pointer                                                 */
-/*-----------------------------------------------------------------------*/
+    memset(dir, 0, 32);
+    memcpy(dir, sfn, 11);
+    if (dir[0] == 0xE5)
+        dir[0] = 0x05;
+    dir[DIR_Attr] = (fno->flags & FL_DIR) ? AM_DIR : AM_ARC;
+    ST_WORD(dir + DIR_WrtDate, FATFS_DEFAULT_DATE);
+    st_clust(dir, clst);
+    if (disk_writep(f, dir, dj.sect, (dj.index % 16) * 32, 32))
+        return -EIO;
+
+    fno->priv = fatfs_priv_new(f, clst, &dj);
+    if (!fno->priv)
+        return -ENOMEM;
+    ((struct fatfs_priv *)fno->priv)->populated = 1;
+    fatfs_nodes++;
+    return 0;
+}
 
-static
-int fatfs_lseek (struct fatfs_disk *f,
-        uint32_t ofs		/* File pointer from top of file */
-        )
+/* Nonzero if the directory table at 'clust' has entries other than the
+ * dot entries (or cannot be read) */
+static int fatfs_dir_busy(struct fatfs_disk *f, fatfs_cluster clust)
 {
-    fatfs_cluster clst;
-    uint32_t bcs, sect, ifptr;
-    struct fatfs *fs = f->fs;
+    struct fatfs_dir dj;
+    uint8_t dirbuf[32];
+    int res;
 
+    dj.fn = NULL;
+    dj.sclust = clust;
+    if (dir_rewind(f, &dj) != FR_OK)
+        return 1;
+    res = dir_read(f, &dj, dirbuf);
+    return (res != FR_NO_FILE);
+}
 
-    if (!fs) return FR_NOT_ENABLED;		/* Check file system */
-    if (!(fs->flag & FA_OPENED))		/* Check if opened */
-        return FR_NOT_OPENED;
-
-    if (ofs > fs->fsize) ofs = fs->fsize;	/* Clip offset with the file size */
-    ifptr = fs->fptr;
-    fs->fptr = 0;
-    if (ofs > 0) {
-        bcs = (uint32_t)fs->csize * 512;	/* Cluster size (byte) */
-        if (ifptr > 0 &&
-                (ofs - 1) / bcs >= (ifptr - 1) / bcs) {	/* When seek to same or following cluster, */
-            fs->fptr = (ifptr - 1) & ~(bcs - 1);	/* start from the current cluster */
-            ofs -= fs->fptr;
-            clst = fs->curr_clust;
-        } else {							/* When seek to back cluster, */
-            clst = fs->org_clust;			/* start from the first cluster */
-            fs->curr_clust = clst;
-        }
-        while (ofs > bcs) {				/* Cluster following loop */
-            clst = get_fat(clst);		/* Follow cluster chain */
-            if (clst <= 1 || clst >= fs->n_fatent) ABORT(FR_DISK_ERR);
-            fs->curr_clust = clst;
-            fs->fptr += bcs;
-            ofs -= bcs;
-        }
-        fs->fptr += ofs;
-        sect = clust2sect(f, clst);		/* Current sector */
-        if (!sect) ABORT(FR_DISK_ERR);
-        fs->dsect = sect + (fs->fptr / 512 & (fs->csize - 1));
-    }
+/* Frees the cluster chain, and marks the directory entry as deleted.
+ * Directories must be empty on disk. */
+static int fatfs_unlink(struct fnode *fno)
+{
+    struct fatfs_priv *priv;
+    struct fatfs_disk *f;
+    uint8_t del = 0xE5;
+    int ret = 0;
 
-    return FR_OK;
+    priv = FNO_MOD_PRIV(fno, &mod_fatfs);
+    if (!priv)
+        return 0;
+    f = priv->fsd;
+    if (!fatfs_evicting && !(f->fs->flag & FA_WPRT) && (fno->flags & FL_DIR) &&
+            fatfs_dir_busy(f, priv->cluster))
+        return -ENOTEMPTY;
+    fatfs_nodes--;
+    if (!fatfs_evicting && !(f->fs->flag & FA_WPRT)) {
+        if ((remove_chain(f, priv->cluster) != FR_OK) ||
+                disk_writep(f, &del, priv->dirsect, priv->dirofs, 1))
+            ret = -EIO;
+    }
+    fno->priv = NULL;
+    kfree(priv->ext);
+    kfree(priv);
+    return ret;
 }
-#endif
 
 void fatfs_init(void)
 {
@@ -1287,15 +1895,14 @@ void fatfs_init(void)
 
     mod_fatfs.mount = fatfs_mount;
     mod_fatfs.ops.read = fatfs_read; 
-    mod_fatfs.ops.seek = fatfs_seek;
-    mod_fatfs.ops.poll = fatfs_poll;
-    /*
     mod_fatfs.ops.write = fatfs_write;
     mod_fatfs.ops.seek = fatfs_seek;
+    mod_fatfs.ops.poll = fatfs_poll;
     mod_fatfs.ops.creat = fatfs_creat;
     mod_fatfs.ops.unlink = fatfs_unlink;
     mod_fatfs.ops.close = fatfs_close;
-    mod_fatfs.ops.exe = fatfs_exe;
-    */
+    mod_fatfs.ops.fsync = fatfs_fsync;
+    mod_fatfs.ops.lookup = fatfs_lookup;
+    mod_fatfs.ops.readdir = fatfs_readdir;
     register_module(&mod_fatfs);
 }
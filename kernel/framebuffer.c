@@ -39,6 +39,7 @@ static int fb_read(struct fnode *fno, void *buf, unsigned int len);
 static int fb_open(const char *path, int flags);
 static int fb_seek(struct fnode *fno, int off, int whence);
 static int fb_ioctl(struct fnode * fno, const uint32_t cmd, void *arg);
+static void *fb_mmap(struct fnode *fno, uint32_t off, uint32_t *len);
 
 static struct module mod_devfb = {
     .family = FAMILY_FILE,
@@ -48,6 +49,7 @@ static struct module mod_devfb = {
     .ops.write = fb_write,
     .ops.seek = fb_seek,
     .ops.ioctl = fb_ioctl,
+    .ops.mmap = fb_mmap,
 };
 
 
@@ -118,6 +120,21 @@ static int fb_read(struct fnode *fno, void *buf, unsigned int len)
     return len;
 }
 
+/* The screen buffer is allocated from the user pool: it can be
+ * handed out as is. */
+static void *fb_mmap(struct fnode *fno, uint32_t off, uint32_t *len)
+{
+    struct fb_info *fb;
+
+    fb = (struct fb_info *)FNO_MOD_PRIV(fno, &mod_devfb);
+    if (!fb || !fb->screen_buffer)
+        return NULL;
+    if (off >= fno->size)
+        return NULL;
+    *len = fno->size - off;
+    return (void *)((uint8_t *)fb->screen_buffer + off);
+}
+
 /* TODO: Could probably be made generic ? */
 static int fb_seek(struct fnode *fno, int off, int whence)
 {
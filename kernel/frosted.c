@@ -38,6 +38,10 @@ void socket_in_ini(void);
 # define pico_unlock() do{}while(0)
 #endif
 
+#ifdef CONFIG_SOCK_UNIX
+void socket_un_init(void);
+#endif
+
 #ifdef CONFIG_PICOTCP_LOOP
 struct pico_device *pico_loop_create(void);
 #else
@@ -178,6 +182,7 @@ int frosted_init(void)
 
     vfs_init();
     devnull_init(fno_search("/dev"));
+    ramdisk_init(fno_search("/dev"));
 
     /* Set up system */
 
@@ -188,6 +193,10 @@ int frosted_init(void)
     mpu_init();
             
     syscalls_init();
+    sys_pipe_init();
+    mqueue_init();
+    shm_init();
+    eventfd_init();
 
     memfs_init();
     xipfs_init();
@@ -202,11 +211,16 @@ int frosted_init(void)
     xip_mounted = vfs_mount((char *)init, "/bin", "xipfs", 0, NULL);
     vfs_mount(NULL, "/sys", "sysfs", 0, NULL);
 
+#ifdef CONFIG_IRQ_PROFILE
+    irqprof_init();
+#endif
+    bcache_init();
+
     klog_init();
     kernel_task_init();
 
 
-#ifdef UNIX    
+#ifdef CONFIG_SOCK_UNIX
     socket_un_init();
 #endif
 
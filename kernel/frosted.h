@@ -33,9 +33,11 @@
 struct task;
 struct fnode;
 struct semaphore;
+struct rwlock;
 struct termios;
 typedef struct semaphore sem_t;
 typedef struct semaphore frosted_mutex_t;
+typedef struct rwlock rwlock_t;
 
 typedef uint32_t sigset_t;
 
@@ -63,8 +65,13 @@ struct sysfs_fnode {
     struct fnode *fnode;
     int (*do_read)(struct sysfs_fnode *sfs, void *buf, int len);
     int (*do_write)(struct sysfs_fnode *sfs, const void *buf, int len);
+    /* One reader at a time: do_read() keeps its snapshot across calls */
+    frosted_mutex_t *lock;
+    uint16_t reader;
+    uint32_t off;
 };
 void sysfs_init(void);
+void ramdisk_init(struct fnode *dev);
 
 
 /* Scheduler */
@@ -78,12 +85,19 @@ int task_filedesc_add(struct fnode *f);
 int task_fd_setmask(int fd, uint32_t mask);
 uint32_t task_fd_getmask(int fd);
 struct fnode *task_filedesc_get(int fd);
+struct file *task_file_get(int fd);
+int task_file_fd(struct file *f);
+void splice_xfer_free(struct file *out);
+int task_mmap_add(struct file *f, void *base, uint32_t size, uint32_t attr);
+int task_mmap_del(void *base, uint32_t size);
 int task_segfault(uint32_t addr, uint32_t instr, int flags);
 
 int task_fd_readable(int fd);
 int task_fd_writable(int fd);
 int task_filedesc_del(int fd);
 void task_suspend(void);
+uint16_t task_get_prio(int pid);
+void task_set_prio(int pid, uint16_t prio);
 void task_resume(int pid);
 int task_create(struct vfs_info *vfsi, void *arg, unsigned int prio);
 int task_kill(int pid, int signal);
@@ -91,21 +105,53 @@ int task_kill(int pid, int signal);
 void task_preempt(void);
 void task_preempt_all(void);
 
+/* Wait queues: tasks waiting for a lock, in arrival order. The lock is
+ * handed over directly to the task woken up. */
+struct waitq {
+    struct task *head;
+    struct task *tail;
+    /* Passes the lock on, if the task it was handed over to terminates */
+    void (*abandon)(struct waitq *q);
+};
+#define WQ_NONE         0   /* Not in the queue */
+#define WQ_WAITING      1
+#define WQ_WOKEN        2   /* Woken up by waitq_wake_one() */
+#define WQ_TIMEDOUT     3
+void waitq_add(struct waitq *q, int timeout);
+int waitq_sleep(struct waitq *q);
+int waitq_check(struct waitq *q);
+int waitq_wake_one(struct waitq *q);
+int waitq_has(struct waitq *q, int pid);
+uint16_t waitq_top_prio(struct waitq *q);
+
 struct fnode *task_getcwd(void);
 void task_chdir(struct fnode *f);
+int task_is_cwd(struct fnode *f);
 
 int sem_wait(sem_t *s);
+int sem_timedwait(sem_t *s, int timeout);
 int sem_trywait(sem_t *s);
 int sem_post(sem_t *s);
 sem_t *sem_init(int val);
 int sem_destroy(sem_t *s);
 
 int frosted_mutex_lock(frosted_mutex_t *s);
+int frosted_mutex_timedlock(frosted_mutex_t *s, int timeout);
 int frosted_mutex_trylock(frosted_mutex_t *s);
 int frosted_mutex_unlock(frosted_mutex_t *s);
+void mutex_task_exit(uint16_t pid);
 frosted_mutex_t *frosted_mutex_init();
 void frosted_mutex_destroy(frosted_mutex_t *s);
 
+rwlock_t *rwlock_init(void);
+void rwlock_destroy(rwlock_t *rw);
+int rwlock_rdlock(rwlock_t *rw);
+int rwlock_tryrdlock(rwlock_t *rw);
+int rwlock_rdunlock(rwlock_t *rw);
+int rwlock_wrlock(rwlock_t *rw);
+int rwlock_trywrlock(rwlock_t *rw);
+int rwlock_wrunlock(rwlock_t *rw);
+
 #define schedule()   *((uint32_t volatile *)0xE000ED04) = 0x10000000 
 
 /* Timers */
@@ -119,11 +165,21 @@ void check_tasklets(void);
 struct module *MODS;
 int register_module(struct module *m);
 int unregister_module(struct module *m);
+int register_addr_family(struct module *m, uint16_t family);
 struct module *module_search(char *name);
 
 /* System */
 void mpu_init(void);
-void mpu_task_on(void *stack);
+/* Areas granted to a task through the MPU, one region each (mmap) */
+#define MPU_MAP_MAX 4
+struct mpu_map {
+    uint32_t base;
+    uint32_t attr;
+};
+void mpu_task_on(void *stack, const struct mpu_map *map);
+int mpu_map_regions(void);
+int mpu_user_access(uint32_t base, uint32_t size, int writable);
+uint32_t mpu_map_attr(uint32_t base, uint32_t size, int writable);
 
 int sys_register_handler(uint32_t n, int (*_sys_c)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t));
 int syscall(uint32_t syscall_nr, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
@@ -148,6 +204,7 @@ int fno_fullpath(struct fnode *f, char *dst, int len);
 
 #define FL_EXEC   0x40
 #define FL_LINK   0x80
+#define FL_SOCK   0x100
 
 #ifndef FD_CLOEXEC
     #define FD_CLOEXEC	1
@@ -173,6 +230,14 @@ int fno_fullpath(struct fnode *f, char *dst, int len);
     #define F_SETFL 4
 #endif
 
+#ifndef F_SETPIPE_SZ
+    #define F_SETPIPE_SZ 1031
+#endif
+
+#ifndef F_GETPIPE_SZ
+    #define F_GETPIPE_SZ 1032
+#endif
+
 
 struct fnode {
     struct module *owner;
@@ -185,9 +250,42 @@ struct fnode {
     uint32_t size;
     uint32_t off;
     uint32_t usage;
+    struct epitem *epitems;     /* epoll instances watching this file */
     struct fnode *next;
 };
 
+/* Open file description. Shared among dup()'d and inherited descriptors,
+ * each open() creates a new one with its own offset.
+ */
+struct file {
+    struct fnode *fno;
+    uint32_t off;
+    uint32_t flags;
+    uint16_t refcount;
+
+    /* Progress of an interrupted readv/writev, see sys_readv_hdlr() */
+    const struct iovec *iov;
+    uint16_t iov_idx;
+    uint32_t iov_done;
+
+    /* Pending splice()/sendfile() transfer to this file */
+    struct splice_xfer *xfer;
+};
+
+/* Module operations find the current offset in fno->off: load the
+ * per-open offset before calling them, and save it back afterwards.
+ */
+static inline struct fnode *file_enter(struct file *f)
+{
+    f->fno->off = f->off;
+    return f->fno;
+}
+
+static inline void file_leave(struct file *f)
+{
+    f->off = f->fno->off;
+}
+
 #define FNO_MOD_PRIV(fno,mod) (((fno == NULL)?NULL:((mod != fno->owner)?NULL:(fno->priv))))
 #define FNO_BLOCKING(f) ((f->flags & O_NONBLOCK) == 0)
 
@@ -201,9 +299,37 @@ struct fnode *fno_create(struct module *owner, const char *name, struct fnode *p
 struct fnode *fno_create_rdonly(struct module *owner, const char *name, struct fnode *parent);
 struct fnode *fno_create_wronly(struct module *owner, const char *name, struct fnode *parent);
 struct fnode *fno_mkdir(struct module *owner, const char *name, struct fnode *parent);
-void fno_unlink(struct fnode *fno);
+int fno_unlink(struct fnode *fno);
 struct fnode *fno_search(const char *path);
 int vfs_symlink(char *file, char *link);
+int vfs_dirent(void *buf, int len, const char *name, uint8_t type, uint32_t size);
+struct fnode *vfs_search(const char *path);
+int vfs_mknod(struct module *owner, const char *path, uint32_t flags, struct fnode **fno);
+
+/* Asynchronous I/O */
+void aio_task_exit(uint16_t pid);
+
+/* Pipes */
+void sys_pipe_init(void);
+
+/* Futexes */
+void futex_task_exit(uint16_t pid);
+
+/* Message queues */
+void mqueue_init(void);
+
+/* Shared memory */
+void shm_init(void);
+
+/* Event descriptors */
+void eventfd_init(void);
+struct fnode *eventfd_get(int fd);
+void eventfd_put(struct fnode *fno);
+int eventfd_signal(struct fnode *fno, uint32_t n);
+
+/* epoll */
+void epoll_notify(struct fnode *fno, uint16_t events);
+void epoll_forget(struct fnode *fno);
 
 /* Modules (for files/sockets) */
 
@@ -232,14 +358,36 @@ struct module {
         int (*poll) (struct fnode *fno, uint16_t events, uint16_t *revents);
         int (*close)(struct fnode *fno);
         int (*ioctl)(struct fnode *fno, const uint32_t cmd, void *arg);
+        int (*fcntl)(struct fnode *fno, int cmd, uint32_t arg);
+
+        /* Vectored I/O (optional, emulated via read/write if NULL) */
+        int (*readv)(struct fnode *fno, const struct iovec *iov, int iovcnt);
+        int (*writev)(struct fnode *fno, const struct iovec *iov, int iovcnt);
 
         /* Files only (NULL == socket) */
         int (*open)(const char *path, int flags);
         int (*seek)(struct fnode *fno, int offset, int whence);
+        int (*fsync)(struct fnode *fno);
+        int (*truncate)(struct fnode *fno, uint32_t size);
         int (*creat)(struct fnode *fno);
         int (*unlink)(struct fnode *fno);
+        /* Directories: called before their children are looked up or
+         * listed, for filesystems that read directories on demand */
+        int (*lookup)(struct fnode *dir);
+        /* Directories: fills buf with getdents records from entry *pos on,
+         * without creating nodes (optional) */
+        int (*readdir)(struct fnode *dir, uint32_t *pos, void *buf, int len);
         void * (*exe)(struct fnode *fno, void *arg);
 
+        /* Direct pointer to the contents at offset off. On return, *len
+         * is the number of bytes of the file from there (optional).
+         * Areas outside the user memory map must be power-of-two blocks
+         * aligned to their size, from the start of the file. */
+        void * (*mmap)(struct fnode *fno, uint32_t off, uint32_t *len);
+        /* Same as mmap, for in-kernel transfers: only for contents that
+         * are addressable as they are, with no side effects (optional) */
+        void * (*contents)(struct fnode *fno, uint32_t off, uint32_t *len);
+
         /* Sockets only (NULL == file) */
         int (*socket)(int domain, int type, int protocol);
         int (*recvfrom)(int fd, void *buf, unsigned int len, int flags, struct sockaddr *addr, unsigned int *addrlen);
@@ -284,6 +432,29 @@ void kernel_task_init(void);
 #define F_MALLOC_OVERHEAD 20
 uint32_t mem_stats_frag(int pool);
 
+/* Block buffer cache (bcache.c) */
+#define BCACHE_SECTOR_SIZE 512
+#define BCACHE_VALID 0x01
+#define BCACHE_DIRTY 0x02
+struct bcache_buf {
+    struct fnode *dev;
+    uint32_t sector;
+    uint16_t flags;
+    uint16_t pin;
+    struct bcache_buf *prev;
+    struct bcache_buf *next;
+    uint8_t data[BCACHE_SECTOR_SIZE];
+};
+void bcache_init(void);
+struct bcache_buf *bcache_get(struct fnode *dev, uint32_t sector);
+void bcache_put(struct bcache_buf *b);
+void bcache_dirty(struct bcache_buf *b);
+int bcache_read(struct fnode *dev, void *buf, uint32_t sector, int offset, int count);
+int bcache_read_blocks(struct fnode *dev, void *buf, uint32_t sector, uint32_t count);
+int bcache_write(struct fnode *dev, const void *buf, uint32_t sector, int offset, int count);
+int bcache_sync(struct fnode *dev);
+void bcache_invalidate(struct fnode *dev);
+
 /* Helper defined by sysfs.c */
 int ul_to_str(unsigned long n, char *s);
 int sysfs_register(char *name, char *dir,
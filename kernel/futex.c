@@ -0,0 +1,161 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+
+/* Futexes: tasks sleeping on a word of memory.
+ *
+ * Locks implemented in userspace (see include/frosted_locks.h) only
+ * enter the kernel when contended: FUTEX_WAIT sleeps as long as the
+ * word holds the expected value, FUTEX_WAKE wakes up the tasks sleeping
+ * on the word, in arrival order.
+ *
+ * Waiters are kept in a small hash table, keyed by the address of the
+ * word. Syscall handlers never run concurrently, so the value cannot
+ * change between the check and the sleep.
+ */
+
+#define FUTEX_HASH 16
+
+struct futex_waiter {
+    volatile int *uaddr;
+    uint16_t pid;
+    uint8_t woken;
+    uint32_t deadline;
+    struct futex_waiter *next;
+};
+
+static struct futex_waiter *futex_hash[FUTEX_HASH];
+
+static struct futex_waiter **futex_bucket(volatile int *uaddr)
+{
+    return &futex_hash[(((uint32_t)uaddr) >> 2) % FUTEX_HASH];
+}
+
+static struct futex_waiter *futex_find(int pid, struct futex_waiter ***prev)
+{
+    struct futex_waiter **pp;
+    int i;
+    for (i = 0; i < FUTEX_HASH; i++) {
+        for (pp = &futex_hash[i]; *pp; pp = &(*pp)->next) {
+            if ((*pp)->pid == pid) {
+                if (prev)
+                    *prev = pp;
+                return *pp;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void futex_timeout(uint32_t now, void *arg)
+{
+    task_resume((int)arg);
+}
+
+static int futex_wait(volatile int *uaddr, int val, int timeout)
+{
+    int pid = scheduler_get_cur_pid();
+    struct futex_waiter *w, **pp;
+
+    /* Restarted after a wakeup? */
+    w = futex_find(pid, &pp);
+    if (w) {
+        if (w->woken) {
+            *pp = w->next;
+            kfree(w);
+            return 0;
+        }
+        if ((timeout >= 0) && (jiffies >= w->deadline)) {
+            *pp = w->next;
+            kfree(w);
+            return -ETIMEDOUT;
+        }
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    if (*uaddr != val)
+        return -EAGAIN;
+    if (timeout == 0)
+        return -ETIMEDOUT;
+
+    w = kcalloc(sizeof(struct futex_waiter), 1);
+    if (!w)
+        return -ENOMEM;
+    w->uaddr = uaddr;
+    w->pid = pid;
+    /* Appended: woken up in arrival order */
+    for (pp = futex_bucket(uaddr); *pp; pp = &(*pp)->next)
+        ;
+    *pp = w;
+    if (timeout > 0) {
+        w->deadline = jiffies + timeout;
+        ktimer_add(timeout, futex_timeout, (void *)pid);
+    }
+    task_suspend();
+    return SYS_CALL_AGAIN;
+}
+
+static int futex_wake(volatile int *uaddr, int n)
+{
+    struct futex_waiter *w;
+    int woken = 0;
+    for (w = *futex_bucket(uaddr); w && (woken < n); w = w->next) {
+        if ((w->uaddr != uaddr) || w->woken)
+            continue;
+        w->woken = 1;
+        task_resume(w->pid);
+        woken++;
+    }
+    return woken;
+}
+
+/* A task is going away: forget its wait */
+void futex_task_exit(uint16_t pid)
+{
+    struct futex_waiter *w, **pp;
+    w = futex_find(pid, &pp);
+    if (w) {
+        *pp = w->next;
+        kfree(w);
+    }
+}
+
+/* futex(uaddr, op, val, timeout): the timeout of FUTEX_WAIT is relative,
+ * in milliseconds; a negative value waits forever. */
+int sys_futex_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    volatile int *uaddr = (volatile int *)arg1;
+    int val = (int)arg3;
+
+    if (!uaddr || (arg1 & 0x03))
+        return -EINVAL;
+    switch (arg2) {
+        case FUTEX_WAIT:
+            return futex_wait(uaddr, val, (int)arg4);
+        case FUTEX_WAKE:
+            if (val <= 0)
+                return 0;
+            return futex_wake(uaddr, val);
+        default:
+            return -ENOSYS;
+    }
+}
@@ -2,13 +2,57 @@
 #ifndef FROSTED_INTERRUPTS_H
 #define FROSTED_INTERRUPTS_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 extern void __set_BASEPRI(int);
 
+/* NVIC priorities. Only the upper bits of each priority byte are
+ * implemented (3 on LM3S, 4 on STM32F4), so values are left-aligned.
+ * Device interrupts default to 0 (highest) and preempt syscall
+ * handlers, which run with interrupts enabled.
+ */
+#define IRQ_PRIO_SYSTICK    0x80
+#define IRQ_PRIO_SVC        0xC0
+#define IRQ_PRIO_PENDSV     0xE0
+
+/* Nonzero when running in a device or SysTick ISR (not SVC/PendSV) */
+static inline int in_irq(void)
+{
+    uint32_t ipsr;
+    asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+    return ((ipsr & 0x1FF) >= 15);
+}
+
+#ifdef CONFIG_IRQ_PROFILE
+    /* DWT cycle counter, enabled by irqprof_init() */
+#   define IRQPROF_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+    extern volatile uint32_t irqprof_masked_since;
+    extern const char * volatile irqprof_masked_site;
+    extern volatile int irqprof_masked_line;
+    extern volatile uint32_t irqprof_masked_max;
+    extern const char * volatile irqprof_masked_max_site;
+    extern volatile int irqprof_masked_max_line;
+
+    void irqprof_init(void);
+    void irqprof_isr_exit(uint32_t t0);
+
+    /* To be placed at the very beginning / end of an ISR.
+     * The vector is identified at exit time via IPSR.
+     */
+#   define IRQPROF_ENTER() uint32_t __irqprof_t0 = IRQPROF_CYCCNT
+#   define IRQPROF_EXIT()  irqprof_isr_exit(__irqprof_t0)
+#else
+#   define IRQPROF_ENTER() do{}while(0)
+#   define IRQPROF_EXIT()  do{}while(0)
+#endif
+
 #ifdef DEBUG
     static void irq_off(void)
     {
     }
-    
+
     static void irq_on(void)
     {
     }
@@ -16,10 +60,19 @@ extern void __set_BASEPRI(int);
     static void irq_setmask(void)
     {
     }
-    
+
     static void irq_clearmask(void)
     {
     }
+
+    static uint32_t irq_save(void)
+    {
+        return 0;
+    }
+
+    static void irq_restore(uint32_t primask)
+    {
+    }
 #else
     /* Inline kernel utils */
 
@@ -27,21 +80,85 @@ extern void __set_BASEPRI(int);
     {
         __set_BASEPRI(3);
     }
-    
+
     static inline void irq_clearmask(void)
     {
         __set_BASEPRI(0u);
     }
 
+#ifdef CONFIG_IRQ_PROFILE
+    /* No function calls allowed in here: irq_off() is used in naked
+     * handlers (e.g. sv_call_handler) before the context is saved.
+     */
+    static inline void _irq_off(const char *site, int line)
+    {
+        asm volatile ("cpsid i                \n");
+        if (!irqprof_masked_site) {
+            irqprof_masked_since = IRQPROF_CYCCNT;
+            irqprof_masked_site = site;
+            irqprof_masked_line = line;
+        }
+    }
+
+    static inline void _irq_on(void)
+    {
+        if (irqprof_masked_site) {
+            uint32_t masked = IRQPROF_CYCCNT - irqprof_masked_since;
+            if (masked > irqprof_masked_max) {
+                irqprof_masked_max = masked;
+                irqprof_masked_max_site = irqprof_masked_site;
+                irqprof_masked_max_line = irqprof_masked_line;
+            }
+            irqprof_masked_site = NULL;
+        }
+        asm volatile ("cpsie i                \n");
+    }
+
+#   define irq_off() _irq_off(__func__, __LINE__)
+#   define irq_on()  _irq_on()
+
+    /* Nesting-safe variants: only the outermost section is profiled */
+    static inline uint32_t _irq_save(const char *site, int line)
+    {
+        uint32_t primask;
+        asm volatile ("mrs %0, primask" : "=r" (primask));
+        if (!primask)
+            _irq_off(site, line);
+        return primask;
+    }
+
+    static inline void irq_restore(uint32_t primask)
+    {
+        if (!primask)
+            _irq_on();
+    }
+
+#   define irq_save() _irq_save(__func__, __LINE__)
+#else
     static inline void irq_off(void)
     {
         asm volatile ("cpsid i                \n");
     }
-    
+
     static inline void irq_on(void)
     {
         asm volatile ("cpsie i                \n");
     }
+
+    /* Nesting-safe variants, usable from both ISRs and syscalls */
+    static inline uint32_t irq_save(void)
+    {
+        uint32_t primask;
+        asm volatile ("mrs %0, primask" : "=r" (primask));
+        asm volatile ("cpsid i                \n");
+        return primask;
+    }
+
+    static inline void irq_restore(uint32_t primask)
+    {
+        asm volatile ("msr primask, %0" :: "r" (primask));
+    }
+#endif
 #endif
 
 #endif /* FROSTED_INTERRUPTS_H */
@@ -0,0 +1,234 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+
+/* Interrupt latency instrumentation.
+ *
+ * ISR durations are measured with the DWT cycle counter between
+ * IRQPROF_ENTER() and IRQPROF_EXIT(). Durations include the time spent
+ * in nested (higher priority) interrupts.
+ *
+ * The longest window with interrupts masked (irq_off() -> irq_on()) is
+ * tracked directly by the inline helpers in interrupts.h.
+ */
+
+#define DBG_DEMCR       (*(volatile uint32_t *)0xE000EDFC)
+#define DBG_DEMCR_TRCENA (1 << 24)
+#define DWT_CTRL        (*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+
+#define IRQPROF_MAX_VECTORS 16
+#define IRQPROF_HIST_SIZE   8
+#define IRQPROF_HIST_SHIFT  8   /* First bucket: < 256 cycles */
+
+#define MAX_SYSFS_BUFFER 1024
+
+struct irqprof_vector {
+    uint16_t vector;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t hist[IRQPROF_HIST_SIZE];
+};
+
+static struct irqprof_vector irqprof_vec[IRQPROF_MAX_VECTORS];
+static int irqprof_n_vec = 0;
+static uint32_t irqprof_lost = 0;
+
+volatile uint32_t irqprof_masked_since = 0;
+const char * volatile irqprof_masked_site = NULL;
+volatile int irqprof_masked_line = 0;
+volatile uint32_t irqprof_masked_max = 0;
+const char * volatile irqprof_masked_max_site = NULL;
+volatile int irqprof_masked_max_line = 0;
+
+static inline uint32_t ipsr_read(void)
+{
+    uint32_t ipsr;
+    asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+    return ipsr & 0x1FF;
+}
+
+/* Save and restore PRIMASK around accesses to the statistics, without
+ * going through irq_off()/irq_on() (which are instrumented themselves).
+ */
+static inline uint32_t irqprof_lock(void)
+{
+    uint32_t primask;
+    asm volatile ("mrs %0, primask" : "=r" (primask));
+    asm volatile ("cpsid i");
+    return primask;
+}
+
+static inline void irqprof_unlock(uint32_t primask)
+{
+    asm volatile ("msr primask, %0" :: "r" (primask));
+}
+
+static int irqprof_bucket(uint32_t cycles)
+{
+    int b = 0;
+    cycles >>= IRQPROF_HIST_SHIFT;
+    while (cycles && (b < (IRQPROF_HIST_SIZE - 1))) {
+        cycles >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* Called from ISR context, right before returning. */
+void irqprof_isr_exit(uint32_t t0)
+{
+    uint32_t elapsed = IRQPROF_CYCCNT - t0;
+    uint16_t vector = (uint16_t)ipsr_read();
+    struct irqprof_vector *v = NULL;
+    uint32_t primask;
+    int i;
+
+    primask = irqprof_lock();
+    for (i = 0; i < irqprof_n_vec; i++) {
+        if (irqprof_vec[i].vector == vector) {
+            v = &irqprof_vec[i];
+            break;
+        }
+    }
+    if (!v) {
+        if (irqprof_n_vec >= IRQPROF_MAX_VECTORS) {
+            irqprof_lost++;
+            irqprof_unlock(primask);
+            return;
+        }
+        v = &irqprof_vec[irqprof_n_vec++];
+        v->vector = vector;
+        v->min = 0xFFFFFFFF;
+    }
+    v->count++;
+    if (elapsed < v->min)
+        v->min = elapsed;
+    if (elapsed > v->max)
+        v->max = elapsed;
+    v->hist[irqprof_bucket(elapsed)]++;
+    irqprof_unlock(primask);
+}
+
+static int irqprof_append(char *txt, int off, const char *s)
+{
+    int l = strlen(s);
+    if (off + l >= MAX_SYSFS_BUFFER)
+        return off;
+    strcpy(txt + off, s);
+    return off + l;
+}
+
+static int irqprof_append_ul(char *txt, int off, unsigned long n)
+{
+    if (off + 12 >= MAX_SYSFS_BUFFER)
+        return off;
+    return off + ul_to_str(n, txt + off);
+}
+
+int sysfs_irq_read(struct sysfs_fnode *sfs, void *buf, int len)
+{
+    char *res = (char *)buf;
+    struct fnode *fno = sfs->fnode;
+    static char *txt;
+    static int off;
+    int i, j;
+    if (fno->off == 0) {
+        const char irq_banner[] = "Vector\tCount\tMin\tMax\tHistogram (cycles, <256 x2)\r\n";
+        sysfs_lock();
+        txt = kalloc(MAX_SYSFS_BUFFER);
+        if (!txt) {
+            sysfs_unlock();
+            return -1;
+        }
+        off = 0;
+        off = irqprof_append(txt, off, irq_banner);
+        for (i = 0; i < irqprof_n_vec; i++) {
+            struct irqprof_vector v;
+            uint32_t primask = irqprof_lock();
+            memcpy(&v, &irqprof_vec[i], sizeof(v));
+            irqprof_unlock(primask);
+            off = irqprof_append_ul(txt, off, v.vector);
+            off = irqprof_append(txt, off, "\t");
+            off = irqprof_append_ul(txt, off, v.count);
+            off = irqprof_append(txt, off, "\t");
+            off = irqprof_append_ul(txt, off, v.min);
+            off = irqprof_append(txt, off, "\t");
+            off = irqprof_append_ul(txt, off, v.max);
+            off = irqprof_append(txt, off, "\t");
+            for (j = 0; j < IRQPROF_HIST_SIZE; j++) {
+                off = irqprof_append_ul(txt, off, v.hist[j]);
+                off = irqprof_append(txt, off, (j < IRQPROF_HIST_SIZE - 1) ? " " : "\r\n");
+            }
+        }
+        if (irqprof_lost > 0) {
+            off = irqprof_append(txt, off, "Untracked ISR samples: ");
+            off = irqprof_append_ul(txt, off, irqprof_lost);
+            off = irqprof_append(txt, off, "\r\n");
+        }
+        off = irqprof_append(txt, off, "\r\nLongest irq_off() window: ");
+        off = irqprof_append_ul(txt, off, irqprof_masked_max);
+        off = irqprof_append(txt, off, " cycles");
+        if (irqprof_masked_max_site) {
+            off = irqprof_append(txt, off, " in ");
+            off = irqprof_append(txt, off, irqprof_masked_max_site);
+            off = irqprof_append(txt, off, ":");
+            off = irqprof_append_ul(txt, off, irqprof_masked_max_line);
+        }
+        off = irqprof_append(txt, off, "\r\n");
+    }
+    if (off == fno->off) {
+        kfree(txt);
+        sysfs_unlock();
+        return -1;
+    }
+    if (len > (off - fno->off)) {
+       len = off - fno->off;
+    }
+    memcpy(res, txt + fno->off, len);
+    fno->off += len;
+    return len;
+}
+
+/* Writing anything to /sys/irq resets the statistics */
+int sysfs_irq_write(struct sysfs_fnode *sfs, const void *buf, int len)
+{
+    uint32_t primask = irqprof_lock();
+    memset(irqprof_vec, 0, sizeof(irqprof_vec));
+    irqprof_n_vec = 0;
+    irqprof_lost = 0;
+    irqprof_masked_max = 0;
+    irqprof_masked_max_site = NULL;
+    irqprof_masked_max_line = 0;
+    irqprof_unlock(primask);
+    return len;
+}
+
+void irqprof_init(void)
+{
+    /* DEMCR is also used by fpb_init(): preserve its bits. */
+    DBG_DEMCR |= DBG_DEMCR_TRCENA;
+    IRQPROF_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+    sysfs_register("irq", "/sys", sysfs_irq_read, sysfs_irq_write);
+}
@@ -57,19 +57,23 @@ static int klog_close(struct fnode *f)
 
 static int klog_read(struct fnode *fno, void *buf, unsigned int len)
 {
-    int ret;
+    uint32_t primask;
     if (len == 0)
         return len;
     if (!buf)
         return -EINVAL;
 
-    ret = cirbuf_readbytes(klog.buf, buf, len);
-    if (ret <= 0) {
+    /* The ring is lock-free: only the check-and-sleep must not race
+     * with a kprintf() from an ISR */
+    primask = irq_save();
+    if (cirbuf_bytesinuse(klog.buf) <= 0) {
         klog.pid = scheduler_get_cur_pid();
         task_suspend();
+        irq_restore(primask);
         return SYS_CALL_AGAIN;
     }
-    return ret;
+    irq_restore(primask);
+    return cirbuf_readbytes(klog.buf, buf, len);
 }
 
 static int klog_poll(struct fnode *fno, uint16_t events, uint16_t *revents)
@@ -101,11 +105,7 @@ static void printchar(char **str, int c)
         ++(*str);
     }
     else {
-        if (cirbuf_bytesfree(klog.buf)) {
-            cirbuf_writebyte(klog.buf, c);
-            if (klog.pid > 0) 
-                task_resume(klog.pid);
-        }
+        cirbuf_writebyte(klog.buf, c);
     }
 }
 
@@ -267,6 +267,8 @@ int kprintf(const char *format, ...)
         va_start(args, format);
         ret = print(0, format, args);
         frosted_mutex_unlock(klog_lock);
+        if (klog.pid > 0)
+            task_resume(klog.pid);
         return ret;
     }
     return 0;
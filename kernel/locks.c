@@ -19,42 +19,223 @@
  */  
 #include "frosted.h"
 #include "locks.h"
+#include <stddef.h>
 
+/* Semaphores and mutexes.
+ *
+ * Tasks that cannot take the lock wait in a FIFO queue. Releasing the
+ * lock hands it over directly to the first task in the queue, which is
+ * woken up already owning it: a task arriving later cannot take it in
+ * the meantime, and no other waiter is woken up for nothing.
+ *
+ * Mutexes implement priority inheritance. A locked mutex records its
+ * owner, and is kept in the list of locked mutexes. A task that has to
+ * wait for a mutex raises the effective priority of the owner to its
+ * own, and so on along the chain if the owner is waiting for another
+ * mutex. On unlock, the owner goes back to the priority of the tasks
+ * waiting for the other mutexes it holds.
+ *
+ * Reader-writer locks let readers of structures that rarely change
+ * proceed together. They are phase-fair: readers arriving while a
+ * writer waits queue behind it, and when a writer unlocks, all the
+ * readers waiting go before the next writer. Neither side can starve.
+ *
+ * Locks can be released from ISRs: the shared state is accessed with
+ * interrupts masked. The kernel task (pid 0) cannot sleep, it spins.
+ * Callers that can sleep must return SYS_CALL_AGAIN to the syscall
+ * when told so: they are queued, and do not own the lock yet.
+ *
+ * Only the owner can unlock a mutex, or an ISR completing a transfer
+ * the owner started. Mutexes still held by a task that terminates are
+ * released when the task is destroyed.
+ */
+
+#define MUTEX_PI_CHAIN 4
 
-/* Semaphore: internal functions */
-static void _add_listener(sem_t *s)
+static frosted_mutex_t *mutex_locked = NULL;
+
+/* Mutex: priority inheritance */
+static void mutex_locked_del(frosted_mutex_t *s)
 {
-    int i;
-    int pid = scheduler_get_cur_pid();
-    for (i = 0; i < s->listeners; i++) {
-        if (s->listener[i] == pid)
-            return;
-        if (s->listener[i] == -1) {
-            s->listener[i] = pid;
+    frosted_mutex_t **pp;
+    uint32_t primask = irq_save();
+    for (pp = &mutex_locked; *pp; pp = &(*pp)->next_locked) {
+        if (*pp == s) {
+            *pp = s->next_locked;
+            break;
         }
     }
+    s->next_locked = NULL;
+    s->owner = 0;
+    irq_restore(primask);
 }
 
-static void _del_listener(sem_t *s)
+static void mutex_set_owner(frosted_mutex_t *s, int pid)
 {
-    int i;
-    int pid = scheduler_get_cur_pid();
-    for (i = 0; i < s->listeners; i++) {
-        if (s->listener[i] == pid) {
-            s->listener[i] = -1;
-            return;
+    uint32_t primask;
+    if (pid <= 0)
+        return;
+    primask = irq_save();
+    s->owner = pid;
+    s->next_locked = mutex_locked;
+    mutex_locked = s;
+    /* Tasks still waiting lend their priority to the new owner */
+    task_set_prio(pid, waitq_top_prio(&s->wq));
+    irq_restore(primask);
+}
+
+/* Locked mutex the task is waiting for, if any */
+static frosted_mutex_t *mutex_waited_by(int pid)
+{
+    frosted_mutex_t *s;
+    for (s = mutex_locked; s; s = s->next_locked) {
+        if (waitq_has(&s->wq, pid))
+            return s;
+    }
+    return NULL;
+}
+
+static void mutex_boost(frosted_mutex_t *s, uint16_t prio)
+{
+    int depth;
+    uint32_t primask = irq_save();
+    for (depth = 0; s && (depth < MUTEX_PI_CHAIN); depth++) {
+        if ((s->owner <= 0) || (task_get_prio(s->owner) >= prio))
+            break;
+        task_set_prio(s->owner, prio);
+        s = mutex_waited_by(s->owner);
+    }
+    irq_restore(primask);
+}
+
+/* s was unlocked: drops the priority its owner inherited from it */
+static void mutex_release(frosted_mutex_t *s)
+{
+    frosted_mutex_t *o;
+    int owner = s->owner;
+    uint16_t prio = 0, p;
+    uint32_t primask;
+
+    if (owner <= 0)
+        return;
+    mutex_locked_del(s);
+    primask = irq_save();
+    for (o = mutex_locked; o; o = o->next_locked) {
+        if (o->owner == owner) {
+            p = waitq_top_prio(&o->wq);
+            if (p > prio)
+                prio = p;
         }
     }
+    task_set_prio(owner, prio);
+    irq_restore(primask);
 }
 
-static int sem_spinwait(sem_t *s)
+/* Common to all the locks */
+
+/* Owner recorded for the current context: ISRs and the kernel task
+ * lock on behalf of no task */
+static int lock_owner_pid(void)
 {
-    if (!s)
-        return -EINVAL;
-    while (_sem_wait(s) != 0) {
-        /* spin ... */
+    if (in_irq())
+        return 0;
+    return scheduler_get_cur_pid();
+}
+
+/* Let the task a lock was handed over to run right away, if it has a
+ * higher priority */
+static void lock_handoff_preempt(int pid)
+{
+    int cur = scheduler_get_cur_pid();
+    if ((pid > 0) && (cur > 0) && (task_get_prio(pid) > task_get_prio(cur)))
+        task_preempt();
+}
+
+/* Takes s, or queues the current task. 'timeout' in ms, negative:
+ * forever. */
+static int lock_wait(struct semaphore *s, int timeout)
+{
+    int pid = scheduler_get_cur_pid();
+    uint32_t primask;
+    int ret;
+
+    /* Restarted after a wakeup? */
+    switch (waitq_check(&s->wq)) {
+        case WQ_WOKEN:
+            /* Handed over, unless it was released in the meantime */
+            if (!s->mutex || (s->owner == pid))
+                return 0;
+            break;
+        case WQ_TIMEDOUT:
+            return -ETIMEDOUT;
+        case WQ_WAITING:
+            return waitq_sleep(&s->wq);
     }
-    return 0;
+
+    primask = irq_save();
+    ret = s->mutex ? _mutex_lock(s) : _sem_wait(s);
+    if (ret == 0) {
+        irq_restore(primask);
+        if (s->mutex)
+            mutex_set_owner(s, pid);
+        return 0;
+    }
+    if (timeout == 0) {
+        irq_restore(primask);
+        return -ETIMEDOUT;
+    }
+    waitq_add(&s->wq, timeout);
+    irq_restore(primask);
+    if (s->mutex)
+        mutex_boost(s, task_get_prio(pid));
+    return waitq_sleep(&s->wq);
+}
+
+/* Hands s over to the first task waiting, or releases it */
+static void lock_release(struct semaphore *s)
+{
+    uint32_t primask;
+    int pid;
+
+    primask = irq_save();
+    if (s->mutex)
+        mutex_release(s);
+    pid = waitq_wake_one(&s->wq);
+    if (pid > 0) {
+        if (s->mutex)
+            mutex_set_owner(s, pid);
+    } else if (s->mutex) {
+        _mutex_unlock(s);
+    } else {
+        _sem_post(s);
+    }
+    irq_restore(primask);
+    lock_handoff_preempt(pid);
+}
+
+/* The task the lock was handed over to terminated before taking it */
+void lock_abandon(struct waitq *q)
+{
+    struct semaphore *s = (struct semaphore *)((uint8_t *)q - offsetof(struct semaphore, wq));
+    lock_release(s);
+}
+
+static struct semaphore *lock_new(int val, int mutex)
+{
+    struct semaphore *s = kcalloc(sizeof(struct semaphore), 1);
+    if (s) {
+        s->value = val;
+        s->mutex = mutex;
+        s->wq.abandon = lock_abandon;
+    }
+    return s;
+}
+
+static void lock_destroy(struct semaphore *s)
+{
+    if (s->mutex)
+        mutex_locked_del(s);
+    kfree(s);
 }
 
 /* Semaphore: API */
@@ -68,59 +249,41 @@ int sem_trywait(sem_t *s)
     return 0;
 }
 
-int sem_wait(sem_t *s)
+int sem_timedwait(sem_t *s, int timeout)
 {
-    if (scheduler_get_cur_pid() == 0)
-        return sem_spinwait(s);
     if (!s)
         return -EINVAL;
-    if(_sem_wait(s) != 0) {
-        _add_listener(s);
-        task_suspend();
-        return SYS_CALL_AGAIN;
+    if (scheduler_get_cur_pid() == 0) {
+        while (_sem_wait(s) != 0) {
+            /* spin ... */
+        }
+        return 0;
     }
-    _del_listener(s);
-    return 0;
+    return lock_wait(s, timeout);
 }
 
+int sem_wait(sem_t *s)
+{
+    return sem_timedwait(s, -1);
+}
 
 int sem_post(sem_t *s)
 {
     if (!s)
         return -EINVAL;
-    if (_sem_post(s) > 0) {
-        int i;
-        for(i = 0; i < s->listeners; i++) {
-            int pid = s->listener[i];
-            if (pid > 0) {
-                task_resume(pid);
-            }
-        }
-    }
+    lock_release(s);
     return 0;
 }
 
 int sem_destroy(sem_t *sem)
 {
-    if (sem->listener)
-        kfree(sem->listener);
-    kfree(sem);
+    lock_destroy(sem);
     return 0;
 }
 
 sem_t *sem_init(int val)
 {
-    sem_t *s = kalloc(sizeof(sem_t));
-    if (s) {
-        int i;
-        s->value = val;
-        s->listeners = 8;
-        s->listener = kalloc(sizeof(int) * (s->listeners + 1));
-        for (i = 0; i < s->listeners; i++)
-            s->listener[i] = -1;
-
-    }
-    return s;
+    return lock_new(val, 0);
 }
 
 /* Semaphore: Syscalls */
@@ -139,6 +302,12 @@ int sys_sem_wait_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
     return sem_wait((sem_t *)arg1);
 }
 
+/* sem_timedwait(sem, timeout): relative, in ms */
+int sys_sem_timedwait_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
+{
+    return sem_timedwait((sem_t *)arg1, arg2);
+}
+
 int sys_sem_destroy_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
 {
     return sem_destroy((sem_t *)arg1);
@@ -147,33 +316,12 @@ int sys_sem_destroy_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
 /* Mutex: API */
 frosted_mutex_t *frosted_mutex_init()
 {
-    frosted_mutex_t *s = kalloc(sizeof(frosted_mutex_t));
-    if (s) {
-        int i;
-        s->value = 1; /* Unlocked. */
-        s->listeners = 8;
-        s->listener = kalloc(sizeof(int) * (s->listeners + 1));
-        for (i = 0; i < s->listeners; i++)
-            s->listener[i] = -1;
-    }
-    return s;
+    return lock_new(1, 1); /* Unlocked. */
 }
 
 void frosted_mutex_destroy(frosted_mutex_t *s)
 {
-    if (s->listener)
-        kfree(s->listener);
-    kfree(s);
-}
-
-static int frosted_mutex_spinlock(frosted_mutex_t *s)
-{
-    if (!s)
-        return -EINVAL;
-    while (_mutex_lock(s) != 0) {
-        /* spin... */
-    }
-    return 0;
+    lock_destroy(s);
 }
 
 int frosted_mutex_trylock(frosted_mutex_t *s)
@@ -182,39 +330,56 @@ int frosted_mutex_trylock(frosted_mutex_t *s)
         return -EINVAL;
     if(_mutex_lock(s) != 0)
         return -EAGAIN;
+    mutex_set_owner(s, lock_owner_pid());
     return 0;
 }
 
-int frosted_mutex_lock(frosted_mutex_t *s)
+int frosted_mutex_timedlock(frosted_mutex_t *s, int timeout)
 {
-    if (scheduler_get_cur_pid() == 0)
-        return frosted_mutex_spinlock(s);
     if (!s)
         return -EINVAL;
-    if(_mutex_lock(s) != 0) {
-        _add_listener(s);
-        task_suspend();
-        return SYS_CALL_AGAIN;
+    if (scheduler_get_cur_pid() == 0) {
+        while (_mutex_lock(s) != 0) {
+            /* spin... */
+        }
+        return 0;
     }
-    _del_listener(s);
-    return 0;
+    return lock_wait(s, timeout);
+}
+
+int frosted_mutex_lock(frosted_mutex_t *s)
+{
+    return frosted_mutex_timedlock(s, -1);
 }
 
 int frosted_mutex_unlock(frosted_mutex_t *s)
 {
     if (!s)
         return -EINVAL;
-    if (_mutex_unlock(s) == 0) {
-        int i;
-        for(i = 0; i < s->listeners; i++) {
-            int pid = s->listener[i];
-            if (pid > 0) {
-                task_resume(pid);
-            }
+    /* Already unlocked */
+    if (s->value != 0)
+        return -EAGAIN;
+    if (!in_irq() && (s->owner != lock_owner_pid()))
+        return -EPERM;
+    lock_release(s);
+    return 0;
+}
+
+/* The task is going away: release the mutexes it still holds */
+void mutex_task_exit(uint16_t pid)
+{
+    frosted_mutex_t *s;
+    uint32_t primask;
+    do {
+        primask = irq_save();
+        for (s = mutex_locked; s; s = s->next_locked) {
+            if (s->owner == pid)
+                break;
         }
-        return 0;
-    }
-    return -EAGAIN;
+        irq_restore(primask);
+        if (s)
+            lock_release(s);
+    } while (s);
 }
 
 
@@ -229,6 +394,12 @@ int sys_mutex_lock_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
     return frosted_mutex_lock((frosted_mutex_t *)arg1);
 }
 
+/* mutex_timedlock(mutex, timeout): relative, in ms */
+int sys_mutex_timedlock_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
+{
+    return frosted_mutex_timedlock((frosted_mutex_t *)arg1, arg2);
+}
+
 int sys_mutex_unlock_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
 {
     return frosted_mutex_unlock((frosted_mutex_t *)arg1);
@@ -239,3 +410,191 @@ int sys_mutex_destroy_hdlr(int arg1, int arg2, int arg3, int arg4, int arg5)
     return sem_destroy((sem_t *)arg1); /* Same as semaphore */
 }
 
+/* Reader-writer lock: internal functions */
+static int _rw_rdlock(rwlock_t *rw)
+{
+    if (rw->writer || rw->wq.head)
+        return -1;
+    rw->readers++;
+    return 0;
+}
+
+static int _rw_wrlock(rwlock_t *rw)
+{
+    if (rw->writer || (rw->readers > 0))
+        return -1;
+    rw->writer = 1;
+    return 0;
+}
+
+/* Lock is free of readers: hands it over to the next writer */
+static int rw_wake_writer(rwlock_t *rw)
+{
+    int pid = waitq_wake_one(&rw->wq);
+    if (pid > 0)
+        rw->writer = 1;
+    return pid;
+}
+
+/* Hands the lock over to all the readers waiting. Returns the first. */
+static int rw_wake_readers(rwlock_t *rw)
+{
+    int pid, first = 0;
+    while ((pid = waitq_wake_one(&rw->rq)) > 0) {
+        rw->readers++;
+        if (!first)
+            first = pid;
+    }
+    return first;
+}
+
+static int rw_rdunlock(rwlock_t *rw)
+{
+    uint32_t primask;
+    int pid = 0;
+
+    primask = irq_save();
+    if (rw->readers <= 0) {
+        irq_restore(primask);
+        return -EAGAIN;
+    }
+    if (--rw->readers == 0) {
+        pid = rw_wake_writer(rw);
+        /* Readers queued behind a writer that went away */
+        if (!pid)
+            pid = rw_wake_readers(rw);
+    }
+    irq_restore(primask);
+    lock_handoff_preempt(pid);
+    return 0;
+}
+
+/* All the readers waiting go first, then the next writer */
+static int rw_wrunlock(rwlock_t *rw)
+{
+    uint32_t primask;
+    int pid;
+
+    primask = irq_save();
+    if (!rw->writer) {
+        irq_restore(primask);
+        return -EAGAIN;
+    }
+    rw->writer = 0;
+    pid = rw_wake_readers(rw);
+    if (!pid)
+        pid = rw_wake_writer(rw);
+    irq_restore(primask);
+    lock_handoff_preempt(pid);
+    return 0;
+}
+
+static void rw_abandon_read(struct waitq *q)
+{
+    rw_rdunlock((rwlock_t *)((uint8_t *)q - offsetof(rwlock_t, rq)));
+}
+
+static void rw_abandon_write(struct waitq *q)
+{
+    rw_wrunlock((rwlock_t *)((uint8_t *)q - offsetof(rwlock_t, wq)));
+}
+
+static int rw_wait(rwlock_t *rw, struct waitq *q, int (*trylock)(rwlock_t *))
+{
+    uint32_t primask;
+    int ret;
+
+    if (scheduler_get_cur_pid() == 0) {
+        do {
+            primask = irq_save();
+            ret = trylock(rw);
+            irq_restore(primask);
+        } while (ret != 0);
+        return 0;
+    }
+
+    /* Restarted after a wakeup? */
+    switch (waitq_check(q)) {
+        case WQ_WOKEN:
+            return 0;
+        case WQ_WAITING:
+            return waitq_sleep(q);
+    }
+
+    primask = irq_save();
+    if (trylock(rw) == 0) {
+        irq_restore(primask);
+        return 0;
+    }
+    waitq_add(q, -1);
+    irq_restore(primask);
+    return waitq_sleep(q);
+}
+
+/* Reader-writer lock: API */
+rwlock_t *rwlock_init(void)
+{
+    rwlock_t *rw = kcalloc(sizeof(rwlock_t), 1);
+    if (rw) {
+        rw->rq.abandon = rw_abandon_read;
+        rw->wq.abandon = rw_abandon_write;
+    }
+    return rw;
+}
+
+void rwlock_destroy(rwlock_t *rw)
+{
+    kfree(rw);
+}
+
+int rwlock_rdlock(rwlock_t *rw)
+{
+    if (!rw)
+        return -EINVAL;
+    return rw_wait(rw, &rw->rq, _rw_rdlock);
+}
+
+int rwlock_tryrdlock(rwlock_t *rw)
+{
+    uint32_t primask;
+    int ret;
+    if (!rw)
+        return -EINVAL;
+    primask = irq_save();
+    ret = _rw_rdlock(rw);
+    irq_restore(primask);
+    return (ret == 0) ? 0 : -EAGAIN;
+}
+
+int rwlock_rdunlock(rwlock_t *rw)
+{
+    if (!rw)
+        return -EINVAL;
+    return rw_rdunlock(rw);
+}
+
+int rwlock_wrlock(rwlock_t *rw)
+{
+    if (!rw)
+        return -EINVAL;
+    return rw_wait(rw, &rw->wq, _rw_wrlock);
+}
+
+int rwlock_trywrlock(rwlock_t *rw)
+{
+    uint32_t primask;
+    int ret;
+    if (!rw)
+        return -EINVAL;
+    primask = irq_save();
+    ret = _rw_wrlock(rw);
+    irq_restore(primask);
+    return (ret == 0) ? 0 : -EAGAIN;
+}
+
+int rwlock_wrunlock(rwlock_t *rw)
+{
+    if (!rw)
+        return -EINVAL;
+    return rw_wrunlock(rw);
+}
@@ -2,10 +2,22 @@
 /* Structures */
 struct semaphore {
     int value;
-    int listeners;
-    int *listener;
+    struct waitq wq;
+    /* Mutexes only */
+    int owner;
+    struct semaphore *next_locked;
+    uint8_t mutex;
 };
 
+struct rwlock {
+    int readers;            /* Tasks holding it for reading */
+    int writer;             /* Held for writing */
+    struct waitq rq;        /* Readers waiting */
+    struct waitq wq;        /* Writers waiting */
+};
+
+void lock_abandon(struct waitq *q);
+
 
 int _mutex_lock(void *);
 int _mutex_unlock(void *);
@@ -62,10 +62,34 @@ static struct f_malloc_block *malloc_entry[4] = {NULL, NULL, NULL, NULL};
 struct f_malloc_stats f_malloc_stats[4] = {};
 
 /* Mlock is a special lock, so initialization is made static */
-static int _m_listeners[16] = { -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 };
-static struct semaphore _mlock = { .value = 1, .listeners=16, .listener=_m_listeners};
+static struct semaphore _mlock = { .value = 1, .mutex = 1, .wq = { .abandon = lock_abandon } };
 static frosted_mutex_t *mlock = (frosted_mutex_t *)(&_mlock);
 
+/* Nobody waits for mlock: allocations cannot be restarted.
+ * A syscall runs to completion before any other task, so the only
+ * holder it could find is the kernel task, preempted: the kernel task
+ * keeps interrupts masked while it holds the lock. An ISR that finds
+ * it taken fails. */
+static int mlock_take(uint32_t *primask)
+{
+    int kernel = (scheduler_get_cur_pid() == 0) && !in_irq();
+    if (kernel)
+        *primask = irq_save();
+    if (frosted_mutex_trylock(mlock) < 0) {
+        if (kernel)
+            irq_restore(*primask);
+        return -1;
+    }
+    return 0;
+}
+
+static void mlock_give(uint32_t primask)
+{
+    frosted_mutex_unlock(mlock);
+    if ((scheduler_get_cur_pid() == 0) && !in_irq())
+        irq_restore(primask);
+}
+
 
 
 
@@ -297,17 +321,13 @@ void * f_malloc(int flags, size_t size)
 {
     struct f_malloc_block * blk = NULL, *last = NULL;
     void *ret = NULL;
+    uint32_t primask;
     while((size % 4) != 0) {
         size++;
     } 
 
-    if (scheduler_get_cur_pid() == 0) {
-        if (frosted_mutex_trylock(mlock) < 0) {
-            return NULL;
-        }
-    } else {
-        frosted_mutex_lock(mlock);
-    }
+    if (mlock_take(&primask) < 0)
+        return NULL;
 
     /* update stats */
     f_malloc_stats[MEMPOOL(flags)].malloc_calls++;
@@ -327,7 +347,7 @@ void * f_malloc(int flags, size_t size)
         /* No first fit found: ask for new memory */
         blk = (struct f_malloc_block *)f_sbrk(flags, size + sizeof(struct f_malloc_block));  // can OS give us more memory?
         if ((long)blk == -1) {
-            frosted_mutex_unlock(mlock);
+            mlock_give(primask);
             return NULL;
         }
 
@@ -356,14 +376,15 @@ void * f_malloc(int flags, size_t size)
     f_malloc_stats[MEMPOOL(flags)].mem_allocated += ((uint32_t)blk->size + sizeof(struct f_malloc_block));
 
     ret = (void *)(((uint8_t *)blk) + sizeof(struct f_malloc_block)); // pointer to newly allocated mem
-    frosted_mutex_unlock(mlock);
+    mlock_give(primask);
     return ret;
 }
 
 static void blk_rearrange(void *arg)
 {
     struct f_malloc_block *blk = arg;
-    if (frosted_mutex_trylock(mlock) < 0) {
+    uint32_t primask;
+    if (mlock_take(&primask) < 0) {
         /* Try again later. */
         tasklet_add(blk_rearrange, blk);
         return;
@@ -380,7 +401,7 @@ static void blk_rearrange(void *arg)
     }
     if (!blk->next)
         f_compact(blk);
-    frosted_mutex_unlock(mlock);
+    mlock_give(primask);
 }
 
 
@@ -418,15 +439,17 @@ uint32_t mem_stats_frag(int pool)
 {
     uint32_t frag_size = 0u;
     struct f_malloc_block *blk;
-        
-    frosted_mutex_lock(mlock);    
+    uint32_t primask;
+
+    if (mlock_take(&primask) < 0)
+        return 0;
     blk = malloc_entry[pool];
     while (blk) {
         if (!in_use(blk)) 
             frag_size += blk->size + sizeof(struct f_malloc_block); 
         blk = blk->next;
     }
-    frosted_mutex_unlock(mlock);
+    mlock_give(primask);
     return frag_size;
 }
 
@@ -18,6 +18,7 @@
  *
  */  
 #include "frosted.h"
+#include "scheduler.h"
 
 struct address_family {
     struct module *mod;
@@ -81,34 +82,601 @@ int register_addr_family(struct module *m, uint16_t family)
    return 0;
 } 
 
-int sys_read_hdlr(int fd, void *buf, int len)
+static int file_read(int fd, struct file *f, void *buf, int len)
 {
-    struct fnode *fno = task_filedesc_get(fd);
-    if (!task_fd_readable(fd))
-        return -EPERM;
-    if (fno && fno->owner->ops.read) {
-        return fno->owner->ops.read(fno, buf, len);
+    struct fnode *fno = f->fno;
+    int ret;
+    if (fno->owner && fno->owner->ops.read) {
+        ret = fno->owner->ops.read(file_enter(f), buf, len);
+        file_leave(f);
+        return ret;
     } else if (fno->owner && fno->owner->ops.recvfrom) {
         return fno->owner->ops.recvfrom(fd, buf, len, 0, NULL, NULL);
     }
     return -ENOENT;
 }
 
-int sys_write_hdlr(int fd, void *buf, int len)
+static int file_write(int fd, struct file *f, const void *buf, int len)
 {
-    struct fnode *fno = task_filedesc_get(fd);
-    if (!task_fd_writable(fd))
-        return -EPERM;
-    if (!fno)
-        return -ENOENT;
+    struct fnode *fno = f->fno;
+    int ret;
     if (fno->owner && fno->owner->ops.write) {
-        return fno->owner->ops.write(fno, buf, len);
+        ret = fno->owner->ops.write(file_enter(f), buf, len);
+        file_leave(f);
+        return ret;
     } else if (fno->owner && fno->owner->ops.sendto) {
         return fno->owner->ops.sendto(fd, buf, len, 0, NULL, 0);
     }
     return -EOPNOTSUPP;
 }
 
+int sys_read_hdlr(int fd, void *buf, int len)
+{
+    struct file *f = task_file_get(fd);
+    if (!f)
+        return -ENOENT;
+    if (!task_fd_readable(fd))
+        return -EPERM;
+    return file_read(fd, f, buf, len);
+}
+
+int sys_write_hdlr(int fd, void *buf, int len)
+{
+    struct file *f = task_file_get(fd);
+    if (!f)
+        return -ENOENT;
+    if (!task_fd_writable(fd))
+        return -EPERM;
+    return file_write(fd, f, buf, len);
+}
+
+/* Positional I/O: the offset of the open file is not modified. */
+int sys_pread_hdlr(int fd, void *buf, int len, uint32_t off)
+{
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    if (!f)
+        return -EBADF;
+    if (!task_fd_readable(fd))
+        return -EPERM;
+    fno = f->fno;
+    if (!fno->owner || !fno->owner->ops.seek)
+        return -ESPIPE;
+    if (!fno->owner->ops.read)
+        return -EINVAL;
+    fno->off = off;
+    return fno->owner->ops.read(fno, buf, len);
+}
+
+int sys_pwrite_hdlr(int fd, const void *buf, int len, uint32_t off)
+{
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    if (!f)
+        return -EBADF;
+    if (!task_fd_writable(fd))
+        return -EPERM;
+    fno = f->fno;
+    if (!fno->owner || !fno->owner->ops.seek)
+        return -ESPIPE;
+    if (!fno->owner->ops.write)
+        return -EINVAL;
+    fno->off = off;
+    return fno->owner->ops.write(fno, buf, len);
+}
+
+/* Vectored I/O emulation, one read/write per iovec.
+ *
+ * Blocking operations restart the whole syscall (SYS_CALL_AGAIN): the
+ * position reached in the vector is kept in the open file, so that the
+ * restarted call resumes from the interrupted iovec instead of
+ * transferring the first ones again. A read that would block after
+ * some data has already been transferred returns the partial count.
+ */
+static int iov_fallback(int fd, struct file *f, const struct iovec *iov, int iovcnt, int wr)
+{
+    int i = 0, tot = 0;
+    int ret;
+
+    if (f->iov == iov) {
+        i = f->iov_idx;
+        tot = f->iov_done;
+    }
+    f->iov = NULL;
+
+    for (; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        if (wr)
+            ret = file_write(fd, f, iov[i].iov_base, iov[i].iov_len);
+        else
+            ret = file_read(fd, f, iov[i].iov_base, iov[i].iov_len);
+
+        if (ret == SYS_CALL_AGAIN) {
+            if (!wr && (tot > 0)) {
+                /* Undo the suspension: return what we have */
+                task_resume(scheduler_get_cur_pid());
+                return tot;
+            }
+            f->iov = iov;
+            f->iov_idx = i;
+            f->iov_done = tot;
+            return SYS_CALL_AGAIN;
+        }
+        if (ret < 0)
+            return (tot > 0) ? tot : ret;
+        tot += ret;
+        if (ret < iov[i].iov_len)
+            break;
+    }
+    return tot;
+}
+
+int sys_readv_hdlr(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    int ret;
+    if (!f)
+        return -EBADF;
+    if (!task_fd_readable(fd))
+        return -EPERM;
+    if (!iov || (iovcnt < 0))
+        return -EINVAL;
+    fno = f->fno;
+    if (fno->owner && fno->owner->ops.readv) {
+        ret = fno->owner->ops.readv(file_enter(f), iov, iovcnt);
+        file_leave(f);
+        return ret;
+    }
+    return iov_fallback(fd, f, iov, iovcnt, 0);
+}
+
+int sys_writev_hdlr(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    int ret;
+    if (!f)
+        return -EBADF;
+    if (!task_fd_writable(fd))
+        return -EPERM;
+    if (!iov || (iovcnt < 0))
+        return -EINVAL;
+    fno = f->fno;
+    if (fno->owner && fno->owner->ops.writev) {
+        ret = fno->owner->ops.writev(file_enter(f), iov, iovcnt);
+        file_leave(f);
+        return ret;
+    }
+    return iov_fallback(fd, f, iov, iovcnt, 1);
+}
+
+/* In-kernel transfer between two descriptors.
+ *
+ * Data is moved one chunk at a time from the source read path into the
+ * destination write (or sendto) path, without going through userspace.
+ * Sources exposing their contents through ops.contents (e.g. xipfs)
+ * are handed over directly, without any intermediate copy.
+ *
+ * If the destination blocks, the pending chunk is kept in the
+ * destination file and presented again, unchanged, when the syscall is
+ * restarted: this is what the write paths expect (see sock_sendto,
+ * devuart_write, pipe_write).
+ */
+#define SPLICE_CHUNK 512
+
+struct splice_xfer {
+    struct file *src;
+    uint8_t *bounce;
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t done;
+};
+
+void splice_xfer_free(struct file *out)
+{
+    struct splice_xfer *x = out->xfer;
+    if (!x)
+        return;
+    if (x->bounce)
+        kfree(x->bounce);
+    kfree(x);
+    out->xfer = NULL;
+}
+
+/* Read the next chunk from the source into x->buf / x->len */
+static int splice_fetch(int in_fd, struct file *in, uint32_t *off_in, struct splice_xfer *x, uint32_t len)
+{
+    struct fnode *fno = in->fno;
+    uint32_t saved_off = in->off;
+    uint32_t avail = len;
+    int ret;
+
+    if (off_in)
+        in->off = *off_in;
+
+    if (fno->owner && fno->owner->ops.contents) {
+        x->buf = fno->owner->ops.contents(fno, in->off, &avail);
+        ret = 0;
+        if (x->buf && (in->off < fno->size)) {
+            if (avail > len)
+                avail = len;
+            if (avail > (fno->size - in->off))
+                avail = fno->size - in->off;
+            ret = avail;
+        }
+        in->off += ret;
+    } else {
+        if (len > SPLICE_CHUNK)
+            len = SPLICE_CHUNK;
+        if (!x->bounce)
+            x->bounce = kalloc(SPLICE_CHUNK);
+        if (!x->bounce)
+            return -ENOMEM;
+        x->buf = x->bounce;
+        ret = file_read(in_fd, in, x->buf, len);
+    }
+
+    if (off_in) {
+        *off_in = in->off;
+        in->off = saved_off;
+    }
+    if (ret > 0)
+        x->len = ret;
+    return ret;
+}
+
+static int splice_write(int out_fd, struct file *out, uint32_t *off_out, struct splice_xfer *x)
+{
+    uint32_t saved_off = out->off;
+    int ret;
+    if (off_out)
+        out->off = *off_out;
+    ret = file_write(out_fd, out, x->buf, x->len);
+    if (off_out) {
+        *off_out = out->off;
+        out->off = saved_off;
+    }
+    return ret;
+}
+
+static int do_splice(int in_fd, uint32_t *off_in, int out_fd, uint32_t *off_out, uint32_t count)
+{
+    struct file *in = task_file_get(in_fd);
+    struct file *out = task_file_get(out_fd);
+    struct splice_xfer *x;
+    int ret;
+
+    if (!in || !out)
+        return -EBADF;
+    if (!task_fd_readable(in_fd) || !task_fd_writable(out_fd))
+        return -EBADF;
+    if (in == out)
+        return -EINVAL;
+
+    /* Not a restarted call: drop any stale transfer */
+    if (out->xfer && (out->xfer->src != in))
+        splice_xfer_free(out);
+
+    if (!out->xfer) {
+        out->xfer = kcalloc(sizeof(struct splice_xfer), 1);
+        if (!out->xfer)
+            return -ENOMEM;
+        out->xfer->src = in;
+    }
+    x = out->xfer;
+
+    while ((x->len > 0) || (x->done < count)) {
+        if (x->len == 0) {
+            ret = splice_fetch(in_fd, in, off_in, x, count - x->done);
+            if (ret == SYS_CALL_AGAIN) {
+                if (x->done == 0)
+                    return SYS_CALL_AGAIN;
+                /* Don't wait for more input, return what we have */
+                task_resume(scheduler_get_cur_pid());
+                break;
+            }
+            if (ret <= 0) {
+                if (x->done == 0) {
+                    splice_xfer_free(out);
+                    return (ret == -1) ? 0 : ret; /* -1: EOF on files */
+                }
+                break;
+            }
+        }
+
+        ret = splice_write(out_fd, out, off_out, x);
+        if (ret == SYS_CALL_AGAIN)
+            return SYS_CALL_AGAIN;
+        if (ret <= 0) {
+            /* Give back what could not be sent to seekable sources */
+            if (in->fno->owner && in->fno->owner->ops.seek) {
+                if (off_in)
+                    *off_in -= x->len;
+                else
+                    in->off -= x->len;
+            }
+            if (x->done == 0) {
+                splice_xfer_free(out);
+                return (ret < 0) ? ret : -EAGAIN;
+            }
+            break;
+        }
+        x->buf += ret;
+        x->len -= ret;
+        x->done += ret;
+    }
+    ret = x->done;
+    splice_xfer_free(out);
+    return ret;
+}
+
+int sys_sendfile_hdlr(int out_fd, int in_fd, uint32_t *offset, uint32_t count)
+{
+    return do_splice(in_fd, offset, out_fd, NULL, count);
+}
+
+/* Flags are not supported: the transfer always behaves like
+ * SPLICE_F_MOVE. */
+int sys_splice_hdlr(int fd_in, uint32_t *off_in, int fd_out, uint32_t *off_out, uint32_t len)
+{
+    return do_splice(fd_in, off_in, fd_out, off_out, len);
+}
+
+/* Asynchronous I/O.
+ *
+ * A request is a read or write that would otherwise be restarted with
+ * SYS_CALL_AGAIN until the driver is done: instead of keeping the task
+ * suspended, the suspension is undone and the request stays queued.
+ * Queued requests are retried, in the context of the submitting task,
+ * every time it enters one of the aio_* calls. Drivers keep the pid of
+ * the task they suspended, so aio_suspend() sleeps until any of them
+ * signals progress.
+ *
+ * Requests on the same file are served in order: only the oldest one
+ * is in flight, since drivers keep the state of an interrupted transfer
+ * per file. Seekable files are accessed at aio_offset, like pread().
+ */
+#define AIO_READ    0
+#define AIO_WRITE   1
+
+struct aio_req {
+    struct aiocb *cb;
+    int op;
+    struct aio_req *next;
+};
+
+struct aio_ctx {
+    uint16_t pid;
+    uint8_t waiting;            /* In aio_suspend() */
+    uint32_t deadline;
+    struct aio_req *reqs;       /* In submission order */
+    struct aio_ctx *next;
+};
+
+static struct aio_ctx *aio_ctxs = NULL;
+
+static struct aio_ctx *aio_ctx_get(uint16_t pid, int create)
+{
+    struct aio_ctx *c;
+    for (c = aio_ctxs; c; c = c->next) {
+        if (c->pid == pid)
+            return c;
+    }
+    if (!create)
+        return NULL;
+    c = kcalloc(sizeof(struct aio_ctx), 1);
+    if (!c)
+        return NULL;
+    c->pid = pid;
+    c->next = aio_ctxs;
+    aio_ctxs = c;
+    return c;
+}
+
+static int aio_complete(struct aiocb *cb, int ret)
+{
+    cb->__return = ret;
+    cb->__error = (ret < 0) ? -ret : 0;
+    return 1;
+}
+
+/* Returns 1 if the request is complete */
+static int aio_try(struct aio_req *r)
+{
+    struct aiocb *cb = r->cb;
+    int fd = cb->aio_fildes;
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    int ret;
+
+    if (!f)
+        return aio_complete(cb, -EBADF);
+    fno = f->fno;
+    if (fno->owner && fno->owner->ops.seek) {
+        /* Positional */
+        fno->off = cb->aio_offset;
+        if ((r->op == AIO_READ) && fno->owner->ops.read)
+            ret = fno->owner->ops.read(fno, (void *)cb->aio_buf, cb->aio_nbytes);
+        else if ((r->op == AIO_WRITE) && fno->owner->ops.write)
+            ret = fno->owner->ops.write(fno, (const void *)cb->aio_buf, cb->aio_nbytes);
+        else
+            ret = -EINVAL;
+    } else if (r->op == AIO_READ) {
+        ret = file_read(fd, f, (void *)cb->aio_buf, cb->aio_nbytes);
+    } else {
+        ret = file_write(fd, f, (const void *)cb->aio_buf, cb->aio_nbytes);
+    }
+    if (ret == SYS_CALL_AGAIN)
+        return 0;
+    return aio_complete(cb, ret);
+}
+
+/* Retries the queued requests. Returns the number completed. */
+static int aio_progress(struct aio_ctx *c)
+{
+    struct aio_req *r, *o, **pp;
+    int done = 0, busy;
+
+    pp = &c->reqs;
+    while (*pp) {
+        r = *pp;
+        busy = 0;
+        for (o = c->reqs; o != r; o = o->next) {
+            if (o->cb->aio_fildes == r->cb->aio_fildes)
+                busy = 1;
+        }
+        if (!busy && aio_try(r)) {
+            *pp = r->next;
+            kfree(r);
+            done++;
+            continue;
+        }
+        pp = &r->next;
+    }
+    return done;
+}
+
+/* Drivers that could not complete a request suspended the task */
+static void aio_unsuspend(uint16_t pid)
+{
+    if (scheduler_task_state(pid) == TASK_WAITING)
+        task_resume(pid);
+}
+
+static int aio_submit(struct aiocb *cb, int op)
+{
+    uint16_t pid = scheduler_get_cur_pid();
+    struct aio_ctx *c;
+    struct aio_req *r, **pp;
+
+    if (!cb)
+        return -EINVAL;
+    if (!task_file_get(cb->aio_fildes))
+        return -EBADF;
+    if (op == AIO_READ ? !task_fd_readable(cb->aio_fildes) : !task_fd_writable(cb->aio_fildes))
+        return -EBADF;
+    c = aio_ctx_get(pid, 1);
+    if (!c)
+        return -EAGAIN;
+    r = kalloc(sizeof(struct aio_req));
+    if (!r)
+        return -EAGAIN;
+    r->cb = cb;
+    r->op = op;
+    r->next = NULL;
+    for (pp = &c->reqs; *pp; pp = &(*pp)->next)
+        ;
+    *pp = r;
+    cb->__error = EINPROGRESS;
+    cb->__return = 0;
+    aio_progress(c);
+    aio_unsuspend(pid);
+    return 0;
+}
+
+int sys_aio_read_hdlr(struct aiocb *cb)
+{
+    return aio_submit(cb, AIO_READ);
+}
+
+int sys_aio_write_hdlr(struct aiocb *cb)
+{
+    return aio_submit(cb, AIO_WRITE);
+}
+
+int sys_aio_error_hdlr(struct aiocb *cb)
+{
+    uint16_t pid = scheduler_get_cur_pid();
+    struct aio_ctx *c = aio_ctx_get(pid, 0);
+    if (!cb)
+        return -EINVAL;
+    if (c && (cb->__error == EINPROGRESS)) {
+        aio_progress(c);
+        aio_unsuspend(pid);
+    }
+    return cb->__error;
+}
+
+int sys_aio_return_hdlr(struct aiocb *cb)
+{
+    if (!cb || (cb->__error == EINPROGRESS))
+        return -EINVAL;
+    return cb->__return;
+}
+
+static void aio_timeout(uint32_t now, void *arg)
+{
+    task_resume((int)arg);
+}
+
+/* Waits until one of the requests in list is complete, or for timeout
+ * milliseconds (-1: forever). */
+int sys_aio_suspend_hdlr(const struct aiocb * const *list, int nent, int timeout)
+{
+    uint16_t pid = scheduler_get_cur_pid();
+    struct aio_ctx *c = aio_ctx_get(pid, 0);
+    int i, pending = 0;
+
+    if (!list || (nent <= 0))
+        return -EINVAL;
+    if (c)
+        aio_progress(c);
+    for (i = 0; i < nent; i++) {
+        if (!list[i])
+            continue;
+        if (list[i]->__error != EINPROGRESS)
+            break;
+        pending++;
+    }
+    if ((i < nent) || !pending || !c) {
+        if (c)
+            c->waiting = 0;
+        aio_unsuspend(pid);
+        return 0;
+    }
+
+    if (!c->waiting) {
+        c->waiting = 1;
+        c->deadline = jiffies + timeout;
+        if (timeout > 0)
+            ktimer_add(timeout, aio_timeout, (void *)(uint32_t)pid);
+    }
+    if ((timeout == 0) || ((timeout > 0) && (jiffies >= c->deadline))) {
+        c->waiting = 0;
+        aio_unsuspend(pid);
+        return -EAGAIN;
+    }
+
+    /* Requests not suspended by their driver are polled */
+    if (scheduler_task_state(pid) != TASK_WAITING) {
+        ktimer_add(1, aio_timeout, (void *)(uint32_t)pid);
+        task_suspend();
+    }
+    return SYS_CALL_AGAIN;
+}
+
+/* Called when a task terminates: results are not delivered */
+void aio_task_exit(uint16_t pid)
+{
+    struct aio_ctx *c, **pp;
+    struct aio_req *r;
+    for (pp = &aio_ctxs; *pp; pp = &(*pp)->next) {
+        c = *pp;
+        if (c->pid != pid)
+            continue;
+        while (c->reqs) {
+            r = c->reqs;
+            c->reqs = r->next;
+            kfree(r);
+        }
+        *pp = c->next;
+        kfree(c);
+        return;
+    }
+}
+
 int sys_socket_hdlr(int family, int type, int proto)
 {
     struct module *m = af_to_module(family);
@@ -116,9 +684,7 @@ int sys_socket_hdlr(int family, int type, int proto)
     if(!m || !(m->ops.socket))
         return -EOPNOTSUPP;
     res = m->ops.socket(family, type, proto);
-    if (res >= 0) {
-        
-    }
+    return res;
 }
 
 int sys_bind_hdlr(int sd, struct sockaddr_env *se)
@@ -173,6 +739,76 @@ int sys_recvfrom_hdlr(int sd, void *buf, int len, int flags, struct sockaddr_env
     return -EINVAL;
 }
 
+/* mmap(len, prot, flags, fd, off): the address hint is not supported.
+ * Returns the address of the mapping. As on Linux, errors are in the
+ * range [-4095, -1], which never holds a mapping.
+ *
+ * Areas outside the user-accessible memory map (e.g. kernel memory, or
+ * shared memory segments) are granted to the task through one of the
+ * MPU regions reserved for mappings. A region covers a power-of-two
+ * block aligned to its size, which may extend past len and past the
+ * end of the file: such areas are allocated as power-of-two blocks
+ * themselves (see ops.mmap), so the region stays within them.
+ */
+int sys_mmap_hdlr(uint32_t len, uint32_t prot, uint32_t flags, int fd, uint32_t off)
+{
+    struct file *f = task_file_get(fd);
+    struct fnode *fno;
+    uint32_t avail = len;
+    uint32_t attr, size;
+    int writable = ((prot & PROT_WRITE) != 0);
+    void *addr;
+    int ret;
+
+    if (!f)
+        return -EBADF;
+    if ((len == 0) || ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0))
+        return -EINVAL;
+    fno = f->fno;
+    if (!fno->owner || !fno->owner->ops.mmap)
+        return -ENODEV;
+
+    /* Private writable mappings would need copy-on-write */
+    if (writable && (flags & MAP_PRIVATE))
+        return -EOPNOTSUPP;
+    if (writable && ((f->flags & O_ACCMODE) == O_RDONLY))
+        return -EACCES;
+
+    addr = fno->owner->ops.mmap(fno, off, &avail);
+    if (!addr || (avail < len))
+        return -ENXIO;
+
+    if (mpu_user_access((uint32_t)addr, len, writable))
+        return (int)addr;
+
+    /* Read-only area (e.g. XIP flash) */
+    if (writable && mpu_user_access((uint32_t)addr, len, 0))
+        return -EACCES;
+
+    size = 32;
+    while (size && (size < len))
+        size <<= 1;
+    if (!size)
+        return -EACCES;
+    attr = mpu_map_attr((uint32_t)addr, size, writable);
+    if (!attr)
+        return -EACCES;
+    ret = task_mmap_add(f, addr, size, attr);
+    if (ret < 0)
+        return ret;
+    return (int)addr;
+}
+
+int sys_munmap_hdlr(void *addr, uint32_t len)
+{
+    if (task_mmap_del(addr, len) == 0)
+        return 0;
+    /* Nothing to release for areas in the user memory map */
+    if (mpu_user_access((uint32_t)addr, len, 0))
+        return 0;
+    return -EINVAL;
+}
+
 int sys_sendto_hdlr(int sd, const void *buf, int len, int flags, struct sockaddr_env *se )
 {
     struct fnode *fno = task_filedesc_get(sd);
@@ -57,6 +57,15 @@
 #define EXTDEV_START      (0xA0000000)
 #define REG_START         (0xE0000000)
 
+#define FLASH_SIZE        (256 * 1024 * 1024)
+#define USER_SIZE         (1024 * 1024 * 1024)
+#define EXTRAM_SIZE       (512 * 1024 * 1024)
+
+/* Region reserved for the first area mapped by the running task (mmap).
+ * MPUs with more than 8 regions map further areas from region 8 on. */
+#define MPU_REGION_MAP    6
+#define MPU_REGION_MAP_X  8
+
 uint32_t mpu_size(uint32_t size)
 {
     switch(size) {
@@ -95,20 +104,41 @@ uint32_t mpu_size(uint32_t size)
 
 
 static uint32_t mpu_bits = 0;
+static int mpu_n_map = 0;
 
 int mpu_present(void)
 {
+    int dregion;
     mpu_bits = MPU_TYPE;
-    if (mpu_bits != 0)
-        return 1;
-    return 0;
+    if (mpu_bits == 0)
+        return 0;
+    dregion = (mpu_bits >> 8) & 0xFF;
+    mpu_n_map = 1;
+    if (dregion > MPU_REGION_MAP_X)
+        mpu_n_map += dregion - MPU_REGION_MAP_X;
+    if (mpu_n_map > MPU_MAP_MAX)
+        mpu_n_map = MPU_MAP_MAX;
+    return 1;
+}
+
+/* Number of areas a task can map through the MPU at the same time */
+int mpu_map_regions(void)
+{
+    return mpu_n_map;
+}
+
+static int mpu_map_region(int i)
+{
+    if (i == 0)
+        return MPU_REGION_MAP;
+    return MPU_REGION_MAP_X + i - 1;
 }
 
 int mpu_enable(void)
 {
     if (!mpu_bits)
         return -1;
-    MPU_CTRL = MPU_CTRL_ENABLE; //| MPU_CTRL_PRIVDEFENA;
+    MPU_CTRL = MPU_CTRL_ENABLE | MPU_CTRL_PRIVDEFENA;
     return 0;
 }
 
@@ -140,6 +170,7 @@ void mpu_setaddr(int region, uint32_t addr)
 
 void mpu_init(void)
 {
+    int i;
     if (!mpu_present())
         return;
 
@@ -162,8 +193,14 @@ void mpu_init(void)
 
     mpu_setaddr(5, DEV_START);      /* Peripherals              0x40000000 (512MB)*/
     mpu_setattr(5, MPUSIZE_1G | MPU_RASR_ENABLE | MPU_RASR_ATTR_S | MPU_RASR_ATTR_B | MPU_RASR_ATTR_AP_PRW_UNO);
-    mpu_setaddr(6, EXTDEV_START);   /* External Peripherals     0xA0000000 (1GB)   */
-    mpu_setattr(6, MPUSIZE_1G | MPU_RASR_ENABLE | MPU_RASR_ATTR_S | MPU_RASR_ATTR_B | MPU_RASR_ATTR_AP_PRW_UNO);
+
+    /* Priority 6 (and 8 on, if any) reserved for memory mapped by the task. External
+     * peripherals (0xA0000000) are reached through the default
+     * memory map (PRIVDEFENA), and are not accessible from user mode.
+     */
+    for (i = 0; i < mpu_n_map; i++)
+        mpu_setattr(mpu_map_region(i), 0);
+
     mpu_setaddr(7, REG_START);      /* System Level             0xE0000000 (256MB) */
     mpu_setattr(7, MPUSIZE_256M | MPU_RASR_ENABLE | MPU_RASR_ATTR_S | MPU_RASR_ATTR_B | MPU_RASR_ATTR_AP_PRW_UNO);
 
@@ -171,10 +208,63 @@ void mpu_init(void)
     mpu_enable();
 }
 
-void mpu_task_on(void *stack)
+void mpu_task_on(void *stack, const struct mpu_map *map)
 {
+    int i;
     mpu_disable();
     mpu_setaddr(4, (int)(stack + 20));
     mpu_setattr(4, mpu_size(CONFIG_TASK_STACK_SIZE) | MPU_RASR_ENABLE | MPU_RASR_ATTR_SCB | MPU_RASR_ATTR_AP_PRW_URW);
+    for (i = 0; i < mpu_n_map; i++) {
+        mpu_setaddr(mpu_map_region(i), map[i].base);
+        mpu_setattr(mpu_map_region(i), map[i].attr);
+    }
     mpu_enable();
 }
+
+/* Returns 1 if the static regions already grant user access to
+ * [base, base + size) (read-only, unless 'writable').
+ */
+int mpu_user_access(uint32_t base, uint32_t size, int writable)
+{
+    uint32_t end = base + size;
+    if (!mpu_bits)
+        return 1;
+    if (end < base)
+        return 0;
+
+    /* Kernel memory */
+    if ((base < (RAM_START + (CONFIG_KRAM_SIZE << 10))) && (end > RAM_START))
+        return 0;
+
+    /* Internal flash is read-only */
+    if (end <= (FLASH_START + FLASH_SIZE))
+        return !writable;
+    if (base < (FLASH_START + FLASH_SIZE))
+        return 0;
+
+    if (end <= USER_SIZE)
+        return 1;
+    if ((base >= EXTRAM_START) && (end <= (EXTRAM_START + EXTRAM_SIZE)))
+        return 1;
+    return 0;
+}
+
+/* Computes the attributes of the region granting user access to
+ * [base, base + size). A single region can only describe a block
+ * whose size is a power of two (32B min.) and whose base is aligned
+ * to its size. Returns 0 if the area does not fit.
+ */
+uint32_t mpu_map_attr(uint32_t base, uint32_t size, int writable)
+{
+    int bits = 5;
+    if (!mpu_bits)
+        return 0;
+    while (bits < 32 && ((1u << bits) < size))
+        bits++;
+    if ((bits == 32) || ((1u << bits) != size))
+        return 0;
+    if (base & (size - 1))
+        return 0;
+    return ((bits - 1) << 1) | MPU_RASR_ENABLE | MPU_RASR_ATTR_SCB |
+        (writable ? MPU_RASR_ATTR_AP_PRW_URW : MPU_RASR_ATTR_AP_PRO_URO);
+}
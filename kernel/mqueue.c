@@ -0,0 +1,543 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+#include "poll.h"
+#include <stddef.h>
+
+/* POSIX message queues.
+ *
+ * Queues are named in /dev/mqueue, and stay there until unlinked. Each
+ * mq_open() gets its own descriptor node (like a socket), so O_NONBLOCK
+ * is per open.
+ *
+ * All the message slots are allocated at mq_open(O_CREAT) time. Queued
+ * messages are kept in a binary heap of slot numbers, ordered by
+ * priority and then by arrival: send and receive are O(log n).
+ *
+ * Blocked senders and receivers wait in arrival order, each with its
+ * own deadline. A send wakes up one receiver, a receive one sender: the
+ * task woken up tries again.
+ */
+
+#define MQ_MAXMSG_DEFAULT   8
+#define MQ_MSGSIZE_DEFAULT  64
+#define MQ_MAXMSG_MAX       64
+#define MQ_MSGSIZE_MAX      1024
+
+struct mq_slot {
+    uint32_t prio;
+    uint32_t seq;
+    uint16_t len;
+};
+
+struct mqueue;
+
+struct mq_desc {
+    struct fnode *fno;
+    struct mqueue *mq;
+    struct mq_desc *next;
+};
+
+struct mqueue {
+    struct fnode *name;             /* In /dev/mqueue, until unlinked */
+    struct mq_desc *descs;          /* Open descriptors */
+    uint16_t maxmsg;
+    uint16_t msgsize;
+    uint16_t curmsgs;
+    uint8_t *data;                  /* maxmsg * msgsize */
+    struct mq_slot *slots;
+    uint8_t *heap;                  /* Queued slots, highest priority first */
+    uint8_t *free;                  /* Stack of free slots */
+    uint16_t n_free;
+    uint32_t seq;
+    struct waitq rq;                /* Blocked in mq_receive() */
+    struct waitq wq;                /* Blocked in mq_send() */
+    int pid_r;                      /* poll(): to wake up on send */
+    int pid_w;                      /* poll(): to wake up on receive */
+    int notify_pid;
+    int notify_sig;
+};
+
+static struct module mod_mqueue;
+static struct fnode *mq_dir;
+
+static void mq_free(struct mqueue *mq)
+{
+    kfree(mq->data);
+    kfree(mq->slots);
+    kfree(mq->heap);
+    kfree(mq->free);
+    kfree(mq);
+}
+
+/* The task woken up terminated before trying again: wake up the next */
+static void mq_abandon_recv(struct waitq *q)
+{
+    struct mqueue *mq = (struct mqueue *)((uint8_t *)q - offsetof(struct mqueue, rq));
+    if (mq->curmsgs > 0)
+        waitq_wake_one(&mq->rq);
+}
+
+static void mq_abandon_send(struct waitq *q)
+{
+    struct mqueue *mq = (struct mqueue *)((uint8_t *)q - offsetof(struct mqueue, wq));
+    if (mq->n_free > 0)
+        waitq_wake_one(&mq->wq);
+}
+
+static struct mqueue *mq_new(int maxmsg, int msgsize)
+{
+    struct mqueue *mq;
+    int i;
+
+    mq = kcalloc(sizeof(struct mqueue), 1);
+    if (!mq)
+        return NULL;
+    mq->maxmsg = maxmsg;
+    mq->msgsize = msgsize;
+    mq->rq.abandon = mq_abandon_recv;
+    mq->wq.abandon = mq_abandon_send;
+    mq->data = kalloc(maxmsg * msgsize);
+    mq->slots = kalloc(maxmsg * sizeof(struct mq_slot));
+    mq->heap = kalloc(maxmsg);
+    mq->free = kalloc(maxmsg);
+    if (!mq->data || !mq->slots || !mq->heap || !mq->free) {
+        mq_free(mq);
+        return NULL;
+    }
+    for (i = 0; i < maxmsg; i++)
+        mq->free[i] = i;
+    mq->n_free = maxmsg;
+    return mq;
+}
+
+/* Slot a goes before slot b */
+static int mq_before(struct mqueue *mq, uint8_t a, uint8_t b)
+{
+    if (mq->slots[a].prio != mq->slots[b].prio)
+        return mq->slots[a].prio > mq->slots[b].prio;
+    return (int32_t)(mq->slots[a].seq - mq->slots[b].seq) < 0;
+}
+
+static void mq_heap_push(struct mqueue *mq, uint8_t slot)
+{
+    int i = mq->curmsgs++;
+    int parent;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!mq_before(mq, slot, mq->heap[parent]))
+            break;
+        mq->heap[i] = mq->heap[parent];
+        i = parent;
+    }
+    mq->heap[i] = slot;
+}
+
+static uint8_t mq_heap_pop(struct mqueue *mq)
+{
+    uint8_t top = mq->heap[0];
+    uint8_t last = mq->heap[--mq->curmsgs];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < mq->curmsgs) {
+        if ((child + 1 < mq->curmsgs) && mq_before(mq, mq->heap[child + 1], mq->heap[child]))
+            child++;
+        if (!mq_before(mq, mq->heap[child], last))
+            break;
+        mq->heap[i] = mq->heap[child];
+        i = child;
+    }
+    mq->heap[i] = last;
+    return top;
+}
+
+static void mq_notify_all(struct mqueue *mq, uint16_t events)
+{
+    struct mq_desc *d;
+    for (d = mq->descs; d; d = d->next)
+        epoll_notify(d->fno, events);
+}
+
+static struct mq_desc *mq_get(int fd, uint32_t *flags)
+{
+    struct file *f = task_file_get(fd);
+    if (!f || (f->fno->owner != &mod_mqueue) || !f->fno->priv)
+        return NULL;
+    if (flags)
+        *flags = f->flags;
+    return (struct mq_desc *)f->fno->priv;
+}
+
+static int mq_poll(struct fnode *f, uint16_t events, uint16_t *revents)
+{
+    struct mq_desc *d = (struct mq_desc *)f->priv;
+    struct mqueue *mq;
+    *revents = 0;
+    if (!d)
+        return -EINVAL;
+    mq = d->mq;
+    if ((events & POLLIN) && (mq->curmsgs > 0))
+        *revents |= POLLIN;
+    if ((events & POLLOUT) && (mq->curmsgs < mq->maxmsg))
+        *revents |= POLLOUT;
+    if (*revents)
+        return 1;
+    if (events & POLLIN)
+        mq->pid_r = scheduler_get_cur_pid();
+    if (events & POLLOUT)
+        mq->pid_w = scheduler_get_cur_pid();
+    return 0;
+}
+
+static int mq_close(struct fnode *f)
+{
+    struct mq_desc *d = (struct mq_desc *)f->priv;
+    struct mq_desc **pp;
+    struct mqueue *mq;
+    if (!d)
+        return -EINVAL;
+    if (f->usage > 0)
+        return 0;
+    mq = d->mq;
+    for (pp = &mq->descs; *pp; pp = &(*pp)->next) {
+        if (*pp == d) {
+            *pp = d->next;
+            break;
+        }
+    }
+    if (mq->notify_pid == scheduler_get_cur_pid())
+        mq->notify_pid = 0;
+    if (!mq->descs && !mq->name)
+        mq_free(mq);
+    kfree(d);
+    kfree(f);
+    return 0;
+}
+
+/* The name was removed: the queue goes away with the last descriptor */
+static int mq_unlink(struct fnode *fno)
+{
+    struct mqueue *mq = (struct mqueue *)fno->priv;
+    if (!mq)
+        return 0;
+    mq->name = NULL;
+    fno->priv = NULL;
+    if (!mq->descs)
+        mq_free(mq);
+    return 0;
+}
+
+/* Descriptors are not part of the tree: freed by mq_close() */
+static int mq_desc_add(struct mqueue *mq, uint32_t oflag)
+{
+    struct mq_desc *d;
+    int fd;
+
+    d = kcalloc(sizeof(struct mq_desc), 1);
+    if (!d)
+        return -ENOMEM;
+    d->fno = kcalloc(sizeof(struct fnode), 1);
+    if (!d->fno) {
+        kfree(d);
+        return -ENOMEM;
+    }
+    d->fno->owner = &mod_mqueue;
+    d->fno->flags = FL_RDWR | (oflag & O_NONBLOCK);
+    d->fno->priv = d;
+    d->mq = mq;
+
+    fd = task_filedesc_add(d->fno);
+    if (fd < 0) {
+        kfree(d->fno);
+        kfree(d);
+        return fd;
+    }
+    task_fd_setmask(fd, oflag & O_ACCMODE);
+    d->next = mq->descs;
+    mq->descs = d;
+    return fd;
+}
+
+static struct fnode *mq_lookup(const char *name)
+{
+    struct fnode *fno;
+    for (fno = mq_dir->children; fno; fno = fno->next) {
+        if ((fno->owner == &mod_mqueue) && fno->priv && (strcmp(fno->fname, name) == 0))
+            return fno;
+    }
+    return NULL;
+}
+
+/* Names are "/something", with no other slashes */
+static const char *mq_name(const char *name)
+{
+    const char *p;
+    if (name[0] == '/')
+        name++;
+    if ((name[0] == '\0') || (strlen(name) >= MAX_FILE))
+        return NULL;
+    for (p = name; *p; p++) {
+        if (*p == '/')
+            return NULL;
+    }
+    return name;
+}
+
+/* open("/dev/mqueue/name") works like mq_open() without O_CREAT */
+static int mq_open_name(const char *path, int flags)
+{
+    struct fnode *fno = fno_search(path);
+    if (!fno || (fno->owner != &mod_mqueue) || !fno->priv)
+        return -ENOENT;
+    return mq_desc_add((struct mqueue *)fno->priv, flags);
+}
+
+/* mq_open(name, oflag, mode, attr) */
+int sys_mq_open_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    const char *name = (const char *)arg1;
+    uint32_t oflag = arg2;
+    struct mq_attr *attr = (struct mq_attr *)arg4;
+    struct fnode *fno;
+    struct mqueue *mq;
+    int maxmsg = MQ_MAXMSG_DEFAULT, msgsize = MQ_MSGSIZE_DEFAULT;
+    int fd;
+
+    if (!name || !mq_dir)
+        return -EINVAL;
+    name = mq_name(name);
+    if (!name)
+        return -EINVAL;
+
+    fno = mq_lookup(name);
+    if (fno) {
+        if ((oflag & O_CREAT) && (oflag & O_EXCL))
+            return -EEXIST;
+        return mq_desc_add((struct mqueue *)fno->priv, oflag);
+    }
+
+    if (!(oflag & O_CREAT))
+        return -ENOENT;
+    if (attr) {
+        if ((attr->mq_maxmsg <= 0) || (attr->mq_maxmsg > MQ_MAXMSG_MAX) ||
+                (attr->mq_msgsize <= 0) || (attr->mq_msgsize > MQ_MSGSIZE_MAX))
+            return -EINVAL;
+        maxmsg = attr->mq_maxmsg;
+        msgsize = attr->mq_msgsize;
+    }
+    mq = mq_new(maxmsg, msgsize);
+    if (!mq)
+        return -ENOMEM;
+    fno = fno_create(&mod_mqueue, name, mq_dir);
+    if (!fno) {
+        mq_free(mq);
+        return -ENOMEM;
+    }
+    fno->priv = mq;
+    mq->name = fno;
+    fd = mq_desc_add(mq, oflag);
+    if (fd < 0)
+        fno_unlink(fno);
+    return fd;
+}
+
+int sys_mq_unlink_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    const char *name = (const char *)arg1;
+    struct fnode *fno;
+
+    if (!name || !mq_dir)
+        return -EINVAL;
+    name = mq_name(name);
+    if (!name)
+        return -EINVAL;
+    fno = mq_lookup(name);
+    if (!fno)
+        return -ENOENT;
+    fno_unlink(fno);
+    return 0;
+}
+
+/* mq_send(fd, msg, len, prio) */
+int sys_mq_send_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    uint32_t flags;
+    struct mq_desc *d = mq_get(arg1, &flags);
+    const void *msg = (const void *)arg2;
+    uint32_t len = arg3;
+    uint32_t prio = arg4;
+    struct mqueue *mq;
+    uint8_t slot;
+
+    if (!d || ((flags & O_ACCMODE) == O_RDONLY))
+        return -EBADF;
+    mq = d->mq;
+    if (len > mq->msgsize)
+        return -EMSGSIZE;
+    if (prio >= MQ_PRIO_MAX)
+        return -EINVAL;
+
+    /* Restarted, but not woken up yet */
+    if (waitq_check(&mq->wq) == WQ_WAITING)
+        return waitq_sleep(&mq->wq);
+
+    if (mq->n_free == 0) {
+        if (!FNO_BLOCKING(d->fno))
+            return -EAGAIN;
+        waitq_add(&mq->wq, -1);
+        return waitq_sleep(&mq->wq);
+    }
+
+    slot = mq->free[--mq->n_free];
+    memcpy(mq->data + slot * mq->msgsize, msg, len);
+    mq->slots[slot].prio = prio;
+    mq->slots[slot].seq = mq->seq++;
+    mq->slots[slot].len = len;
+    mq_heap_push(mq, slot);
+
+    if (mq->pid_r > 0) {
+        task_resume(mq->pid_r);
+        mq->pid_r = 0;
+    }
+    if ((waitq_wake_one(&mq->rq) == 0) && (mq->curmsgs == 1) && (mq->notify_pid > 0)) {
+        /* First message, and nobody waiting: one-shot notification */
+        task_kill(mq->notify_pid, mq->notify_sig);
+        mq->notify_pid = 0;
+    }
+    mq_notify_all(mq, POLLIN);
+    return 0;
+}
+
+static int mq_receive(int fd, void *msg, uint32_t len, uint32_t *prio, int timeout)
+{
+    uint32_t flags;
+    struct mq_desc *d = mq_get(fd, &flags);
+    struct mqueue *mq;
+    uint8_t slot;
+    int ret;
+
+    if (!d || ((flags & O_ACCMODE) == O_WRONLY))
+        return -EBADF;
+    mq = d->mq;
+    if (len < mq->msgsize)
+        return -EMSGSIZE;
+
+    switch (waitq_check(&mq->rq)) {
+        case WQ_WAITING:
+            /* Restarted, but not woken up yet */
+            return waitq_sleep(&mq->rq);
+        case WQ_TIMEDOUT:
+            if (mq->curmsgs == 0)
+                return -ETIMEDOUT;
+            break;
+    }
+
+    if (mq->curmsgs == 0) {
+        if (!FNO_BLOCKING(d->fno))
+            return -EAGAIN;
+        if (timeout == 0)
+            return -ETIMEDOUT;
+        waitq_add(&mq->rq, timeout);
+        return waitq_sleep(&mq->rq);
+    }
+
+    slot = mq_heap_pop(mq);
+    ret = mq->slots[slot].len;
+    memcpy(msg, mq->data + slot * mq->msgsize, ret);
+    if (prio)
+        *prio = mq->slots[slot].prio;
+    mq->free[mq->n_free++] = slot;
+
+    if (mq->pid_w > 0) {
+        task_resume(mq->pid_w);
+        mq->pid_w = 0;
+    }
+    waitq_wake_one(&mq->wq);
+    mq_notify_all(mq, POLLOUT);
+    return ret;
+}
+
+/* mq_receive(fd, msg, len, prio) */
+int sys_mq_receive_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    return mq_receive(arg1, (void *)arg2, arg3, (uint32_t *)arg4, -1);
+}
+
+/* mq_timedreceive(fd, msg, len, prio, timeout): the timeout is relative,
+ * in milliseconds; a negative value waits forever. */
+int sys_mq_timedreceive_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    return mq_receive(arg1, (void *)arg2, arg3, (uint32_t *)arg4, (int)arg5);
+}
+
+/* mq_notify(fd, signo): the C library passes sigev_signo, or 0 to
+ * remove the registration. */
+int sys_mq_notify_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct mq_desc *d = mq_get(arg1, NULL);
+    int sig = (int)arg2;
+    int pid = scheduler_get_cur_pid();
+    struct mqueue *mq;
+
+    if (!d)
+        return -EBADF;
+    mq = d->mq;
+    if (sig == 0) {
+        if (mq->notify_pid == pid)
+            mq->notify_pid = 0;
+        return 0;
+    }
+    if ((mq->notify_pid > 0) && (mq->notify_pid != pid))
+        return -EBUSY;
+    mq->notify_pid = pid;
+    mq->notify_sig = sig;
+    return 0;
+}
+
+/* mq_getattr(fd, attr) */
+int sys_mq_getattr_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct mq_desc *d = mq_get(arg1, NULL);
+    struct mq_attr *attr = (struct mq_attr *)arg2;
+
+    if (!d)
+        return -EBADF;
+    if (!attr)
+        return -EINVAL;
+    attr->mq_flags = d->fno->flags & O_NONBLOCK;
+    attr->mq_maxmsg = d->mq->maxmsg;
+    attr->mq_msgsize = d->mq->msgsize;
+    attr->mq_curmsgs = d->mq->curmsgs;
+    return 0;
+}
+
+void mqueue_init(void)
+{
+    mod_mqueue.family = FAMILY_FILE;
+    strcpy(mod_mqueue.name, "mqueue");
+    mod_mqueue.ops.open = mq_open_name;
+    mod_mqueue.ops.poll = mq_poll;
+    mod_mqueue.ops.close = mq_close;
+    mod_mqueue.ops.unlink = mq_unlink;
+    register_module(&mod_mqueue);
+    mq_dir = fno_mkdir(NULL, "mqueue", fno_search("/dev"));
+}
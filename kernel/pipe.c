@@ -24,7 +24,23 @@
 #include "sys/termios.h"
 #include "poll.h"
 
-#define PIPE_BUFSIZE 64
+/* Pipes move data in bulk (at most two copies per transfer, around the
+ * end of the ring). To keep the number of context switches low:
+ *  - a writer wakes the reader up once per call, after filling the pipe
+ *    as much as it can (or when its data is all in);
+ *  - a reader wakes a blocked writer up only when at least half of the
+ *    pipe is free, so that the writer can refill it in one go.
+ * The capacity can be changed with fcntl(F_SETPIPE_SZ), and is rounded
+ * up to a power of two.
+ */
+
+#ifndef CONFIG_PIPE_BUFSIZE
+#   define CONFIG_PIPE_BUFSIZE 512
+#endif
+
+#define PIPE_BUFSIZE  CONFIG_PIPE_BUFSIZE
+#define PIPE_MIN_SIZE 16
+#define PIPE_MAX_SIZE 4096
 
 static struct module mod_pipe;
 
@@ -141,30 +157,122 @@ static int pipe_close(struct fnode *f)
         return -EINVAL;
 
 
-    if ((f == pp->fno_r) && (f->usage == 1)) {
+    if ((f == pp->fno_r) && (f->usage == 0)) {
         pp->fno_r = NULL;
         fno_unlink(f);
+        epoll_notify(pp->fno_w, POLLHUP);
         if ((pp->pid_w != pid) && (pp->pid_w > 0)) {
             task_resume(pp->pid_w);
         }
     }
-    if ((f == pp->fno_w) && (f->usage == 1)) {
+    if ((f == pp->fno_w) && (f->usage == 0)) {
         pp->fno_w = NULL;
         fno_unlink(f);
+        epoll_notify(pp->fno_r, POLLHUP);
         if ((pp->pid_r != pid) && (pp->pid_r > 0)) {
             task_resume(pp->pid_r);
         }
     }
-    if ((!pp->fno_w) && (!pp->fno_r))
+    if ((!pp->fno_w) && (!pp->fno_r)) {
+        cirbuf_destroy(pp->cb);
         kfree(pp);
+    }
     return 0;
 }
 
+/* Data was written */
+static void pipe_wake_reader(struct pipe_priv *pp)
+{
+    if (pp->pid_r > 0)
+        task_resume(pp->pid_r);
+    epoll_notify(pp->fno_r, POLLIN);
+}
+
+/* Data was read */
+static void pipe_wake_writer(struct pipe_priv *pp)
+{
+    if ((pp->pid_w > 0) && (cirbuf_bytesfree(pp->cb) >= (cirbuf_capacity(pp->cb) / 2)))
+        task_resume(pp->pid_w);
+    epoll_notify(pp->fno_w, POLLOUT);
+}
+
 static int pipe_read(struct fnode *f, void *buf, unsigned int len)
 {
     struct pipe_priv *pp;
-    int out, len_available;
-    uint8_t *ptr = buf;
+    int out;
+
+    if (f->owner != &mod_pipe)
+        return -EINVAL;
+
+    pp = (struct pipe_priv *)f->priv;
+    if (!pp)
+        return -EINVAL;
+
+    if (pp->fno_r != f)
+        return -EPERM;
+
+    if (len == 0)
+        return 0;
+
+    if (cirbuf_bytesinuse(pp->cb) <= 0) {
+        /* End of file */
+        if (!pp->fno_w)
+            return 0;
+        pp->pid_r = scheduler_get_cur_pid();
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    out = cirbuf_readbytes(pp->cb, buf, len);
+    pp->pid_r = 0;
+    if (out > 0)
+        pipe_wake_writer(pp);
+    return out;
+}
+
+static int pipe_write(struct fnode *f, const void *buf, unsigned int len)
+{
+    struct pipe_priv *pp;
+    int out, w;
+
+    if (f->owner != &mod_pipe)
+        return -EINVAL;
+
+    pp = (struct pipe_priv *)f->priv;
+    if (!pp)
+        return -EINVAL;
+
+    if (pp->fno_w != f)
+        return -EPERM;
+
+    if (!pp->fno_r) {
+        pp->w_off = 0;
+        pp->pid_w = 0;
+        return -EPIPE;
+    }
+
+    out = pp->w_off;
+    w = cirbuf_writebytes(pp->cb, (uint8_t *)buf + out, len - out);
+    out += w;
+    if (w > 0)
+        pipe_wake_reader(pp);
+
+    if (out < len) {
+        pp->pid_w = scheduler_get_cur_pid();
+        pp->w_off = out;
+        task_suspend();
+        return SYS_CALL_AGAIN;
+    }
+
+    pp->w_off = 0;
+    pp->pid_w = 0;
+    return out;
+}
+
+static int pipe_readv(struct fnode *f, const struct iovec *iov, int iovcnt)
+{
+    struct pipe_priv *pp;
+    int i, r, out = 0;
 
     if (f->owner != &mod_pipe)
         return -EINVAL;
@@ -176,28 +284,37 @@ static int pipe_read(struct fnode *f, void *buf, unsigned int len)
     if (pp->fno_r != f)
         return -EPERM;
 
-    len_available =  cirbuf_bytesinuse(pp->cb);
-    if (len_available <= 0) {
+    if (cirbuf_bytesinuse(pp->cb) <= 0) {
+        if (!pp->fno_w)
+            return 0;
         pp->pid_r = scheduler_get_cur_pid();
         task_suspend();
         return SYS_CALL_AGAIN;
     }
 
-    for(out = 0; out < len; out++) {
-        /* read data */
-        if (cirbuf_readbyte(pp->cb, ptr) != 0)
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        r = cirbuf_readbytes(pp->cb, iov[i].iov_base, iov[i].iov_len);
+        if (r <= 0)
+            break;
+        out += r;
+        if (r < iov[i].iov_len)
             break;
-        ptr++;
     }
     pp->pid_r = 0;
+    if (out > 0)
+        pipe_wake_writer(pp);
     return out;
 }
 
-static int pipe_write(struct fnode *f, const void *buf, unsigned int len)
+/* Same restart protocol as pipe_write(): w_off counts the bytes of the
+ * whole vector already transferred. */
+static int pipe_writev(struct fnode *f, const struct iovec *iov, int iovcnt)
 {
     struct pipe_priv *pp;
-    int out, len_available;
-    const uint8_t *ptr = buf;
+    int i, w, skip;
+    int pos = 0, out, tot = 0;
 
     if (f->owner != &mod_pipe)
         return -EINVAL;
@@ -209,18 +326,32 @@ static int pipe_write(struct fnode *f, const void *buf, unsigned int len)
     if (pp->fno_w != f)
         return -EPERM;
 
+    if (!pp->fno_r) {
+        pp->w_off = 0;
+        pp->pid_w = 0;
+        return -EPIPE;
+    }
+
     out = pp->w_off;
+    for (i = 0; i < iovcnt; i++)
+        tot += iov[i].iov_len;
 
-    len_available =  cirbuf_bytesfree(pp->cb);
-    if (len_available > (len - out))
-        len_available = (len - out);
-    for(; out < len_available; out++) {
-        /* write data */
-        if (cirbuf_writebyte(pp->cb, *(ptr + out)) != 0)
+    for (i = 0; (i < iovcnt) && (out < tot); i++) {
+        if (out >= pos + iov[i].iov_len) {
+            pos += iov[i].iov_len;
+            continue;
+        }
+        skip = out - pos;
+        w = cirbuf_writebytes(pp->cb, (uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        out += w;
+        if (w < (iov[i].iov_len - skip))
             break;
+        pos += iov[i].iov_len;
     }
+    if (out > pp->w_off)
+        pipe_wake_reader(pp);
 
-    if (out < len) {
+    if (out < tot) {
         pp->pid_w = scheduler_get_cur_pid();
         pp->w_off = out;
         task_suspend();
@@ -232,6 +363,38 @@ static int pipe_write(struct fnode *f, const void *buf, unsigned int len)
     return out;
 }
 
+static int pipe_fcntl(struct fnode *f, int cmd, uint32_t arg)
+{
+    struct pipe_priv *pp;
+    int size = (int)arg;
+
+    if (f->owner != &mod_pipe)
+        return -EINVAL;
+
+    pp = (struct pipe_priv *)f->priv;
+    if (!pp)
+        return -EINVAL;
+
+    switch (cmd) {
+        case F_GETPIPE_SZ:
+            return cirbuf_capacity(pp->cb);
+        case F_SETPIPE_SZ:
+            if (size < PIPE_MIN_SIZE)
+                size = PIPE_MIN_SIZE;
+            if (size > PIPE_MAX_SIZE)
+                return -EPERM;
+            if (cirbuf_bytesinuse(pp->cb) > size)
+                return -EBUSY;
+            if (cirbuf_resize(pp->cb, size) < 0)
+                return -ENOMEM;
+            if (pp->fno_w)
+                pipe_wake_writer(pp);
+            return cirbuf_capacity(pp->cb);
+        default:
+            return -EINVAL;
+    }
+}
+
 void sys_pipe_init(void)
 {
     mod_pipe.family = FAMILY_DEV;
@@ -240,6 +403,9 @@ void sys_pipe_init(void)
     mod_pipe.ops.close = pipe_close;
     mod_pipe.ops.read = pipe_read;
     mod_pipe.ops.write = pipe_write;
+    mod_pipe.ops.readv = pipe_readv;
+    mod_pipe.ops.writev = pipe_writev;
+    mod_pipe.ops.fcntl = pipe_fcntl;
 
 
     register_module(&mod_pipe);
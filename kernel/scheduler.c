@@ -114,7 +114,7 @@ int sys_register_handler(uint32_t n, int(*_sys_c)(uint32_t arg1, uint32_t arg2,
 
 #define MAX_TASKS 16
 #define BASE_TIMESLICE (20)
-#define TIMESLICE(x) ((BASE_TIMESLICE) + ((x)->tb.prio << 2))
+#define TIMESLICE(x) ((BASE_TIMESLICE) + ((x)->tb.eprio << 2))
 #define SCHEDULER_STACK_SIZE ((CONFIG_TASK_STACK_SIZE - sizeof(struct task_block)) - F_MALLOC_OVERHEAD)
 #define INIT_SCHEDULER_STACK_SIZE (256)
 
@@ -175,8 +175,7 @@ static void * _top_stack;
 
 
 struct filedesc {
-    struct fnode *fno;
-    uint32_t mask;
+    struct file *file;
 };
 
 
@@ -202,6 +201,15 @@ struct __attribute__((packed)) task_block {
     uint16_t ppid;
     uint16_t n_files;
 
+    uint16_t eprio;     /* Effective priority: prio, or higher (mutexes) */
+
+    /* Lock being waited for */
+    struct waitq *wq;
+    struct task *wq_next;
+    uint32_t wq_deadline;
+    uint8_t wq_state;
+    uint8_t wq_timed;
+
     int exitval;
     struct fnode *cwd;
     struct task_handler *sighdlr;
@@ -213,6 +221,11 @@ struct __attribute__((packed)) task_block {
     void *cur_stack;
     struct task *next;
     struct vfs_info *vfsi;
+
+    /* Areas mapped through the MPU (mmap) */
+    struct file *map_file[MPU_MAP_MAX];
+    uint32_t map_size[MPU_MAP_MAX];
+    struct mpu_map map[MPU_MAP_MAX];
 };
 
 struct __attribute__((packed)) task {
@@ -223,6 +236,12 @@ struct __attribute__((packed)) task {
 static struct task struct_task_kernel;
 static struct task *const kernel = (struct task *)(&struct_task_kernel);
 
+static inline void task_mpu_on(volatile struct task *t)
+{
+    mpu_task_on((void *)(((uint32_t)t->tb.cur_stack) - (sizeof(struct task_block) + F_MALLOC_OVERHEAD)),
+            (const struct mpu_map *)t->tb.map);
+}
+
 
 static int number_of_tasks = 0;
 
@@ -278,27 +297,41 @@ static struct task *tasklist_get(struct task **list, uint16_t pid)
 static struct task *tasks_running = NULL;
 static struct task *tasks_idling = NULL;
 
+/* Syscall handlers are preemptible: task lists can be modified by ISRs
+ * (via task_resume()), so every list transition is done with interrupts
+ * masked.
+ */
 static void idling_to_running(volatile struct task *t)
 {
+    uint32_t primask = irq_save();
     if (tasklist_del(&tasks_idling, t->tb.pid) == 0)
         tasklist_add(&tasks_running, t);
+    irq_restore(primask);
 }
 
 static void running_to_idling(volatile struct task *t)
 {
+    uint32_t primask;
     if (t->tb.pid < 1)
         return;
+    primask = irq_save();
     if (tasklist_del(&tasks_running, t->tb.pid) == 0)
         tasklist_add(&tasks_idling, t);
+    irq_restore(primask);
 }
 
 static int task_filedesc_del_from_task(volatile struct task *t, int fd);
+static void task_mmap_release(volatile struct task *t);
 static void task_destroy(struct task *t)
 {
     int i;
     for (i = 0; i < t->tb.n_files; i++) {
         task_filedesc_del_from_task(t, i);
     }
+    task_mmap_release(t);
+    aio_task_exit(t->tb.pid);
+    futex_task_exit(t->tb.pid);
+    mutex_task_exit(t->tb.pid);
     tasklist_del(&tasks_running, t->tb.pid);
     tasklist_del(&tasks_idling, t->tb.pid);
     kfree(t->tb.filedesc);
@@ -346,26 +379,67 @@ static int next_pid(void)
 /**/
 /**/
 /**/
-static int task_filedesc_add_to_task(volatile struct task *t, struct fnode *f)
+/* Open file descriptions are refcounted: the same struct file is shared
+ * by dup()'d descriptors and by descriptors inherited from the parent.
+ * The module close() operation is only called on the last reference.
+ */
+static struct file *file_get(struct file *f)
+{
+    f->refcount++;
+    return f;
+}
+
+static void file_put(struct file *f)
+{
+    struct fnode *fno = f->fno;
+    if (--f->refcount > 0)
+        return;
+    splice_xfer_free(f);
+    fno->usage--;
+    if ((fno->usage == 0) && fno->epitems)
+        epoll_forget(fno);
+    if (fno->owner && fno->owner->ops.close)
+        fno->owner->ops.close(fno);
+    kfree(f);
+}
+
+static int task_filedesc_attach(volatile struct task *t, struct file *f)
 {
     int i;
     void *re;
     if (!t || !f)
         return -EINVAL;
     for (i = 0; i < t->tb.n_files; i++) {
-        if (t->tb.filedesc[i].fno == NULL) {
-            t->tb.filedesc[i].fno = f;
-            f->usage++;
+        if (t->tb.filedesc[i].file == NULL) {
+            t->tb.filedesc[i].file = f;
             return i;
         }
     }
-    t->tb.n_files++;
-    re = (void *)krealloc(t->tb.filedesc, t->tb.n_files * sizeof(struct filedesc));
+    re = (void *)krealloc(t->tb.filedesc, (t->tb.n_files + 1) * sizeof(struct filedesc));
     if (!re)
-        return -1;
+        return -ENOMEM;
     t->tb.filedesc = re;
-    memset(&(t->tb.filedesc[t->tb.n_files - 1]), 0, sizeof(struct filedesc));
-    t->tb.filedesc[t->tb.n_files - 1].fno = f;
+    t->tb.n_files++;
+    t->tb.filedesc[t->tb.n_files - 1].file = f;
+    return t->tb.n_files - 1;
+}
+
+static int task_filedesc_add_to_task(volatile struct task *t, struct fnode *f)
+{
+    struct file *file;
+    int fd;
+    if (!t || !f)
+        return -EINVAL;
+    file = kcalloc(sizeof(struct file), 1);
+    if (!file)
+        return -ENOMEM;
+    file->fno = f;
+    file->refcount = 1;
+    fd = task_filedesc_attach(t, file);
+    if (fd < 0) {
+        kfree(file);
+        return fd;
+    }
     if (f->flags & FL_TTY) {
         struct module *mod = f->owner;
         if (mod && mod->ops.tty_attach) {
@@ -373,7 +447,7 @@ static int task_filedesc_add_to_task(volatile struct task *t, struct fnode *f)
         }
     }
     f->usage++;
-    return t->tb.n_files - 1;
+    return fd;
 }
 
 int task_filedesc_add(struct fnode *f)
@@ -381,23 +455,53 @@ int task_filedesc_add(struct fnode *f)
     return task_filedesc_add_to_task(_cur_task, f);
 }
 
+/* Inherit all the open files of the current task */
+static void task_filedesc_inherit(volatile struct task *t)
+{
+    int i;
+    if (_cur_task->tb.n_files == 0)
+        return;
+    t->tb.filedesc = kcalloc(sizeof(struct filedesc), _cur_task->tb.n_files);
+    if (!t->tb.filedesc)
+        return;
+    t->tb.n_files = _cur_task->tb.n_files;
+    for (i = 0; i < t->tb.n_files; i++) {
+        struct file *file = _cur_task->tb.filedesc[i].file;
+        if (!file)
+            continue;
+        t->tb.filedesc[i].file = file_get(file);
+        /* The child takes over the terminal */
+        if (file->fno->flags & FL_TTY) {
+            struct module *mod = file->fno->owner;
+            if (mod && mod->ops.tty_attach) {
+                mod->ops.tty_attach(file->fno, t->tb.pid);
+            }
+        }
+    }
+}
+
 static int task_filedesc_del_from_task(volatile struct task *t, int fd)
 {
+    struct file *file;
     struct fnode *fno;
     if (!t)
         return -EINVAL;
+    if ((fd < 0) || (fd >= t->tb.n_files))
+        return -EBADF;
 
-    fno = t->tb.filedesc[fd].fno;
-    if (!fno)
+    file = t->tb.filedesc[fd].file;
+    if (!file)
         return -ENOENT;
-    if ((fno->flags & FL_TTY) && ((t->tb.filedesc[fd].mask & O_NOCTTY) == 0)) {
+    fno = file->fno;
+    if ((fno->flags & FL_TTY) && ((file->flags & O_NOCTTY) == 0)) {
         struct module *mod = fno->owner;
         if (mod && mod->ops.tty_attach) {
             mod->ops.tty_attach(fno, t->tb.ppid);
         }
     }
-    fno->usage--;
-    t->tb.filedesc[fd].fno = NULL;
+    t->tb.filedesc[fd].file = NULL;
+    file_put(file);
+    return 0;
 }
 
 int task_filedesc_del(int fd)
@@ -405,42 +509,61 @@ int task_filedesc_del(int fd)
     return task_filedesc_del_from_task(_cur_task, fd);
 }
 
+struct file *task_file_get(int fd)
+{
+    volatile struct task *t = _cur_task;
+    if (!t)
+        return NULL;
+    if ((fd < 0) || (fd >= t->tb.n_files))
+        return NULL;
+    if (!t->tb.filedesc)
+        return NULL;
+    return t->tb.filedesc[fd].file;
+}
+
+/* Returns the descriptor referring to file f in the current task, or -1 */
+int task_file_fd(struct file *f)
+{
+    volatile struct task *t = _cur_task;
+    int i;
+    if (!f)
+        return -1;
+    for (i = 0; i < t->tb.n_files; i++) {
+        if (t->tb.filedesc[i].file == f)
+            return i;
+    }
+    return -1;
+}
+
 int task_fd_setmask(int fd, uint32_t mask)
 {
-    struct fnode *fno = _cur_task->tb.filedesc[fd].fno;
-    if (!fno)
+    struct file *file = task_file_get(fd);
+    if (!file)
         return -EINVAL;
 
     if ((mask & O_ACCMODE) != O_RDONLY) {
-        if ((fno->flags & FL_WRONLY)== 0)
+        if ((file->fno->flags & FL_WRONLY)== 0)
             return -EPERM;
     }
 
-    _cur_task->tb.filedesc[fd].mask = mask;
+    file->flags = mask;
     return 0;
 }
 
 uint32_t task_fd_getmask(int fd)
 {
-    if (_cur_task->tb.filedesc[fd].fno)
-        return _cur_task->tb.filedesc[fd].mask;
+    struct file *file = task_file_get(fd);
+    if (file)
+        return file->flags;
     return 0;
 }
 
 struct fnode *task_filedesc_get(int fd)
 {
-    volatile struct task *t = _cur_task;
-    if (fd < 0)
-        return NULL;
-    if (fd >= t->tb.n_files)
+    struct file *file = task_file_get(fd);
+    if (!file)
         return NULL;
-    if (!t)
-        return NULL;
-    if (!t->tb.filedesc || (( t->tb.n_files - 1) < fd))
-        return NULL;
-    if (t->tb.filedesc[fd].fno == NULL)
-        return NULL;
-    return t->tb.filedesc[fd].fno;
+    return file->fno;
 }
 
 int task_fd_readable(int fd)
@@ -452,28 +575,95 @@ int task_fd_readable(int fd)
 
 int task_fd_writable(int fd)
 {
-    if (!task_filedesc_get(fd))
+    struct file *file = task_file_get(fd);
+    if (!file)
         return 0;
-    if ((_cur_task->tb.filedesc[fd].mask & O_ACCMODE) == O_RDONLY)
+    if ((file->flags & O_ACCMODE) == O_RDONLY)
         return 0;
     return 1;
 }
 
+/* Grants the current task access to [base, base + size) through one of
+ * the MPU regions reserved for mappings, reprogrammed on every context
+ * switch. The file is kept referenced until the area is unmapped, or
+ * the task exits.
+ */
+int task_mmap_add(struct file *f, void *base, uint32_t size, uint32_t attr)
+{
+    volatile struct task *t = _cur_task;
+    uint32_t primask;
+    int i;
+    for (i = 0; i < mpu_map_regions(); i++) {
+        if (!t->tb.map_file[i])
+            break;
+    }
+    if (i >= mpu_map_regions())
+        return -ENOMEM;
+    primask = irq_save();
+    t->tb.map_file[i] = file_get(f);
+    t->tb.map_size[i] = size;
+    t->tb.map[i].base = (uint32_t)base;
+    t->tb.map[i].attr = attr;
+    task_mpu_on(t);
+    irq_restore(primask);
+    return 0;
+}
 
-int sys_dup_hdlr(int fd)
+static void task_mmap_release_one(volatile struct task *t, int i)
+{
+    struct file *f = t->tb.map_file[i];
+    uint32_t primask = irq_save();
+    t->tb.map_file[i] = NULL;
+    t->tb.map_size[i] = 0;
+    t->tb.map[i].base = 0;
+    t->tb.map[i].attr = 0;
+    if (t == _cur_task)
+        task_mpu_on(t);
+    irq_restore(primask);
+    if (f)
+        file_put(f);
+}
+
+static void task_mmap_release(volatile struct task *t)
+{
+    int i;
+    for (i = 0; i < MPU_MAP_MAX; i++) {
+        if (t->tb.map_file[i])
+            task_mmap_release_one(t, i);
+    }
+}
+
+int task_mmap_del(void *base, uint32_t size)
 {
     volatile struct task *t = _cur_task;
-    struct fnode *f = task_filedesc_get(fd);
-    int newfd = -1;
+    int i;
+    for (i = 0; i < MPU_MAP_MAX; i++) {
+        if (t->tb.map_file[i] && (t->tb.map[i].base == (uint32_t)base))
+            break;
+    }
+    if ((i >= MPU_MAP_MAX) || (size > t->tb.map_size[i]))
+        return -EINVAL;
+    task_mmap_release_one(t, i);
+    return 0;
+}
+
+
+int sys_dup_hdlr(int fd)
+{
+    struct file *f = task_file_get(fd);
+    int newfd;
     if (!f)
-        return -1;
-    return task_filedesc_add(f);
+        return -EBADF;
+    newfd = task_filedesc_attach(_cur_task, file_get(f));
+    if (newfd < 0)
+        file_put(f);
+    return newfd;
 }
 
 int sys_dup2_hdlr(int fd, int newfd)
 {
     volatile struct task *t = _cur_task;
-    struct fnode *f = task_filedesc_get(fd);
+    struct file *f = task_file_get(fd);
     if (newfd < 0)
         return -1;
     if (newfd == fd)
@@ -482,9 +672,9 @@ int sys_dup2_hdlr(int fd, int newfd)
         return -1;
     if (newfd >= t->tb.n_files)
         return -1;
-    if (t->tb.filedesc[newfd].fno != NULL)
+    if (t->tb.filedesc[newfd].file != NULL)
         task_filedesc_del(newfd);
-    t->tb.filedesc[newfd].fno = f;
+    t->tb.filedesc[newfd].file = file_get(f);
     return newfd;
 }
 
@@ -734,6 +924,21 @@ void task_chdir(struct fnode *f)
     _cur_task->tb.cwd = f;
 }
 
+/* Nonzero if f is the working directory of any task */
+int task_is_cwd(struct fnode *f)
+{
+    struct task *t;
+    for (t = tasks_running; t; t = t->tb.next) {
+        if (t->tb.cwd == f)
+            return 1;
+    }
+    for (t = tasks_idling; t; t = t->tb.next) {
+        if (t->tb.cwd == f)
+            return 1;
+    }
+    return 0;
+}
+
 static __inl int in_kernel(void)
 {
     return (_cur_task->tb.pid == 0);
@@ -753,15 +958,30 @@ static __inl void * psp_read(void)
     return ret;
 }
 
+/* Round robin among the runnable tasks with the highest effective
+ * priority. The kernel task always takes its turn, to run the tasklets.
+ */
 static __inl void task_switch(void)
 {
-    int i, pid = _cur_task->tb.pid;
     volatile struct task *t = _cur_task;
+    volatile struct task *first;
+    uint16_t top = 0;
 
     if (((t->tb.state != TASK_RUNNING) && (t->tb.state != TASK_RUNNABLE)) || (t->tb.next == NULL))
-        t = tasks_running;
+        first = tasks_running;
     else
+        first = t->tb.next;
+
+    for (t = tasks_running; t; t = t->tb.next) {
+        if ((t->tb.pid != 0) && (t->tb.eprio > top))
+            top = t->tb.eprio;
+    }
+    t = first;
+    while ((t->tb.pid != 0) && (t->tb.eprio < top)) {
         t = t->tb.next;
+        if (!t)
+            t = tasks_running;
+    }
     t->tb.timeslice = TIMESLICE(t);
     t->tb.state = TASK_RUNNING;
     _cur_task = t;
@@ -848,6 +1068,200 @@ void task_end(void)
     }
 }
 
+static struct task *task_get(int pid)
+{
+    struct task *t = tasklist_get(&tasks_running, pid);
+    if (!t)
+        t = tasklist_get(&tasks_idling, pid);
+    return t;
+}
+
+/* Effective priority of a task (0 if not found) */
+uint16_t task_get_prio(int pid)
+{
+    struct task *t;
+    uint16_t prio = 0;
+    uint32_t primask = irq_save();
+    t = task_get(pid);
+    if (t)
+        prio = t->tb.eprio;
+    irq_restore(primask);
+    return prio;
+}
+
+/* Sets the effective priority of a task, never below its own: e.g. to
+ * boost the owner of a mutex to the priority of the tasks waiting. */
+void task_set_prio(int pid, uint16_t prio)
+{
+    struct task *t;
+    uint32_t primask = irq_save();
+    t = task_get(pid);
+    if (t)
+        t->tb.eprio = (prio > t->tb.prio) ? prio : t->tb.prio;
+    irq_restore(primask);
+}
+
+/* Wait queues.
+ *
+ * Tasks are linked through their task block: a task waits for one lock
+ * at a time, and a queue needs no memory. Locks can be released from
+ * ISRs: queues are accessed with interrupts masked.
+ */
+
+static void waitq_unlink(struct waitq *q, volatile struct task *t)
+{
+    struct task *prev = NULL, *cur = q->head;
+    while (cur && (cur != t)) {
+        prev = cur;
+        cur = cur->tb.wq_next;
+    }
+    if (!cur)
+        return;
+    if (prev)
+        prev->tb.wq_next = cur->tb.wq_next;
+    else
+        q->head = cur->tb.wq_next;
+    if (q->tail == cur)
+        q->tail = prev;
+    cur->tb.wq_next = NULL;
+}
+
+static void waitq_timeout(uint32_t now, void *arg)
+{
+    task_resume((int)arg);
+}
+
+/* Queues the current task. 'timeout' in ms, negative: forever. */
+void waitq_add(struct waitq *q, int timeout)
+{
+    volatile struct task *t = _cur_task;
+    uint32_t primask = irq_save();
+    t->tb.wq = q;
+    t->tb.wq_state = WQ_WAITING;
+    t->tb.wq_timed = (timeout >= 0);
+    t->tb.wq_deadline = jiffies + timeout;
+    t->tb.wq_next = NULL;
+    if (q->tail)
+        q->tail->tb.wq_next = (struct task *)t;
+    else
+        q->head = (struct task *)t;
+    q->tail = (struct task *)t;
+    irq_restore(primask);
+}
+
+/* Suspends the current task, unless it was woken up in the meantime.
+ * Returns SYS_CALL_AGAIN: the syscall calls waitq_check() when
+ * restarted. */
+int waitq_sleep(struct waitq *q)
+{
+    volatile struct task *t = _cur_task;
+    int32_t left = (int32_t)(t->tb.wq_deadline - jiffies);
+    uint32_t primask;
+
+    /* A stale timer only causes an early restart */
+    if (t->tb.wq_timed && (left > 0))
+        ktimer_add(left, waitq_timeout, (void *)(uint32_t)t->tb.pid);
+    primask = irq_save();
+    if ((t->tb.wq == q) && (t->tb.wq_state == WQ_WAITING))
+        task_suspend();
+    irq_restore(primask);
+    return SYS_CALL_AGAIN;
+}
+
+/* State of the current task in q. WQ_WOKEN and WQ_TIMEDOUT are only
+ * reported once: the task leaves the queue. */
+int waitq_check(struct waitq *q)
+{
+    volatile struct task *t = _cur_task;
+    uint32_t primask;
+    int state;
+
+    if (t->tb.wq != q)
+        return WQ_NONE;
+    primask = irq_save();
+    state = t->tb.wq_state;
+    if ((state == WQ_WAITING) && t->tb.wq_timed &&
+            ((int32_t)(jiffies - t->tb.wq_deadline) >= 0)) {
+        waitq_unlink(q, t);
+        state = WQ_TIMEDOUT;
+    }
+    if (state != WQ_WAITING) {
+        t->tb.wq = NULL;
+        t->tb.wq_state = WQ_NONE;
+    }
+    irq_restore(primask);
+    return state;
+}
+
+/* Wakes up the first task in q. Returns its pid, or 0 if none. */
+int waitq_wake_one(struct waitq *q)
+{
+    struct task *t;
+    int pid = 0;
+    uint32_t primask = irq_save();
+    t = q->head;
+    if (t) {
+        q->head = t->tb.wq_next;
+        if (!q->head)
+            q->tail = NULL;
+        t->tb.wq_next = NULL;
+        t->tb.wq_state = WQ_WOKEN;
+        pid = t->tb.pid;
+        task_resume(pid);
+    }
+    irq_restore(primask);
+    return pid;
+}
+
+int waitq_has(struct waitq *q, int pid)
+{
+    struct task *t;
+    int ret = 0;
+    uint32_t primask = irq_save();
+    for (t = q->head; t; t = t->tb.wq_next) {
+        if (t->tb.pid == pid) {
+            ret = 1;
+            break;
+        }
+    }
+    irq_restore(primask);
+    return ret;
+}
+
+/* Highest effective priority among the tasks in q */
+uint16_t waitq_top_prio(struct waitq *q)
+{
+    struct task *t;
+    uint16_t top = 0;
+    uint32_t primask = irq_save();
+    for (t = q->head; t; t = t->tb.wq_next) {
+        if (t->tb.eprio > top)
+            top = t->tb.eprio;
+    }
+    irq_restore(primask);
+    return top;
+}
+
+/* The task is going away: leave the queue, or pass on the lock that
+ * was handed over to it */
+static void waitq_task_exit(volatile struct task *t)
+{
+    struct waitq *q = t->tb.wq;
+    uint32_t primask;
+    int state;
+    if (!q)
+        return;
+    primask = irq_save();
+    state = t->tb.wq_state;
+    if (state == WQ_WAITING)
+        waitq_unlink(q, t);
+    t->tb.wq = NULL;
+    t->tb.wq_state = WQ_NONE;
+    irq_restore(primask);
+    if ((state == WQ_WOKEN) && q->abandon)
+        q->abandon(q);
+}
+
 static void task_resume_vfork(int pid);
 
 static void *task_pass_args(void *_args)
@@ -936,19 +1350,23 @@ int task_create(struct vfs_info *vfsi, void *arg, unsigned int prio)
     new->tb.pid = next_pid();
     new->tb.ppid = scheduler_get_cur_pid();
     new->tb.prio = prio;
+    new->tb.eprio = prio;
+    new->tb.wq = NULL;
+    new->tb.wq_next = NULL;
+    new->tb.wq_state = WQ_NONE;
     new->tb.filedesc = NULL;
     new->tb.n_files = 0;
     new->tb.flags = 0;
+    memset((void *)new->tb.map_file, 0, sizeof(new->tb.map_file));
+    memset((void *)new->tb.map_size, 0, sizeof(new->tb.map_size));
+    memset((void *)new->tb.map, 0, sizeof(new->tb.map));
     new->tb.cwd = fno_search("/");
     new->tb.vfsi = vfsi;
 
     /* Inherit cwd, file descriptors from parent */
     if (new->tb.ppid > 1) { /* Start from parent #2 */
         new->tb.cwd = task_getcwd();
-        for (i = 0; i < _cur_task->tb.n_files; i++) {
-            task_filedesc_add_to_task(new, _cur_task->tb.filedesc[i].fno);
-            new->tb.filedesc[i].mask = _cur_task->tb.filedesc[i].mask;
-        }
+        task_filedesc_inherit(new);
     } 
 
     new->tb.next = NULL;
@@ -966,10 +1384,11 @@ int scheduler_exec(struct vfs_info *vfsi, void *args)
     volatile struct task *t = _cur_task;
     
     t->tb.vfsi = vfsi;
+    task_mmap_release(t);
     task_create_real(t, vfsi->init, (void *)args, t->tb.prio);
     asm volatile ("msr "PSP", %0" :: "r" (_cur_task->tb.sp));
     t->tb.state = TASK_RUNNING;
-    mpu_task_on((void *)(((uint32_t)t->tb.cur_stack) - (sizeof(struct task_block) + F_MALLOC_OVERHEAD) ));
+    task_mpu_on(t);
     return 0;
 }
 
@@ -991,17 +1410,21 @@ int sys_vfork_hdlr(void)
     new->tb.pid = vpid;
     new->tb.ppid = scheduler_get_cur_pid();
     new->tb.prio = _cur_task->tb.prio;
+    new->tb.eprio = _cur_task->tb.prio;
+    new->tb.wq = NULL;
+    new->tb.wq_next = NULL;
+    new->tb.wq_state = WQ_NONE;
     new->tb.filedesc = NULL;
     new->tb.n_files = 0;
     new->tb.flags = TASK_FLAG_VFORK;
+    memset((void *)new->tb.map_file, 0, sizeof(new->tb.map_file));
+    memset((void *)new->tb.map_size, 0, sizeof(new->tb.map_size));
+    memset((void *)new->tb.map, 0, sizeof(new->tb.map));
     new->tb.cwd = task_getcwd();
 
     /* Inherit cwd, file descriptors from parent */
     if (new->tb.ppid > 1) { /* Start from parent #2 */
-        for (i = 0; i < _cur_task->tb.n_files; i++) {
-            task_filedesc_add_to_task(new, _cur_task->tb.filedesc[i].fno);
-            new->tb.filedesc[i].mask = _cur_task->tb.filedesc[i].mask;
-        }
+        task_filedesc_inherit(new);
         /* Inherit signal mask */
         new->tb.sigmask = _cur_task->tb.sigmask;
     } 
@@ -1090,6 +1513,9 @@ void __naked  pend_sv_handler(void)
 
     /* save current SP to TCB */
 
+    /* PendSV has the lowest priority: keep ISRs away from the task lists
+     * while picking the next task. */
+    irq_off();
     _cur_task->tb.sp = _top_stack;
     if (_cur_task->tb.state == TASK_RUNNING)
         _cur_task->tb.state = TASK_RUNNABLE;
@@ -1097,6 +1523,7 @@ void __naked  pend_sv_handler(void)
     /* choose next task */
 //    if ((_cur_task->tb.flags & TASK_FLAG_SIGNALED) == 0)
         task_switch();
+    irq_on();
     
     /* if switching to a signaled task, adjust sp */
 //    if ((_cur_task->tb.flags & (TASK_FLAG_IN_SYSCALL | TASK_FLAG_SIGNALED)) == ((TASK_FLAG_SIGNALED))) {
@@ -1116,7 +1543,7 @@ void __naked  pend_sv_handler(void)
         restore_kernel_context();
         runnable = RUN_KERNEL;
     } else {
-        mpu_task_on((void *)(((uint32_t)_cur_task->tb.cur_stack) - (sizeof(struct task_block) + F_MALLOC_OVERHEAD) ));
+        task_mpu_on(_cur_task);
         asm volatile ("msr "PSP", %0" :: "r" (_cur_task->tb.sp));
         asm volatile ("isb");
         asm volatile ("msr CONTROL, %0" :: "r" (0x01));
@@ -1145,10 +1572,17 @@ void kernel_task_init(void)
     kernel->tb.pid = next_pid();
     kernel->tb.ppid = scheduler_get_cur_pid();
     kernel->tb.prio = 0;
+    kernel->tb.eprio = 0;
+    kernel->tb.wq = NULL;
+    kernel->tb.wq_next = NULL;
+    kernel->tb.wq_state = WQ_NONE;
     kernel->tb.start = NULL;
     kernel->tb.arg = NULL;
     kernel->tb.filedesc = NULL;
     kernel->tb.n_files = 0;
+    memset((void *)kernel->tb.map_file, 0, sizeof(kernel->tb.map_file));
+    memset((void *)kernel->tb.map_size, 0, sizeof(kernel->tb.map_size));
+    memset((void *)kernel->tb.map, 0, sizeof(kernel->tb.map));
     kernel->tb.timeslice = TIMESLICE(kernel);
     kernel->tb.state = TASK_RUNNABLE;
     kernel->tb.cwd = fno_search("/");
@@ -1165,13 +1599,16 @@ void kernel_task_init(void)
 
 static void task_suspend_to(int newstate)
 {
+    uint32_t primask;
     if (_cur_task->tb.pid < 1)
         return;
+    primask = irq_save();
     running_to_idling(_cur_task);
     if (_cur_task->tb.state == TASK_RUNNABLE || _cur_task->tb.state == TASK_RUNNING) {
         _cur_task->tb.timeslice = 0;
     }
     _cur_task->tb.state = newstate;
+    irq_restore(primask);
     schedule();
 }
 
@@ -1186,39 +1623,52 @@ void task_preempt(void) {
 
 void task_preempt_all(void)
 {
-    volatile struct task *t = tasks_running;
+    volatile struct task *t;
+    uint32_t primask;
     if (_cur_task->tb.pid == 0)
         return;
+    primask = irq_save();
+    t = tasks_running;
     while(t) {
         if (t->tb.pid != 0)
             t->tb.timeslice = 0;
         t = t->tb.next;
     }
+    irq_restore(primask);
     schedule();
 }
 
 
+/* Safe to call from ISRs */
 void task_resume(int pid)
 {
-    struct task *t = tasklist_get(&tasks_idling, pid);
+    struct task *t;
+    uint32_t primask = irq_save();
+    t = tasklist_get(&tasks_idling, pid);
     if ((t) && t->tb.state == TASK_WAITING) {
         idling_to_running(t);
         t->tb.state = TASK_RUNNABLE;
     }
+    irq_restore(primask);
 }
 
 static void task_resume_vfork(int pid)
 {
-    struct task *t = tasklist_get(&tasks_idling, pid);
+    struct task *t;
+    uint32_t primask = irq_save();
+    t = tasklist_get(&tasks_idling, pid);
     if ((t) && t->tb.state == TASK_FORKED) {
         idling_to_running(t);
         t->tb.state = TASK_RUNNABLE;
     }
+    irq_restore(primask);
 }
 
 void task_terminate(int pid)
 {
-    struct task *t = tasklist_get(&tasks_running, pid);
+    struct task *t;
+    uint32_t primask = irq_save();
+    t = tasklist_get(&tasks_running, pid);
     if (!t) 
         t = tasklist_get(&tasks_idling, pid);
     else
@@ -1227,6 +1677,11 @@ void task_terminate(int pid)
     if (t) {
         t->tb.state = TASK_ZOMBIE;
         t->tb.timeslice = 0;
+    }
+    irq_restore(primask);
+
+    if (t) {
+        waitq_task_exit(t);
 
         if (t->tb.ppid > 0) {
             if (t->tb.flags & TASK_FLAG_VFORK) {
@@ -1359,12 +1814,16 @@ int sys_setsid_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
 {
     int i;
     for (i = 0; i < _cur_task->tb.n_files; i++) {
-        struct fnode *fno = _cur_task->tb.filedesc[i].fno;
-        if ((fno->flags & FL_TTY) && ((_cur_task->tb.filedesc[i].mask & O_NOCTTY) == 0)) {
+        struct file *file = _cur_task->tb.filedesc[i].file;
+        struct fnode *fno;
+        if (!file)
+            continue;
+        fno = file->fno;
+        if ((fno->flags & FL_TTY) && ((file->flags & O_NOCTTY) == 0)) {
             struct module *mod = fno->owner;
             if (mod && mod->ops.tty_attach) {
                 mod->ops.tty_attach(fno, _cur_task->tb.ppid);
-                _cur_task->tb.filedesc[i].mask |= O_NOCTTY;
+                file->flags |= O_NOCTTY;
 
             }
         }
@@ -1374,11 +1833,12 @@ int sys_setsid_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
 int task_segfault(uint32_t address, uint32_t instruction, int flags)
 {
     char segv_msg[128] = "Memory fault: process (pid=";
+    struct fnode *err = task_filedesc_get(2);
     if (in_kernel())
         return -1;
     if (_cur_task->tb.state == TASK_ZOMBIE)
         return 0;
-    if ((_cur_task->tb.n_files > 2) &&  _cur_task->tb.filedesc[2].fno->owner->ops.write) {
+    if (err && err->owner && err->owner->ops.write) {
         strcat(segv_msg, pid_str(_cur_task->tb.pid));
         if (flags == MEMFAULT_ACCESS) {
             strcat(segv_msg, ") attempted access to memory at ");
@@ -1388,7 +1848,7 @@ int task_segfault(uint32_t address, uint32_t instruction, int flags)
             strcat(segv_msg, ") attempted double free");
         }
         strcat(segv_msg, ". Killed.\r\n");
-        _cur_task->tb.filedesc[2].fno->owner->ops.write(_cur_task->tb.filedesc[2].fno, segv_msg, strlen(segv_msg));
+        err->owner->ops.write(err, segv_msg, strlen(segv_msg));
     }
     task_terminate(_cur_task->tb.pid);
     return 0;
@@ -1456,6 +1916,12 @@ int __attribute__((naked)) sv_call_handler(uint32_t n, uint32_t arg1, uint32_t a
 
     _cur_task->tb.flags |= TASK_FLAG_IN_SYSCALL;
     call = sys_syscall_handlers[n];
+
+    /* Frame bookkeeping is done: the handler itself runs with interrupts
+     * enabled, preemptible by any ISR (SVC has the lowest priority
+     * but PendSV, so no other task can run in between).
+     */
+    irq_on();
     retval = call(arg1, arg2, arg3, *a4, *a5);
 
     /* Exec does not have a return value, and will use r0 as args for main()*/
@@ -1463,12 +1929,11 @@ int __attribute__((naked)) sv_call_handler(uint32_t n, uint32_t arg1, uint32_t a
         asm volatile ( "mov %0, r0" : "=r" 
             (*((uint32_t *)(_cur_task->tb.sp + EXTRA_FRAME_SIZE))) );
 
-    irq_on();
-
-
+    irq_off();
     if (_cur_task->tb.state != TASK_RUNNING) {
         task_switch();
     }
+    irq_on();
 
 return_from_syscall:
 
@@ -1481,7 +1946,7 @@ return_from_syscall:
         restore_kernel_context();
         runnable = RUN_KERNEL;
     } else {
-        mpu_task_on((void *)(((uint32_t)_cur_task->tb.cur_stack) - (sizeof(struct task_block) + F_MALLOC_OVERHEAD) ));
+        task_mpu_on(_cur_task);
         asm volatile ("msr "PSP", %0" :: "r" (_cur_task->tb.sp));
         asm volatile ("isb");
         asm volatile ("msr CONTROL, %0" :: "r" (0x01));
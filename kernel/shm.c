@@ -0,0 +1,267 @@
+/*
+ *      This file is part of frosted.
+ *
+ *      frosted is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License version 2, as
+ *      published by the Free Software Foundation.
+ *
+ *
+ *      frosted is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with frosted.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *      Authors: Daniele Lacamera, Maxime Vincent
+ *
+ */
+
+#include "frosted.h"
+#include "string.h"
+
+/* Shared memory segments.
+ *
+ * Segments are named in /dev/shm, and stay there until unlinked. They
+ * are sized with ftruncate(), and shared with mmap(MAP_SHARED).
+ *
+ * The contents live in kernel memory, which is not accessible from
+ * userspace: a task can only reach a segment it has mapped, through an
+ * MPU region programmed on each context switch. A region covers a
+ * power-of-two block aligned to its size, so segments are allocated
+ * that way, and their contents never move: a segment can only be
+ * resized within its allocation once it has one.
+ */
+
+#ifndef CONFIG_SHM_MAX_SIZE
+#   define CONFIG_SHM_MAX_SIZE 4096
+#endif
+#define SHM_MIN_SIZE 32
+
+struct shm_seg {
+    struct fnode *name;         /* In /dev/shm, until unlinked */
+    uint8_t *raw;               /* As allocated */
+    uint8_t *base;              /* Aligned to cap */
+    uint32_t size;
+    uint32_t cap;
+    uint16_t refs;              /* Open descriptors */
+};
+
+static struct module mod_shm;
+static struct fnode *shm_dir;
+
+static void shm_free(struct shm_seg *seg)
+{
+    kfree(seg->raw);
+    kfree(seg);
+}
+
+/* Allocates 2 * cap bytes, to find a block aligned to cap */
+static int shm_alloc(struct shm_seg *seg, uint32_t cap)
+{
+    uint8_t *raw = kalloc(2 * cap);
+    if (!raw)
+        return -ENOMEM;
+    seg->raw = raw;
+    seg->base = (uint8_t *)(((uint32_t)raw + cap - 1) & ~(cap - 1));
+    seg->cap = cap;
+    memset(seg->base, 0, cap);
+    return 0;
+}
+
+static int shm_truncate(struct fnode *fno, uint32_t size)
+{
+    struct shm_seg *seg = (struct shm_seg *)fno->priv;
+    uint32_t cap = SHM_MIN_SIZE;
+    int ret;
+
+    if (!seg)
+        return -EINVAL;
+    if (size > CONFIG_SHM_MAX_SIZE)
+        return -EFBIG;
+    while (cap < size)
+        cap <<= 1;
+    if (!seg->base && (size > 0)) {
+        ret = shm_alloc(seg, cap);
+        if (ret < 0)
+            return ret;
+    } else if (size > seg->cap) {
+        return -EBUSY;
+    }
+    /* Shrunk: what is cut off reads as zeros if it grows again */
+    if (size < seg->size)
+        memset(seg->base + size, 0, seg->size - size);
+    seg->size = size;
+    fno->size = size;
+    return 0;
+}
+
+static void *shm_mmap(struct fnode *fno, uint32_t off, uint32_t *len)
+{
+    struct shm_seg *seg = (struct shm_seg *)fno->priv;
+    if (!seg || !seg->base || (off >= seg->size))
+        return NULL;
+    *len = seg->size - off;
+    return seg->base + off;
+}
+
+static int shm_close(struct fnode *fno)
+{
+    struct shm_seg *seg = (struct shm_seg *)fno->priv;
+    if (!seg)
+        return -EINVAL;
+    if (fno->usage > 0)
+        return 0;
+    seg->refs--;
+    if (!seg->refs && !seg->name)
+        shm_free(seg);
+    kfree(fno);
+    return 0;
+}
+
+/* The name was removed: the segment goes away with the last descriptor */
+static int shm_unlink(struct fnode *fno)
+{
+    struct shm_seg *seg = (struct shm_seg *)fno->priv;
+    if (!seg)
+        return 0;
+    seg->name = NULL;
+    fno->priv = NULL;
+    if (!seg->refs)
+        shm_free(seg);
+    return 0;
+}
+
+/* Descriptors are not part of the tree: freed by shm_close() */
+static int shm_desc_add(struct shm_seg *seg, uint32_t oflag)
+{
+    struct fnode *fno;
+    int fd;
+
+    fno = kcalloc(sizeof(struct fnode), 1);
+    if (!fno)
+        return -ENOMEM;
+    fno->owner = &mod_shm;
+    fno->flags = FL_RDWR;
+    fno->priv = seg;
+    fno->size = seg->size;
+
+    fd = task_filedesc_add(fno);
+    if (fd < 0) {
+        kfree(fno);
+        return fd;
+    }
+    task_fd_setmask(fd, oflag & O_ACCMODE);
+    seg->refs++;
+    return fd;
+}
+
+/* Names are "/something", with no other slashes */
+static const char *shm_name(const char *name)
+{
+    const char *p;
+    if (name[0] == '/')
+        name++;
+    if ((name[0] == '\0') || (strlen(name) >= MAX_FILE))
+        return NULL;
+    for (p = name; *p; p++) {
+        if (*p == '/')
+            return NULL;
+    }
+    return name;
+}
+
+static struct fnode *shm_lookup(const char *name)
+{
+    struct fnode *fno;
+    for (fno = shm_dir->children; fno; fno = fno->next) {
+        if ((fno->owner == &mod_shm) && fno->priv && (strcmp(fno->fname, name) == 0))
+            return fno;
+    }
+    return NULL;
+}
+
+/* open("/dev/shm/name") works like shm_open() without O_CREAT */
+static int shm_open_name(const char *path, int flags)
+{
+    struct fnode *fno = fno_search(path);
+    if (!fno || (fno->owner != &mod_shm) || !fno->priv)
+        return -ENOENT;
+    return shm_desc_add((struct shm_seg *)fno->priv, flags);
+}
+
+/* shm_open(name, oflag, mode) */
+int sys_shm_open_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    const char *name = (const char *)arg1;
+    uint32_t oflag = arg2;
+    struct fnode *fno;
+    struct shm_seg *seg;
+    int fd;
+
+    if (!name || !shm_dir)
+        return -EINVAL;
+    name = shm_name(name);
+    if (!name)
+        return -EINVAL;
+
+    fno = shm_lookup(name);
+    if (fno) {
+        if ((oflag & O_CREAT) && (oflag & O_EXCL))
+            return -EEXIST;
+        seg = (struct shm_seg *)fno->priv;
+        fd = shm_desc_add(seg, oflag);
+        if ((fd >= 0) && (oflag & O_TRUNC) && ((oflag & O_ACCMODE) != O_RDONLY) && (seg->size > 0))
+            memset(seg->base, 0, seg->size);
+        return fd;
+    }
+
+    if (!(oflag & O_CREAT))
+        return -ENOENT;
+    seg = kcalloc(sizeof(struct shm_seg), 1);
+    if (!seg)
+        return -ENOMEM;
+    fno = fno_create(&mod_shm, name, shm_dir);
+    if (!fno) {
+        kfree(seg);
+        return -ENOMEM;
+    }
+    fno->priv = seg;
+    seg->name = fno;
+    fd = shm_desc_add(seg, oflag);
+    if (fd < 0)
+        fno_unlink(fno);
+    return fd;
+}
+
+int sys_shm_unlink_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    const char *name = (const char *)arg1;
+    struct fnode *fno;
+
+    if (!name || !shm_dir)
+        return -EINVAL;
+    name = shm_name(name);
+    if (!name)
+        return -EINVAL;
+    fno = shm_lookup(name);
+    if (!fno)
+        return -ENOENT;
+    fno_unlink(fno);
+    return 0;
+}
+
+void shm_init(void)
+{
+    mod_shm.family = FAMILY_FILE;
+    strcpy(mod_shm.name, "shm");
+    mod_shm.ops.open = shm_open_name;
+    mod_shm.ops.truncate = shm_truncate;
+    mod_shm.ops.mmap = shm_mmap;
+    mod_shm.ops.contents = shm_mmap;
+    mod_shm.ops.close = shm_close;
+    mod_shm.ops.unlink = shm_unlink;
+    register_module(&mod_shm);
+    shm_dir = fno_mkdir(NULL, "shm", fno_search("/dev"));
+}
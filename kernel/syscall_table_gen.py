@@ -81,7 +81,39 @@ syscalls = [
     ["getpeername", 2, "sys_getpeername_hdlr"],
     ["readlink", 3, "sys_readlink_hdlr"],
     ["fcntl", 3, "sys_fcntl_hdlr"],
-    ["setsid", 0, "sys_setsid_hdlr"]
+    ["setsid", 0, "sys_setsid_hdlr"],
+    ["pread", 4, "sys_pread_hdlr"],
+    ["pwrite", 4, "sys_pwrite_hdlr"],
+    ["readv", 3, "sys_readv_hdlr"],
+    ["writev", 3, "sys_writev_hdlr"],
+    ["sendfile", 4, "sys_sendfile_hdlr"],
+    ["splice", 5, "sys_splice_hdlr"],
+    ["mmap", 5, "sys_mmap_hdlr"],
+    ["munmap", 2, "sys_munmap_hdlr"],
+    ["fsync", 1, "sys_fsync_hdlr"],
+    ["ftruncate", 2, "sys_ftruncate_hdlr"],
+    ["getdents", 3, "sys_getdents_hdlr"],
+    ["epoll_create", 1, "sys_epoll_create_hdlr"],
+    ["epoll_ctl", 4, "sys_epoll_ctl_hdlr"],
+    ["epoll_wait", 4, "sys_epoll_wait_hdlr"],
+    ["aio_read", 1, "sys_aio_read_hdlr"],
+    ["aio_write", 1, "sys_aio_write_hdlr"],
+    ["aio_error", 1, "sys_aio_error_hdlr"],
+    ["aio_return", 1, "sys_aio_return_hdlr"],
+    ["aio_suspend", 3, "sys_aio_suspend_hdlr"],
+    ["mq_open", 4, "sys_mq_open_hdlr"],
+    ["mq_unlink", 1, "sys_mq_unlink_hdlr"],
+    ["mq_send", 4, "sys_mq_send_hdlr"],
+    ["mq_receive", 4, "sys_mq_receive_hdlr"],
+    ["mq_timedreceive", 5, "sys_mq_timedreceive_hdlr"],
+    ["mq_notify", 2, "sys_mq_notify_hdlr"],
+    ["mq_getattr", 2, "sys_mq_getattr_hdlr"],
+    ["shm_open", 3, "sys_shm_open_hdlr"],
+    ["shm_unlink", 1, "sys_shm_unlink_hdlr"],
+    ["futex", 4, "sys_futex_hdlr"],
+    ["sem_timedwait", 2, "sys_sem_timedwait_hdlr"],
+    ["mutex_timedlock", 2, "sys_mutex_timedlock_hdlr"],
+    ["eventfd", 2, "sys_eventfd_hdlr"]
 
 ]
 
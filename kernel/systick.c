@@ -29,9 +29,9 @@ static int _sched_active = 0;
 
 void frosted_scheduler_on(void)
 {
-    nvic_set_priority(NVIC_PENDSV_IRQ, 2);
-    nvic_set_priority(NVIC_SV_CALL_IRQ, 1);
-    nvic_set_priority(NVIC_SYSTICK_IRQ, 0);
+    nvic_set_priority(NVIC_PENDSV_IRQ, IRQ_PRIO_PENDSV);
+    nvic_set_priority(NVIC_SV_CALL_IRQ, IRQ_PRIO_SVC);
+    nvic_set_priority(NVIC_SYSTICK_IRQ, IRQ_PRIO_SYSTICK);
     nvic_enable_irq(NVIC_SYSTICK_IRQ);
     _sched_active = 1;
     systick_interrupt_enable();
@@ -139,6 +139,7 @@ void sys_tick_handler(void)
     uint32_t next_timer = 0;
     volatile uint32_t reload = systick_get_reload();
     uint32_t this_timeslice;
+    IRQPROF_ENTER();
     SysTick_Hook();
     jiffies+= clock_interval;
     _n_int++;
@@ -146,6 +147,7 @@ void sys_tick_handler(void)
     if (ktimer_expired()) {
         tasklet_add(ktimers_check_tasklet, NULL);
         task_preempt_all();
+        IRQPROF_EXIT();
         return;
     }
 
@@ -153,5 +155,6 @@ void sys_tick_handler(void)
         schedule();
         (void)next_timer;
     }
+    IRQPROF_EXIT();
 }
 
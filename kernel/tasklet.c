@@ -29,15 +29,50 @@ struct tasklet {
 struct tasklet *tasklet_list_head = NULL;
 struct tasklet *tasklet_list_tail = NULL;
 
+/* Tasklets are mostly queued from ISRs, which may preempt a syscall
+ * holding the allocator lock: use a preallocated pool first, and only
+ * fall back to the heap outside of interrupt context.
+ */
+#define TASKLET_POOL_SIZE 32
+static struct tasklet tasklet_pool[TASKLET_POOL_SIZE];
+static struct tasklet *tasklet_free = NULL;
+static int tasklet_pool_ready = 0;
+
+static int tasklet_in_pool(struct tasklet *t)
+{
+    return ((t >= tasklet_pool) && (t < tasklet_pool + TASKLET_POOL_SIZE));
+}
+
+/* Called with interrupts masked */
+static struct tasklet *tasklet_get(void)
+{
+    struct tasklet *t;
+    int i;
+    if (!tasklet_pool_ready) {
+        for (i = 0; i < TASKLET_POOL_SIZE; i++) {
+            tasklet_pool[i].next = tasklet_free;
+            tasklet_free = &tasklet_pool[i];
+        }
+        tasklet_pool_ready = 1;
+    }
+    t = tasklet_free;
+    if (t)
+        tasklet_free = t->next;
+    return t;
+}
 
 void tasklet_add(void (*exe)(void*), void *arg)
 {
     struct tasklet *t, *x;
-    irq_off();
-    t = kalloc(sizeof(struct tasklet));
-    x = tasklet_list_tail;
-    if  (!t)
+    uint32_t primask = irq_save();
+    t = tasklet_get();
+    if (!t && !in_irq())
+        t = kalloc(sizeof(struct tasklet));
+    if  (!t) {
+        irq_restore(primask);
         return;
+    }
+    x = tasklet_list_tail;
     t->exe = exe;
     t->arg = arg;
     t->next = NULL;
@@ -49,7 +84,7 @@ void tasklet_add(void (*exe)(void*), void *arg)
         tasklet_list_tail = t;
     }
     systick_counter_enable();
-    irq_on();
+    irq_restore(primask);
 }
 
 void check_tasklets(void)
@@ -66,7 +101,14 @@ void check_tasklets(void)
             t->exe(t->arg);
         }
         //memset(t, 0x0a, sizeof(struct tasklet)); /* For testing... */
-        kfree(t);
+        if (tasklet_in_pool(t)) {
+            irq_off();
+            t->next = tasklet_free;
+            tasklet_free = t;
+            irq_on();
+        } else {
+            kfree(t);
+        }
         t = n;
     }
 }
@@ -66,6 +66,14 @@ static char *filename(char *path)
 }
 
 static struct fnode *_fno_search(const char *path, struct fnode *dir, int follow);
+static struct fnode *_fno_create(struct module *owner, const char *name, struct fnode *parent);
+
+/* Lets the owner fill in the children of dir, if it reads them on demand */
+static inline void fno_lookup(struct fnode *dir)
+{
+    if (dir->owner && dir->owner->ops.lookup)
+        dir->owner->ops.lookup(dir);
+}
 
 static int _fno_fullpath(struct fnode *f, char *dst, char **p, int len)
 {
@@ -135,8 +143,12 @@ static int path_abs(char *src, char *dst, int len)
     return 0;
 }
 
-static struct fnode *fno_create_file(char *path)
+/* The node flags are set before the owner's creat() is called, so that
+ * filesystems can tell directories and links from regular files. If
+ * creat() refuses the node, its error is stored in 'err' (if not NULL). */
+static struct fnode *fno_create_file(char *path, uint32_t flags, int *err)
 {
+    int ret;
     char *base = kalloc(strlen(path) + 1);
     struct module *owner = NULL;
     struct fnode *parent;
@@ -153,10 +165,21 @@ static struct fnode *fno_create_file(char *path)
 
     if (parent) {
         owner = parent->owner;
+        fno_lookup(parent);
+    }
+    f = _fno_create(owner, filename(path), parent);
+    if (!f)
+        return NULL;
+    f->flags = flags;
+    if (owner && owner->ops.creat) {
+        ret = owner->ops.creat(f);
+        if (ret < 0) {
+            fno_unlink(f);
+            if (err)
+                *err = ret;
+            return NULL;
+        }
     }
-    f = fno_create(owner, filename(path), parent);
-    if (f)
-        f->flags = 0;
     return f;
 }
 
@@ -175,13 +198,12 @@ static struct fnode *fno_link(char *src, char *dst)
     if (!file)
         return NULL;
 
-    link = fno_create_file(p_dst);
+    link = fno_create_file(p_dst, FL_LINK, NULL);
     if (!link) 
         return NULL;
 
     file_name_len = strlen(p_src);
 
-    link->flags |= FL_LINK;
     link->linkname = kalloc(file_name_len + 1);
     if (!link->linkname) {
         fno_unlink(link);
@@ -215,100 +237,161 @@ static void mkdir_links(struct fnode *fno)
 
 }
 
-static struct fnode *fno_create_dir(char *path, uint32_t flags)
+static struct fnode *fno_create_dir(char *path, uint32_t flags, int *err)
 {
-    struct fnode *fno = fno_create_file(path);
-    if (fno) {
-        fno->flags |= (FL_DIR | flags);
-    }
-    mkdir_links(fno);
+    struct fnode *fno = fno_create_file(path, FL_DIR | flags, err);
+    if (fno)
+        mkdir_links(fno);
     return fno;
 }
 
 
-static const char *path_walk(const char *path)
-{
-    const char *p = path;
-
-    if (*p == '/') {
-        while(*p == '/')
-            p++;
-        return p;
-    }
+/* Dentry cache.
+ *
+ * Direct-mapped cache of (parent, name) -> fnode lookups. A NULL fno
+ * marks a negative entry (name known not to exist in parent). Entries are
+ * invalidated when a node with the same name is created in the parent,
+ * and when the node (or its parent) is unlinked.
+ */
+#define DCACHE_SIZE     64      /* Power of two */
+#define DCACHE_NAME_LEN 16
+#define VFS_MAX_LINKS   8
 
-    while ((*p != '\0') && (*p != '/'))
-        p++;
+struct dentry {
+    struct fnode *parent;
+    struct fnode *fno;
+    uint32_t hash;
+    char name[DCACHE_NAME_LEN];
+};
 
-    if (*p == '/')
-        p++;
+static struct dentry dcache[DCACHE_SIZE];
 
-    if (*p == '\0')
-        return NULL;
+static uint32_t dcache_hash(const char *name, int len)
+{
+    uint32_t h = 5381;
+    int i;
+    for (i = 0; i < len; i++)
+        h = ((h << 5) + h) ^ (uint8_t)name[i];
+    return h;
+}
 
-    return p;
+static struct dentry *dcache_slot(struct fnode *parent, uint32_t hash)
+{
+    return &dcache[(hash ^ ((uint32_t)parent >> 4)) & (DCACHE_SIZE - 1)];
 }
 
+/* Returns 1 on hit (*fno set, possibly NULL for negative entries) */
+static int dcache_lookup(struct fnode *parent, const char *name, int len, uint32_t hash, struct fnode **fno)
+{
+    struct dentry *d = dcache_slot(parent, hash);
+    if ((d->parent != parent) || (d->hash != hash) || (len >= DCACHE_NAME_LEN))
+        return 0;
+    if ((strncmp(d->name, name, len) != 0) || (d->name[len] != '\0'))
+        return 0;
+    *fno = d->fno;
+    return 1;
+}
 
-/* Returns: 
- * 0 = if path does not match
- * 1 = if path is in the right dir, need to walk more
- * 2 = if path is found!
- */
+static void dcache_insert(struct fnode *parent, const char *name, int len, uint32_t hash, struct fnode *fno)
+{
+    struct dentry *d = dcache_slot(parent, hash);
+    if (len >= DCACHE_NAME_LEN)
+        return;
+    d->parent = parent;
+    d->fno = fno;
+    d->hash = hash;
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+}
 
-static int path_check(const char *path, const char *dirname)
+static void dcache_invalidate_name(struct fnode *parent, const char *name)
 {
+    int len = strlen(name);
+    struct dentry *d = dcache_slot(parent, dcache_hash(name, len));
+    if (d->parent == parent)
+        d->parent = NULL;
+}
 
-    int i = 0;
-    for (i = 0; dirname[i]; i++) {
-        if (path[i] != dirname[i])
-            return 0;
+static void dcache_invalidate_fno(struct fnode *fno)
+{
+    int i;
+    for (i = 0; i < DCACHE_SIZE; i++) {
+        if ((dcache[i].parent == fno) || (dcache[i].fno == fno))
+            dcache[i].parent = NULL;
     }
+}
 
-    if (path[i] == '\0')
-        return 2;
+/* Newest node wins in case of duplicate names, as children are
+ * prepended to the list. */
+static struct fnode *fno_child(struct fnode *dir, const char *name, int len)
+{
+    struct fnode *cur;
+    uint32_t hash = dcache_hash(name, len);
 
-    if (path[i] == '/')
-        return 1;
+    fno_lookup(dir);
 
-    if (i > 0 && (path[i - 1] == '/' && dirname[i - 1] == '/'))
-        return 1;
+    if (dcache_lookup(dir, name, len, hash, &cur))
+        return cur;
 
-    return 0;
+    cur = dir->children;
+    while (cur) {
+        if ((strncmp(cur->fname, name, len) == 0) && (cur->fname[len] == '\0'))
+            break;
+        cur = cur->next;
+    }
+    dcache_insert(dir, name, len, hash, cur);
+    return cur;
 }
 
-
-static struct fnode *_fno_search(const char *path, struct fnode *dir, int follow)
+/* 'depth' counts the links followed during the whole resolution,
+ * including the nested ones */
+static struct fnode *_fno_search_depth(const char *path, struct fnode *dir, int follow, int *depth)
 {
-    struct fnode *cur;
-    char link[MAX_FILE];
-    int check = 0;
-    if (dir == NULL) 
-        return NULL;
+    struct fnode *cur = dir;
+    const char *end;
 
-    check = path_check(path, dir->fname);
+    if (!path || !dir || (path[0] != '/'))
+        return NULL;
 
-    /* Does not match, try another item */
-    if (check == 0)
-        return _fno_search(path, dir->next, follow);
+    while (1) {
+        while (*path == '/')
+            path++;
+        if (*path == '\0')
+            break;
 
-    /* Item is found! */
-    if (check == 2) {
-        /* If it's a symlink, restart check */
-        if (follow && ((dir->flags & FL_LINK) == FL_LINK)) {
-            return _fno_search(dir->linkname, &FNO_ROOT, 1);
+        /* passing through a symlink */
+        while ((cur->flags & FL_LINK) == FL_LINK) {
+            if (++(*depth) > VFS_MAX_LINKS)
+                return NULL;
+            cur = _fno_search_depth(cur->linkname, &FNO_ROOT, 0, depth);
+            if (!cur)
+                return NULL;
         }
-        return dir;
+
+        end = path;
+        while ((*end != '\0') && (*end != '/'))
+            end++;
+        cur = fno_child(cur, path, end - path);
+        if (!cur)
+            return NULL;
+        path = end;
     }
 
-    /* path is correct, need to walk more */
-    if( (dir->flags & FL_LINK ) == FL_LINK ){
-    /* passing through a symlink */
-        strcpy( link, dir->linkname );
-        strcat( link, "/" );
-        strcat( link, path_walk(path));
-        return _fno_search( link, &FNO_ROOT, follow );
+    /* If it's a symlink, restart check */
+    while (follow && ((cur->flags & FL_LINK) == FL_LINK)) {
+        if (++(*depth) > VFS_MAX_LINKS)
+            return NULL;
+        cur = _fno_search_depth(cur->linkname, &FNO_ROOT, 0, depth);
+        if (!cur)
+            return NULL;
     }
-    return _fno_search(path_walk(path), dir->children, follow);
+    return cur;
+}
+
+static struct fnode *_fno_search(const char *path, struct fnode *dir, int follow)
+{
+    int depth = 0;
+    return _fno_search_depth(path, dir, follow, &depth);
 }
 
 struct fnode *fno_search(const char *path)
@@ -342,6 +425,7 @@ static struct fnode *_fno_create(struct module *owner, const char *name, struct
     fno->parent = parent;
     fno->next = fno->parent->children;
     fno->parent->children = fno;
+    dcache_invalidate_name(parent, fno->fname);
 
     fno->children = NULL;
     fno->owner = owner;
@@ -385,20 +469,60 @@ struct fnode *fno_mkdir(struct module *owner, const char *name, struct fnode *pa
     return fno;
 }
 
-void fno_unlink(struct fnode *fno)
+/* Looks up 'path', relative to the working directory if needed */
+struct fnode *vfs_search(const char *path)
+{
+    char abs_p[MAX_FILE];
+    path_abs((char *)path, abs_p, MAX_FILE);
+    return fno_search(abs_p);
+}
+
+/* Creates a special node (e.g. a bound UNIX socket) at 'path'. The node
+ * belongs to 'owner', not to the filesystem of its directory. */
+int vfs_mknod(struct module *owner, const char *path, uint32_t flags, struct fnode **fno)
+{
+    char abs_p[MAX_FILE];
+    char *base;
+    struct fnode *parent;
+
+    path_abs((char *)path, abs_p, MAX_FILE);
+    if (fno_search_nofollow(abs_p))
+        return -EEXIST;
+    base = kalloc(strlen(abs_p) + 1);
+    if (!base)
+        return -ENOMEM;
+    basename_r(abs_p, base);
+    parent = fno_search(base);
+    kfree(base);
+    if (!parent)
+        return -ENOENT;
+    if ((parent->flags & FL_DIR) == 0)
+        return -ENOTDIR;
+    *fno = _fno_create(owner, filename(abs_p), parent);
+    if (!*fno)
+        return -ENOMEM;
+    (*fno)->flags = flags;
+    return 0;
+}
+
+/* The owner can refuse to remove a directory that is not empty */
+int fno_unlink(struct fnode *fno)
 {
     struct fnode *dir;
 
     if (!fno)
-        return;
+        return -ENOENT;
     dir = fno->parent;
 
-    if (fno && fno->owner && fno->owner->ops.unlink)
-        fno->owner->ops.unlink(fno);
+    if (fno && fno->owner && fno->owner->ops.unlink) {
+        if (fno->owner->ops.unlink(fno) == -ENOTEMPTY)
+            return -ENOTEMPTY;
+    }
 
-    if (!fno)
-        return;
+    if (fno->epitems)
+        epoll_forget(fno);
 
+    dcache_invalidate_fno(fno);
     if (dir) {
         struct fnode *child = dir->children;
         while (child) {
@@ -417,6 +541,7 @@ void fno_unlink(struct fnode *fno)
 
     kfree(fno->fname);
     kfree(fno);
+    return 0;
 }
 
 int sys_readlink_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
@@ -462,7 +587,7 @@ int sys_open_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, ui
     struct fnode *f;
     uint32_t flags = arg2;
     char path[MAX_FILE];
-    int ret;
+    int ret, err = -ENOENT;
 
     path_abs(rel_path, path, MAX_FILE);
     f = fno_search(path);
@@ -493,48 +618,75 @@ int sys_open_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, ui
 
         }
         if (!f)
-            f = fno_create_file(path);
+            f = fno_create_file(path, 0, &err);
 
         /* TODO: Parse arg3 & 0x1c0 for permissions */
         if (f)
             f->flags |= FL_RDWR;
     }
     if (f == NULL)
-       return -ENOENT; 
+       return err; 
     if (f->flags & FL_INUSE)
         return -EBUSY;
     if (f->flags & FL_DIR)
         return -EISDIR;
-    if (flags & O_APPEND) {
-        f->off = f->size;
-    } else {
-        f->off = 0;
-    }
     ret = task_filedesc_add(f);
+    if (ret < 0)
+        return ret;
     task_fd_setmask(ret, flags);
+    if (flags & O_APPEND)
+        task_file_get(ret)->off = f->size;
     return ret; 
 }
 
+/* The module close() operation is called by the scheduler when the last
+ * descriptor referring to the open file goes away. */
 int sys_close_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
 {
-    struct fnode *f = task_filedesc_get(arg1);
-    if (f != NULL) {
-        if (f->owner && f->owner->ops.close)
-            f->owner->ops.close(f);
-        task_filedesc_del(arg1);
+    if (task_filedesc_del(arg1) == 0)
         return 0;
-    }
     return -EINVAL; 
 }
     
 int sys_seek_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct file *f = task_file_get(arg1);
+    struct fnode *fno;
+    int ret;
+    if (!f)
+        return -EINVAL;
+    fno = f->fno;
+    if (fno->owner && fno->owner->ops.seek) {
+        ret = fno->owner->ops.seek(file_enter(f), arg2, arg3);
+        file_leave(f);
+        return ret;
+    } else return -EOPNOTSUPP;
+}
+
+/* Flushes cached data to the device. Files with no backing store have
+ * nothing to do. */
+int sys_fsync_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct fnode *fno = task_filedesc_get(arg1);
+    if (!fno)
+        return -EBADF;
+    if (fno->owner && fno->owner->ops.fsync)
+        return fno->owner->ops.fsync(fno);
+    return 0;
+}
+
+int sys_ftruncate_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
 {
     struct fnode *fno = task_filedesc_get(arg1);
     if (!fno)
+        return -EBADF;
+    if ((int)arg2 < 0)
         return -EINVAL;
-    if (fno->owner->ops.seek) {
-        return fno->owner->ops.seek(fno, arg2, arg3);
-    } else return -EOPNOTSUPP;
+    if (fno->flags & FL_DIR)
+        return -EISDIR;
+    if (!fno->owner || !fno->owner->ops.truncate)
+        return -EINVAL;
+    return fno->owner->ops.truncate(fno, arg2);
 }
 
 int sys_ioctl_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
@@ -561,10 +713,11 @@ int sys_mkdir_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, u
     char *path = (char *)arg1;
     char abs_p[MAX_FILE];
     struct fnode *f;
+    int err = -ENOENT;
     path_abs(path, abs_p, MAX_FILE);
-    if (fno_create_dir(abs_p, arg2))
+    if (fno_create_dir(abs_p, arg2, &err))
         return 0;
-    return -ENOENT;
+    return err;
 }
 
 int sys_unlink_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
@@ -574,23 +727,25 @@ int sys_unlink_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
     struct fnode *f;
     path_abs(path, abs_p, MAX_FILE);
     f = fno_search_nofollow(abs_p); /* Don't follow symlink */
-    if (f) {
-        fno_unlink(f);
-        return 0;
-    }
+    if (f)
+        return fno_unlink(f);
     return -ENOENT;
 }
 
+/* The DIR handle returned to userspace is the open file description
+ * itself. It is bound to a (hidden) descriptor, so it is released on
+ * exit, and its offset is the index of the next entry to read.
+ */
 int sys_opendir_hdlr(uint32_t arg1)
 {
     struct fnode *fno = fno_search((char *)arg1);
+    int fd;
     if (fno && (fno->flags & FL_DIR)) {
-        if (fno->flags & FL_INUSE)
-            return (int)NULL; /* XXX EBUSY */
-        /* Use .off to store current readdir ptr */
-        fno->off = (int)fno->children;
-        fno->flags |= FL_INUSE;
-        return (int)fno;
+        fd = task_filedesc_add(fno);
+        if (fd < 0)
+            return (int)NULL;
+        task_fd_setmask(fd, O_RDONLY);
+        return (int)task_file_get(fd);
     } else {
         return (int)NULL;
     }
@@ -598,26 +753,103 @@ int sys_opendir_hdlr(uint32_t arg1)
 
 int sys_readdir_hdlr(uint32_t arg1, uint32_t arg2)
 {
-    struct fnode *fno = (struct fnode *)arg1;
-    struct fnode *next = (struct fnode *)fno->off;
+    struct file *f = (struct file *)arg1;
     struct dirent *ep = (struct dirent *)arg2;
-    if (!fno || !ep)
+    struct fnode *next;
+    uint32_t i;
+    if (!ep || (task_file_fd(f) < 0))
         return -ENOENT;
+    fno_lookup(f->fno);
+    next = f->fno->children;
+    for (i = 0; next && (i < f->off); i++)
+        next = next->next;
     if (!next) {
         return -1;
     }
-    fno->off = (int)next->next;
+    f->off++;
     ep->d_ino = 0; /* TODO: populate with inode? */
     strncpy(ep->d_name, next->fname, 256);
     return 0;
 }
 
+/* Appends a getdents record to buf. Returns its length, or 0 if it
+ * does not fit in len bytes. */
+int vfs_dirent(void *buf, int len, const char *name, uint8_t type, uint32_t size)
+{
+    struct dirent_ext *ep = (struct dirent_ext *)buf;
+    int nlen = strlen(name);
+    int reclen = (sizeof(struct dirent_ext) + nlen + 1 + 3) & ~3;
+    if (reclen > len)
+        return 0;
+    ep->d_ino = 0;
+    ep->d_size = size;
+    ep->d_reclen = reclen;
+    ep->d_type = type;
+    memcpy(ep->d_name, name, nlen + 1);
+    return reclen;
+}
+
+static uint8_t fno_dtype(struct fnode *fno)
+{
+    if (fno->flags & FL_DIR)
+        return DT_DIR;
+    if (fno->flags & FL_LINK)
+        return DT_LNK;
+    if (fno->flags & FL_BLK)
+        return DT_BLK;
+    if (fno->flags & FL_TTY)
+        return DT_CHR;
+    if (fno->flags & FL_SOCK)
+        return DT_SOCK;
+    return DT_REG;
+}
+
+/* Fills the buffer with as many entries of the directory open as fd as
+ * fit, from the current offset on. Returns the number of bytes filled,
+ * 0 at the end of the directory. */
+int sys_getdents_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5)
+{
+    struct file *f = task_file_get(arg1);
+    uint8_t *buf = (uint8_t *)arg2;
+    int len = (int)arg3;
+    struct fnode *dir, *next;
+    uint32_t i;
+    int w, tot = 0;
+
+    if (!f || !f->fno)
+        return -EBADF;
+    dir = f->fno;
+    if (!(dir->flags & FL_DIR))
+        return -ENOTDIR;
+    if (!buf || (len <= 0))
+        return -EINVAL;
+    if (dir->owner && dir->owner->ops.readdir)
+        return dir->owner->ops.readdir(dir, &f->off, buf, len);
+
+    fno_lookup(dir);
+    next = dir->children;
+    for (i = 0; next && (i < f->off); i++)
+        next = next->next;
+    while (next) {
+        w = vfs_dirent(buf + tot, len - tot, next->fname, fno_dtype(next),
+                (next->flags & FL_DIR) ? 0 : next->size);
+        if (w == 0)
+            break;
+        tot += w;
+        f->off++;
+        next = next->next;
+    }
+    if (next && (tot == 0))
+        return -EINVAL; /* Buffer too small for a single entry */
+    return tot;
+}
+
 int sys_closedir_hdlr(uint32_t arg1)
 {
-    struct fnode *fno = (struct fnode *)arg1;
-    fno->off = 0;
-    fno->flags &= ~(FL_INUSE);
-    return 0;
+    int fd = task_file_fd((struct file *)arg1);
+    if (fd < 0)
+        return -EINVAL;
+    return task_filedesc_del(fd);
 }
 
 
@@ -745,6 +977,11 @@ void __attribute__((weak)) devnull_init(struct fnode *dev)
 
 }
 
+void __attribute__((weak)) ramdisk_init(struct fnode *dev)
+{
+
+}
+
 void __attribute__((weak)) memfs_init(void)
 {
 
@@ -765,6 +1002,11 @@ void __attribute__((weak)) fatfs_init(void)
 
 }
 
+void __attribute__((weak)) bcache_init(void)
+{
+
+}
+
 void __attribute__((weak)) devgpio_init(struct fnode *dev)
 {
 
@@ -863,6 +1105,8 @@ int sys_fcntl_hdlr(uint32_t arg1, uint32_t arg2, uint32_t arg3)
         f->flags |= fl_set;
     } else if (cmd == F_GETFL) {
         return f->flags;
+    } else if (f->owner && f->owner->ops.fcntl) {
+        return f->owner->ops.fcntl(f, cmd, fl_set);
     }
     return 0;
 }
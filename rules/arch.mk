@@ -27,12 +27,14 @@ CFLAGS+=-mthumb -mlittle-endian -mthumb-interwork
 CFLAGS+=-DCORE_M3 -DBOARD_$(BOARD) -D$(ARCH)
 CFLAGS+=-DCONFIG_KMEM_SIZE=$(KMEM_SIZE)
 CFLAGS+=-DCONFIG_TASK_STACK_SIZE=$(TASK_STACK_SIZE)
+CFLAGS+=-DCONFIG_PIPE_BUFSIZE=$(PIPE_BUFSIZE)
 
 # KERNEL DEBUG
 CFLAGS-$(KLOG)+=-DCONFIG_KLOG
 CFLAGS+=-DCONFIG_KLOG_SIZE=$(KLOG_SIZE)
 CFLAGS-$(HARDFAULT_DBG)+=-DCONFIG_HARDFAULT_DBG
 CFLAGS-$(STRACE)+=-DCONFIG_SYSCALL_TRACE
+CFLAGS-$(IRQ_PROFILE)+=-DCONFIG_IRQ_PROFILE
 
 CFLAGS+=$(CFLAGS-y)
 #Include paths